@@ -0,0 +1,146 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#include <iostream>
+#include <stdexcept>
+#include <memory>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <gnuplotpp/gnuplotpp.hpp>
+
+// ================================================================
+//                     ALLOCATION COUNTING
+// ================================================================
+
+// every allocation of the program passes from here, they are counted
+// only while counting is true
+
+namespace
+{
+	std::atomic<bool> counting = false;
+	std::atomic<size_t> allocations = 0;
+
+	void* allocate(std::size_t size, std::size_t alignment)
+	{
+		if (counting)
+			allocations++;
+
+		size = size ? size : 1;
+		void* p = (alignment > alignof(std::max_align_t)) ?
+			std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) :
+			std::malloc(size);
+
+		if (!p)
+			throw std::bad_alloc();
+		return p;
+	}
+}
+
+void* operator new(std::size_t size) { return allocate(size, 0); }
+void* operator new[](std::size_t size) { return allocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+namespace
+{
+	int safe_main(int argc, char** argv);
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		return safe_main(argc, argv);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Uncaught Exception thrown from safe_main(): " << e.what() << std::endl;
+	}
+	catch (...)
+	{
+		std::cerr << "Uncaught Unknown Exception thrown from safe_main()" << std::endl;
+	}
+	return EXIT_FAILURE;
+}
+
+// ================================================================
+//                          EXECUTION
+// ================================================================
+
+namespace
+{
+	// the commands are discarded, only the allocations of Gnuplotpp matter
+	class NullBuf : public std::streambuf
+	{
+	protected:
+		int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+		std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+	};
+
+	constexpr size_t warmupFrames = 10;
+	constexpr size_t frames = 100;
+
+	int safe_main(int, char**)
+	{
+		using namespace lc;
+
+		NullBuf buffer;
+		auto pStream = std::make_shared<std::ostream>(&buffer);
+		Gnuplotpp gp(pStream);
+
+		std::vector<double> x(1000), y(1000);
+		for (size_t i = 0; i < x.size(); i++)
+			x[i] = i, y[i] = 0;
+
+		auto p = Gnuplotpp::plot(x, y, { .lineStyle = Gnuplotpp::LineStyle{} });
+		auto e = Gnuplotpp::errorbar({ .y = y, .x = x, .yErr = { 0.1 }, .xErr = { 0.2 } });
+
+		// only the values change, not the structure of the frame
+		auto update = [&](size_t frame)
+		{
+			for (size_t i = 0; i < p.yData.size(); i++)
+			{
+				p.yData[i] = double(frame + i);
+				e.y[i] = double(frame * i);
+			}
+		};
+
+		for (size_t k = 0; k < warmupFrames; k++)
+		{
+			update(k);
+			gp.draw({ p, e });
+		}
+
+		counting = true;
+		for (size_t k = 0; k < frames; k++)
+		{
+			update(warmupFrames + k);
+			gp.draw({ p, e });
+		}
+		counting = false;
+
+		std::cout << allocations << " allocations in " << frames << " frames" << std::endl;
+
+		return allocations == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+}
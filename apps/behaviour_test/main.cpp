@@ -0,0 +1,386 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+
+#include <gnuplotpp/gnuplotpp.hpp>
+
+namespace
+{
+	int safe_main(int argc, char** argv);
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		return safe_main(argc, argv);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Uncaught Exception thrown from safe_main(): " << e.what() << std::endl;
+	}
+	catch (...)
+	{
+		std::cerr << "Uncaught Unknown Exception thrown from safe_main()" << std::endl;
+	}
+	return EXIT_FAILURE;
+}
+
+// ================================================================
+//                           CHECKS
+// ================================================================
+
+// every check compares what the library computes with a known answer
+
+namespace
+{
+	using namespace lc;
+
+	size_t failures = 0;
+
+	void expect(bool condition, std::string_view what)
+	{
+		if (condition)
+			return;
+
+		std::cout << "  failed: " << what << std::endl;
+		failures++;
+	}
+
+	// ================================
+	//            CONTOUR
+	// ================================
+
+	// the segment of a line with two points, in any direction
+	bool isSegment(const Gnuplotpp::Contour::Line& line, double x0, double y0, double x1, double y1)
+	{
+		constexpr double eps = 1e-12;
+		auto at = [&](size_t k, double x, double y) { return std::abs(line.x[k] - x) < eps && std::abs(line.y[k] - y) < eps; };
+
+		return line.x.size() == 2 && ((at(0, x0, y0) && at(1, x1, y1)) || (at(0, x1, y1) && at(1, x0, y0)));
+	}
+
+	void checkContour(void)
+	{
+		// the distance from the center: every level is a closed circle
+		constexpr size_t N = 101;
+		std::vector<double> distance(N * N);
+		for (size_t i = 0; i < N; i++)
+			for (size_t j = 0; j < N; j++)
+				distance[i * N + j] = std::hypot(double(i) - 50, double(j) - 50);
+
+		const Gnuplotpp::Contour circles(Gnuplotpp::MatrixView<double>{ distance.data(), N, N }, { .levels = { 30, 10, 20.5 } });
+
+		expect(circles.levels == std::vector<double>{ 10, 20.5, 30 }, "the levels are sorted");
+		expect(circles.lines.size() == 3, "a single line for each circle");
+		for (const auto& line : circles.lines)
+		{
+			expect(line.x.size() > 8 && line.x.front() == line.x.back() && line.y.front() == line.y.back(), "the circles are closed");
+
+			// linear interpolation of the distance along an edge
+			double error = 0;
+			for (size_t k = 0; k < line.x.size(); k++)
+				error = std::max(error, std::abs(std::hypot(line.x[k] - 50, line.y[k] - 50) - line.level));
+			expect(error < 0.02, "the points are on the circles");
+		}
+
+		// a saddle, the high corners are (0, 0) and (1, 1)
+		const double saddle[4] = { 1, 0, 0, 1 };
+		const Gnuplotpp::MatrixView<double> cell{ saddle, 2, 2 };
+
+		// the center (0.5) is above 0.4: the high corners are joined
+		const Gnuplotpp::Contour low(cell, { .levels = { 0.4 } });
+		expect(low.lines.size() == 2, "two lines in a saddle (low level)");
+		if (low.lines.size() == 2)
+		{
+			const bool first = isSegment(low.lines[0], 0.6, 0, 1, 0.4) && isSegment(low.lines[1], 0.4, 1, 0, 0.6);
+			const bool second = isSegment(low.lines[1], 0.6, 0, 1, 0.4) && isSegment(low.lines[0], 0.4, 1, 0, 0.6);
+			expect(first || second, "the lines cut the low corners off");
+		}
+
+		// the center is below 0.6: the low corners are joined
+		const Gnuplotpp::Contour high(cell, { .levels = { 0.6 } });
+		expect(high.lines.size() == 2, "two lines in a saddle (high level)");
+		if (high.lines.size() == 2)
+		{
+			const bool first = isSegment(high.lines[0], 0, 0.4, 0.4, 0) && isSegment(high.lines[1], 1, 0.6, 0.6, 1);
+			const bool second = isSegment(high.lines[1], 0, 0.4, 0.4, 0) && isSegment(high.lines[0], 1, 0.6, 0.6, 1);
+			expect(first || second, "the lines cut the high corners off");
+		}
+	}
+
+	// ================================
+	//          P-SQUARE SKETCH
+	// ================================
+
+	void checkP2(void)
+	{
+		// 1, 2, ..., 10001 in random order, the quantile p is 1 + 10000 p
+		constexpr size_t N = 10001;
+		std::vector<double> values(N);
+		for (size_t k = 0; k < N; k++)
+			values[k] = double(k + 1);
+		std::shuffle(values.begin(), values.end(), std::mt19937(42));
+
+		Gnuplotpp::Ensemble ensemble({ 0 });
+		for (const double v : values)
+			ensemble.add({ &v, 1 });
+		const double nan = std::numeric_limits<double>::quiet_NaN();
+		ensemble.add({ &nan, 1 });
+
+		expect(ensemble.count[0] == N, "the NaN values are skipped");
+		expect(ensemble.min[0] == 1 && ensemble.max[0] == N, "exact minimum and maximum");
+		expect(std::abs(ensemble.mean[0] - 5001) < 1e-9, "exact mean");
+
+		for (size_t k = 0; k < ensemble.probabilities.size(); k++)
+		{
+			const double expected = 1 + 10000 * ensemble.probabilities[k];
+			expect(std::abs(ensemble.quantiles[k][0] - expected) < 50, "the quantiles are within 0.5% of the range");
+		}
+	}
+
+	// ================================
+	//           HISTOGRAM
+	// ================================
+
+	// gives access to the bins
+	class HistogramBins : public Gnuplotpp::Histogram
+	{
+	public:
+		using Gnuplotpp::Histogram::Histogram;
+
+		std::vector<double> counts(void) const
+		{
+			Gnuplotpp::DataBuffer buffer;
+			this->getData(buffer);
+
+			std::vector<double> counts;
+			for (size_t k = 0; k < buffer.rows(); k++)
+				counts.push_back(buffer.at(k, 1));
+			return counts;
+		}
+	};
+
+	// Every edge, the value before it and the values just outside the range:
+	// each bin gets its left edge and the value before its right edge, the last
+	// one also gets the last edge
+	std::vector<double> edgeSamples(const std::vector<double>& edges)
+	{
+		constexpr double inf = std::numeric_limits<double>::infinity();
+
+		std::vector<double> samples = { std::nextafter(edges.front(), -inf), std::nextafter(edges.back(), inf) };
+		for (size_t k = 0; k < edges.size(); k++)
+		{
+			samples.push_back(edges[k]);
+			if (k > 0)
+				samples.push_back(std::nextafter(edges[k], -inf));
+		}
+		return samples;
+	}
+
+	void checkHistogram(const HistogramBins& histogram, size_t bins, std::string_view what)
+	{
+		std::vector<double> expected(bins, 2);
+		expected.back() = 3;
+		expect(histogram.counts() == expected, what);
+	}
+
+	void checkHistogram(void)
+	{
+		// the edges computed as Histogram does
+		std::vector<double> linear(7), logarithmic(4);
+		for (size_t k = 0; k < linear.size(); k++)
+			linear[k] = 0.1 + (0.7 - 0.1) * (double(k) / 6);
+		for (size_t k = 0; k < logarithmic.size(); k++)
+			logarithmic[k] = 1 * std::pow(1000.0 / 1, double(k) / 3);
+
+		std::vector<double> samples = edgeSamples(linear);
+		HistogramBins histogram(samples);
+		histogram.bins = 6;
+		histogram.range = Vector2d(0.1, 0.7);
+		checkHistogram(histogram, 6, "the samples on the edges of linear bins");
+
+		// the range of the samples
+		samples.erase(samples.begin(), samples.begin() + 2);
+		histogram.samples = samples;
+		histogram.range = {};
+		checkHistogram(histogram, 6, "the samples on the edges of the default range");
+
+		samples = edgeSamples(logarithmic);
+		histogram.samples = samples;
+		histogram.bins = 3;
+		histogram.range = Vector2d(1, 1000);
+		histogram.logWidth = true;
+		checkHistogram(histogram, 3, "the samples on the edges of logarithmic bins");
+
+		histogram.edges = { -1, 0.25, 2.5, 10 };
+		samples = edgeSamples(histogram.edges);
+		histogram.samples = samples;
+		checkHistogram(histogram, 3, "the samples on explicit edges");
+	}
+
+	// ================================
+	//              KDE
+	// ================================
+
+	double integral(const Gnuplotpp::Kde& kde)
+	{
+		double sum = 0;
+		for (size_t k = 1; k < kde.xData.size(); k++)
+			sum += (kde.xData[k] - kde.xData[k - 1]) * (kde.yData[k] + kde.yData[k - 1]) / 2;
+		return sum;
+	}
+
+	void checkKde(void)
+	{
+		std::mt19937 generator(7);
+		std::normal_distribution<double> normal;
+
+		std::vector<double> samples(10000);
+		for (auto& v : samples)
+			v = normal(generator);
+
+		const Gnuplotpp::Kde kde(samples);
+		expect(std::abs(integral(kde) - 1) < 1e-3, "the density of normal samples integrates to 1");
+
+		// Silverman's rule of thumb for 10000 normal samples
+		expect(std::abs(kde.bandwidth - 0.9 * std::pow(10000.0, -0.2)) < 0.02, "the default bandwidth");
+
+		// the peak of the standard normal density
+		const double peak = *std::max_element(kde.yData.begin(), kde.yData.end());
+		expect(std::abs(peak - 1 / std::sqrt(2 * 3.14159265358979)) < 0.02, "the peak of the density");
+
+		// two far modes, a narrow kernel and some values to ignore
+		for (size_t k = 0; k < samples.size(); k++)
+			samples[k] = (k % 2 ? 100 : -100) + normal(generator);
+		samples[0] = std::numeric_limits<double>::quiet_NaN();
+		samples[1] = std::numeric_limits<double>::infinity();
+
+		const Gnuplotpp::Kde bimodal(samples, { .bandwidth = 0.2, .points = 4096 });
+		expect(std::abs(integral(bimodal) - 1) < 1e-3, "the density of two modes integrates to 1");
+	}
+
+	// ================================
+	//              OHLC
+	// ================================
+
+	bool equal(const std::vector<Gnuplotpp::Ohlc::Candle>& a, const std::vector<Gnuplotpp::Ohlc::Candle>& b)
+	{
+		return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const auto& x, const auto& y)
+			{
+				return x.time == y.time && x.open == y.open && x.high == y.high && x.low == y.low && x.close == y.close && x.ticks == y.ticks;
+			}
+		);
+	}
+
+	void checkOhlc(void)
+	{
+		// enough ticks for multiple tasks, the candles across them are merged
+		constexpr size_t N = 1000000;
+		constexpr double interval = 1000;
+
+		std::vector<double> time(N), price(N);
+		for (size_t k = 0; k < N; k++)
+		{
+			time[k] = double(k);
+			price[k] = (k % 1013 == 0) ? std::numeric_limits<double>::quiet_NaN() : 100 * std::sin(k * 0.01) + double(k % 7);
+		}
+
+		// the candles computed one tick at a time
+		std::vector<Gnuplotpp::Ohlc::Candle> expected;
+		for (size_t k = 0; k < N; k++)
+		{
+			if (std::isnan(price[k]))
+				continue;
+
+			const double start = std::floor(time[k] / interval) * interval;
+			if (expected.empty() || expected.back().time != start)
+			{
+				expected.push_back({ start, price[k], price[k], price[k], price[k], 1 });
+				continue;
+			}
+
+			auto& candle = expected.back();
+			candle.high = std::max(candle.high, price[k]);
+			candle.low = std::min(candle.low, price[k]);
+			candle.close = price[k];
+			candle.ticks++;
+		}
+
+		Gnuplotpp::Ohlc ohlc;
+
+		// 999999 / 160 rounded up to 1, 2 or 5 times a power of 10
+		ohlc.aggregate(time, price);
+		expect(ohlc.usedInterval() == 10000 && ohlc.candles.size() == 100, "the default interval");
+
+		ohlc.interval = interval;
+		ohlc.aggregate(time, price);
+		expect(equal(ohlc.candles, expected), "the candles of the ticks");
+
+		// live ticks update the last candle, then start a new one
+		ohlc.add(double(N) - 0.5, -1000);
+		expected.back().low = -1000;
+		expected.back().close = -1000;
+		expected.back().ticks++;
+		ohlc.add(double(N) + 10, 5);
+		expected.push_back({ double(N), 5, 5, 5, 5, 1 });
+		expect(equal(ohlc.candles, expected), "the live ticks");
+	}
+
+	// ================================
+	//           EXECUTION
+	// ================================
+
+	struct Check
+	{
+		std::string_view name;
+		void (*run)(void);
+	};
+
+	constexpr Check checks[] = {
+		{ "contour", checkContour },
+		{ "p2", checkP2 },
+		{ "histogram", static_cast<void (*)(void)>(checkHistogram) },
+		{ "kde", checkKde },
+		{ "ohlc", checkOhlc },
+	};
+
+	// runs the check given as argument, or all of them
+	int safe_main(int argc, char** argv)
+	{
+		bool found = false;
+		for (const Check& check : checks)
+		{
+			if (argc > 1 && check.name != argv[1])
+				continue;
+
+			found = true;
+			const size_t before = failures;
+			check.run();
+			std::cout << check.name << ": " << (failures == before ? "ok" : "FAILED") << std::endl;
+		}
+
+		if (!found)
+			throw std::runtime_error("unknown check");
+
+		return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+}
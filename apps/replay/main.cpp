@@ -0,0 +1,162 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <memory>
+
+#include <gnuplotpp/gnuplotpp.hpp>
+
+namespace
+{
+	int safe_main(int argc, char** argv);
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		return safe_main(argc, argv);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Uncaught Exception thrown from safe_main(): " << e.what() << std::endl;
+	}
+	catch (...)
+	{
+		std::cerr << "Uncaught Unknown Exception thrown from safe_main()" << std::endl;
+	}
+	return EXIT_FAILURE;
+}
+
+// ================================================================
+//                          EXECUTION
+// ================================================================
+
+namespace
+{
+	const char* usage = R"qwerty(usage: gnuplotpp_replay <recording> [options]
+
+Replays a session recorded with Gnuplotpp::recordSession().
+
+options:
+  --max-speed   do not wait, send everything as fast as possible
+  --speed <x>   replay x times faster than real time (default 1)
+  --stdout      write the commands on stdout instead of starting gnuplot
+  --no-persist  do not start gnuplot with --persist
+)qwerty";
+
+	struct Options
+	{
+		std::string path;
+		bool maxSpeed = false;
+		double speed = 1;
+		bool toStdout = false;
+		bool persist = true;
+	};
+
+	Options parseOptions(int argc, char** argv)
+	{
+		Options options;
+
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string arg = argv[i];
+
+			if (arg == "--max-speed")
+				options.maxSpeed = true;
+			else if (arg == "--speed" && i + 1 < argc)
+				options.speed = std::stod(argv[++i]);
+			else if (arg == "--stdout")
+				options.toStdout = true;
+			else if (arg == "--no-persist")
+				options.persist = false;
+			else if (options.path.empty() && arg.size() > 0 && arg[0] != '-')
+				options.path = arg;
+			else
+				throw std::runtime_error("invalid argument \"" + arg + "\"\n" + usage);
+		}
+
+		if (options.path.empty())
+			throw std::runtime_error(std::string("no recording\n") + usage);
+
+		if (options.speed <= 0)
+			throw std::runtime_error("the speed must be positive");
+
+		return options;
+	}
+
+	int safe_main(int argc, char** argv)
+	{
+		using namespace std::chrono;
+		using lc::Gnuplotpp;
+		using lc::SessionReader;
+
+		const Options options = parseOptions(argc, argv);
+
+		SessionReader reader(options.path);
+
+		std::unique_ptr<Gnuplotpp> pGp;
+		if (options.toStdout)
+			pGp = std::make_unique<Gnuplotpp>(std::shared_ptr<std::ostream>(&std::cout, [](std::ostream*) {}));
+		else
+			pGp = std::make_unique<Gnuplotpp>(options.persist);
+		auto& gp = *pGp;
+
+		size_t records = 0;
+		size_t frames = 0;
+		size_t bytes = 0;
+
+		const auto start = steady_clock::now();
+
+		SessionReader::Record record;
+		while (reader.next(record))
+		{
+			if (!options.maxSpeed)
+				std::this_thread::sleep_until(start + duration_cast<steady_clock::duration>(record.time / options.speed));
+
+			switch (record.kind)
+			{
+			case SessionReader::RecordKind::Command:
+				gp.write(record.bytes.data(), record.bytes.size());
+				gp.flush();
+				break;
+			case SessionReader::RecordKind::Data:
+				gp.beginData();
+				gp.write(record.bytes.data(), record.bytes.size());
+				gp.endData();
+				break;
+			case SessionReader::RecordKind::Frame:
+				gp.endFrame();
+				frames++;
+				break;
+			default:
+				break;
+			}
+
+			records++;
+			bytes += record.bytes.size();
+		}
+
+		gp.flush();
+
+		const double elapsed = duration<double>(steady_clock::now() - start).count();
+		std::cerr
+			<< "replayed " << records << " records, " << frames << " frames, " << bytes << " bytes in " << elapsed << " s"
+			<< " (" << (elapsed > 0 ? frames / elapsed : 0) << " frames/s)" << std::endl;
+
+		return EXIT_SUCCESS;
+	}
+}
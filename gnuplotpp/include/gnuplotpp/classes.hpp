@@ -20,6 +20,8 @@ LC_NOTICE_END */
 #include "classes/ScopeGuard.hpp"
 #include "classes/PipeStreamBuf.hpp"
 #include "classes/MultiStream.hpp"
+#include "classes/SessionRecording.hpp"
+#include "classes/ScriptExporter.hpp"
 #include "classes/Vector.hpp"
 
 namespace lc
@@ -13,7 +13,8 @@ LC_NOTICE_END */
 #pragma once
 
 #include <ostream>
-#include <list>
+#include <memory>
+#include <chrono>
 
 #include "NonCopyable.hpp"
 
@@ -23,32 +24,145 @@ namespace lc
 	//                         MULTI-STREAM
 	// ================================================================
 
-	// This class allows us to use the << and >> operators on multiple streambuffers
+	// This class allows us to use the << operator on multiple streambuffers.
+	// Objects are formatted only once into an internal buffer, when the stream
+	// is flushed (for example with std::endl) the formatted bytes are written
+	// as they are to every streambuffer.
 	// TODO add to LC library
 	class MultiStream : NonCopyable
 	{
 	public:
 
+		// ================================
+		//        SUB-CLASSES/ENUMS
+		// ================================
+
+		// What the bytes of a chunk are
+		enum class ChunkKind
+		{
+			// commands text
+			Command,
+
+			// part of an inline data block
+			Data,
+
+			// last part of an inline data block (it could be empty)
+			DataEnd,
+
+			// end of a frame (empty), sent after a complete plot
+			Frame,
+		};
+
+		// A piece of the stream as it is seen by a Sink
+		struct Chunk
+		{
+			ChunkKind kind = ChunkKind::Command;
+			const char* data = nullptr;
+			size_t size = 0;
+
+			// the time the chunk was sent by the MultiStream
+			std::chrono::steady_clock::time_point time = {};
+
+			// If set, data stays valid as long as owner is alive: a sink can keep
+			// it to use the bytes after write() returned instead of copying them.
+			std::shared_ptr<const void> owner = {};
+		};
+
+		// A destination of the MultiStream. Streambuffers are wrapped in a sink that
+		// ignores the chunk kinds, custom sinks can use them to tell commands from data.
+		class Sink
+		{
+		public:
+			virtual ~Sink() = default;
+
+			// write a chunk, the data is only valid during the call (see Chunk::owner)
+			virtual void write(const Chunk& chunk) = 0;
+
+			// flush what was written
+			virtual void sync(void) {};
+		};
+
+		// ================================
+		//          CONSTRUCTORS
+		// ================================
+
+		MultiStream();
+		MultiStream(MultiStream&&);
+		~MultiStream();
+
+		// ================================
+		//            WRITING
+		// ================================
+
 		// TODO concept
 		template <class T>
 		MultiStream& operator<<(const T& obj)
 		{
-			for (auto& ostream : m_ostreams)
-				ostream << obj;
+			*m_pFormatter << obj;
 			return *this;
 		}
 
-		MultiStream& operator<<(std::ostream& (*endl)(std::ostream& os))
+		MultiStream& operator<<(std::ostream& (*manip)(std::ostream& os))
 		{
-			for (auto& ostream : m_ostreams)
-				ostream << endl;
+			*m_pFormatter << manip;
 			return *this;
 		}
 
+		// write raw bytes
+		void write(const char* data, size_t size);
+
+		// Write bytes that stay valid (and unchanged) as long as pOwner is alive.
+		// The sinks receive them without copies and can keep a reference to them,
+		// this is the way to send large payloads.
+		// If pOwner is null the bytes are borrowed: the synchronous sinks still
+		// receive them without copies, the asynchronous ones get a copy.
+		void write(std::shared_ptr<const void> pOwner, const char* data, size_t size);
+
+		// Whatever is written between beginData() and endData() is marked as an
+		// inline data block.
+		void beginData(void);
+		void endData(void);
+
+		// Marks the end of a frame
+		void endFrame(void);
+
+		// ================================
+		//            SINKS
+		// ================================
+
 		// Add a streambuffer to the multistream
-		void addRdbuf(std::streambuf* streambuf);
+		// params:
+		//  - async : if true, the bytes are written to the streambuffer by a dedicated
+		//    thread, this way a slow streambuffer (for example a file) does not
+		//    hold up the others. At most 64 MiB wait to be written, above this
+		//    limit writing to the multistream blocks until the streambuffer has
+		//    caught up (nothing is dropped).
+		void addRdbuf(std::streambuf* streambuf, bool async = false);
+
+		// Add a custom sink to the multistream
+		// params:
+		//  - async : see addRdbuf()
+		void addSink(std::shared_ptr<Sink> pSink, bool async = false);
+
+		// Sends the pending bytes to every streambuffer and waits for the
+		// asynchronous ones to write them.
+		// Throws the first exception thrown by an asynchronous sink since the
+		// previous flush(), that sink is not written anymore. When the stream is
+		// closed these errors are discarded.
+		void flush(void);
+
+	protected:
+
+		// Sends the pending bytes and stops writing to the streambuffers.
+		// Derived classes owning the streambuffers shall call this before
+		// destroying them.
+		void closeRdbufs(void);
 
 	private:
-		std::list<std::ostream> m_ostreams;
+
+		class FanOutStreamBuf;
+
+		std::unique_ptr<FanOutStreamBuf> m_pFanOut;
+		std::unique_ptr<std::ostream> m_pFormatter;
 	};
-}
\ No newline at end of file
+}
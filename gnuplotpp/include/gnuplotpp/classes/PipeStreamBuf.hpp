@@ -14,6 +14,8 @@ LC_NOTICE_END */
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstdio>
 #include <streambuf>
 
 #include "NonCopyable.hpp"
@@ -30,7 +32,12 @@ namespace lc
 	{
 	public:
 
-		PipeStreamBuf(const std::string& command, size_t buffSize = 1 << 10);
+		// Runs a command with a pipe to its standard input.
+		// params:
+		//  - captureOutput : the standard output and error of the command are not
+		//    inherited, they can be read from outputFd() and errorFd() (POSIX only,
+		//    on other systems this option is ignored)
+		PipeStreamBuf(const std::string& command, size_t buffSize = 1 << 10, bool captureOutput = false);
 
 		~PipeStreamBuf() override;
 
@@ -40,6 +47,25 @@ namespace lc
 		// check if the pipe is open
 		operator bool() const { return this->isOpen(); };
 
+		// Flushes and closes the pipe, then waits for the command to exit.
+		// The output can still be read after this.
+		void close(void);
+
+		// file descriptors of the command standard output and error, -1 if they
+		// are not captured
+		int outputFd(void) const { return m_outFd; };
+		int errorFd(void) const { return m_errFd; };
+
+		// Writes bytes that stay valid (and unchanged) as long as pOwner is alive.
+		// On Linux large payloads are given to the pipe with vmsplice(), without
+		// copying them: pOwner is kept until gnuplot has read them. If splicing is
+		// not possible (or pOwner is null) they are written directly on the pipe,
+		// without the buffer.
+		void writeShared(const char* data, size_t size, std::shared_ptr<const void> pOwner);
+
+		// payloads smaller than this are not worth splicing
+		static constexpr size_t zeroCopyThreshold = 1 << 16;
+
 	protected:
 
 		// this is the function that synchronizes the pipe (i.e. flushes)
@@ -53,8 +79,33 @@ namespace lc
 		int_type overflow(int_type ch = std::char_traits<char>::eof()) override;
 
 
+	private:
+
+		// starts the command with the output captured
+		void spawn(const std::string& command);
+
+		// writes bytes directly on the pipe
+		bool writeRaw(const char* data, size_t size);
+
+		// releases the spliced payloads gnuplot has already read
+		void releaseConsumed(void);
+
 	private:
 		std::vector<char> m_buff;
-		FILE* m_pipe;
+		FILE* m_pipe = nullptr;
+
+		// only when the output is captured (otherwise it is popen() business)
+		int m_pid = -1;
+		int m_outFd = -1;
+		int m_errFd = -1;
+
+		// bytes written on the pipe so far
+		size_t m_written = 0;
+
+		// spliced payloads still in the pipe: position of their end and owner
+		std::vector<std::pair<size_t, std::shared_ptr<const void>>> m_pinned;
+
+		// false after vmsplice() failed, then the payloads are always copied
+		bool m_canSplice = true;
 	};
 }
\ No newline at end of file
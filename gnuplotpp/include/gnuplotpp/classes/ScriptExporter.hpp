@@ -0,0 +1,107 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+
+#include "NonCopyable.hpp"
+#include "MultiStream.hpp"
+
+namespace lc
+{
+	// ================================================================
+	//                        SCRIPT EXPORTER
+	// ================================================================
+
+	// A MultiStream sink that writes the commands on a gnuplot script, every inline
+	// ('-') data block is saved on a separate binary file and the plot commands
+	// refer to it with a gnuplot binary file spec, for example:
+	// > plot 'out_data/000000.bin' binary record=(20) format='%float64%float64' using 1:2
+	// The data files are in the "<script name>_data" folder next to the script and
+	// the script refers to them with relative paths: run gnuplot from the script
+	// folder. Equal data blocks are saved only once.
+	class ScriptExporter : public MultiStream::Sink, NonCopyable
+	{
+	public:
+
+		ScriptExporter(const std::filesystem::path& path);
+
+		~ScriptExporter() override;
+
+		void write(const MultiStream::Chunk& chunk) override;
+
+		void sync(void) override;
+
+	private:
+
+		// an inline data source ('-') in the pending commands
+		struct Source
+		{
+			// position of the '-' in m_pending
+			size_t position = 0;
+
+			// true if the command already tells the data is binary
+			bool binary = false;
+		};
+
+		// a saved data file
+		struct File
+		{
+			std::filesystem::path path;
+
+			// extension and format, as in the spec
+			std::string type;
+
+			// size of the file
+			size_t size = 0;
+
+			// what replaces the '-'
+			std::string spec;
+		};
+
+		// finds the data sources in the commands appended to m_pending
+		void findSources(size_t from);
+
+		// saves the collected data block and replaces its source in the commands
+		void writeBlock(void);
+
+		// tells if a saved file has the given content
+		bool isSaved(const File& file, std::string_view content);
+
+		// writes the commands that do not wait for data anymore
+		void writePending(void);
+
+	private:
+		std::ofstream m_script;
+		std::filesystem::path m_dataDir;
+		std::string m_dataDirName;
+
+		// commands that refer to data blocks not yet received
+		std::string m_pending;
+		std::deque<Source> m_sources;
+
+		// the data block being received
+		bool m_inBlock = false;
+		std::string m_block;
+
+		// content hash -> saved files (more than one if the hashes collide)
+		std::unordered_multimap<uint64_t, File> m_files;
+		std::string m_saved;
+	};
+}
@@ -0,0 +1,129 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+
+#include "NonCopyable.hpp"
+#include "MultiStream.hpp"
+
+namespace lc
+{
+	// ================================================================
+	//                       SESSION RECORDER
+	// ================================================================
+
+	// A MultiStream sink that records a session in a compact binary file:
+	//  - numeric data blocks are stored as binary values instead of text
+	//  - a data block equal to an already recorded one is stored as a reference
+	//  - every record has a timestamp, so that the session can be replayed in real time
+	// Use SessionReader to read the file back.
+	class SessionRecorder : public MultiStream::Sink, NonCopyable
+	{
+	public:
+
+		SessionRecorder(const std::filesystem::path& path);
+
+		~SessionRecorder() override;
+
+		void write(const MultiStream::Chunk& chunk) override;
+
+		void sync(void) override;
+
+	private:
+
+		// writes the tag and the timestamp of a new record
+		void beginRecord(uint8_t tag, std::chrono::steady_clock::time_point time);
+
+		// a recorded data block
+		struct Block
+		{
+			uint64_t index = 0;
+			uint8_t tag = 0;
+
+			// file offset just after the timestamp
+			std::streamoff offset = 0;
+
+			// size of the text
+			size_t size = 0;
+		};
+
+		// writes the data block collected so far
+		void writeBlock(void);
+
+		// tells if a recorded block is equal to the one collected
+		bool isRecorded(const Block& block);
+
+	private:
+		std::fstream m_file;
+		std::string m_record;
+
+		std::chrono::steady_clock::time_point m_lastTime = {};
+		bool m_started = false;
+
+		// the data block being received
+		bool m_inBlock = false;
+		std::string m_block;
+		std::chrono::steady_clock::time_point m_blockTime = {};
+
+		// block hash -> recorded blocks (more than one if the hashes collide)
+		std::unordered_multimap<uint64_t, Block> m_blocks;
+		std::string m_recorded;
+	};
+
+	// ================================================================
+	//                        SESSION READER
+	// ================================================================
+
+	// Reads a session recorded by SessionRecorder, record by record
+	class SessionReader : NonCopyable
+	{
+	public:
+
+		enum class RecordKind
+		{
+			Command,
+			Data,
+			Frame,
+		};
+
+		struct Record
+		{
+			RecordKind kind = RecordKind::Command;
+
+			// time since the beginning of the session
+			std::chrono::microseconds time = {};
+
+			// the bytes as they were sent, empty for frames
+			std::string bytes;
+		};
+
+		SessionReader(const std::filesystem::path& path);
+
+		// Reads the next record, returns false at the end of the recording
+		bool next(Record& record);
+
+	private:
+		std::ifstream m_file;
+		std::chrono::microseconds m_time = {};
+
+		// tags and file offsets of the data blocks, used to resolve references
+		std::vector<std::pair<uint8_t, std::streamoff>> m_blocks;
+	};
+}
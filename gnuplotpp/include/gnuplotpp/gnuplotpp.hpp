@@ -18,11 +18,24 @@ LC_NOTICE_END */
 #include <optional>
 #include <variant>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <optional>
 #include <list>
 #include <memory>
 #include <filesystem>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <memory_resource>
 
 #if __has_include(<concepts>)
 #define _GNUPLOTPP_USE_CONCEPTS
@@ -43,19 +56,116 @@ namespace lc
 	//                         GNUPLOT PIPE
 	// ================================================================
 
-	// This class represents a pipe to gnuplot. It is a write only pipe
-	// (ofstream). In the future it will be bidirectional.
+	// An error reported by gnuplot
+	class GnuplotError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	// This class represents a pipe to gnuplot. Commands are written on it like on
+	// an ostream, the gnuplot output is read by a dedicated thread (POSIX only):
+	//  - gnuplot messages are parsed and queued (see takeMessages()), errors are
+	//    attributed to the command that caused them
+	//  - queries are answered asynchronously, many of them can be waiting at the
+	//    same time
+	//  - fences are used to know when gnuplot has finished a frame
 	// Note: it is not really necessary to have a custom class for the Gnuplot pipe
 	// bu we introduce it for clarity.
 	class GnuplotPipe : NonCopyable, public std::ostream
 	{
 	public:
 
+		// Times of a frame, from the draw() call to gnuplot printing the fence
+		// that follows it
+		struct FrameTiming
+		{
+			// number of the frame (0 is the first one drawn)
+			size_t frame = 0;
+
+			// formatting the commands and data and writing them into the streams
+			std::chrono::steady_clock::duration enqueue = {};
+
+			// sending the end of the frame to the pipe
+			std::chrono::steady_clock::duration transmit = {};
+
+			// from the frame fully sent to gnuplot done with it
+			std::chrono::steady_clock::duration render = {};
+
+			std::chrono::steady_clock::duration total(void) const { return enqueue + transmit + render; };
+		};
+
+		// A message printed by gnuplot (on its standard error)
+		struct Message
+		{
+			enum class Kind
+			{
+				Info,
+				Warning,
+				Error,
+			};
+
+			Kind kind = Kind::Info;
+
+			// the text without the final new line
+			std::string text;
+
+			// The command that caused the message and its number (the command lines
+			// sent on the pipe are numbered from 0), if gnuplot tells it
+			std::optional<std::string> command = {};
+			std::optional<size_t> commandIndex = {};
+		};
+
 		// Opens a pipe with gnuplot.
 		// params:
 		//  - persist : opens gnuplot with "--persist" option
 		GnuplotPipe(bool persist);
 
+		~GnuplotPipe() override;
+
+		// true if the gnuplot output is read, fences and queries need it
+		bool readsOutput(void) const { return m_reader.joinable(); };
+
+		// The sink to add to a MultiStream to write on this pipe, it keeps track
+		// of the command lines for the error attribution
+		std::shared_ptr<MultiStream::Sink> sink(void);
+
+		// ============ fences ============
+
+		// Sends a fence after a frame, the pipe must be already flushed.
+		// params:
+		//  - begin : when the frame started
+		//  - enqueued : when the frame was completely written into the streams
+		void fence(size_t frame, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point enqueued);
+
+		// Sets a function called (from the reader thread) when gnuplot finishes a frame
+		void setFrameCallback(std::function<void(const FrameTiming&)> callback);
+
+		// The timing of the last frame gnuplot has finished
+		std::optional<FrameTiming> lastFrameTiming(void) const;
+
+		// Waits for gnuplot to finish every fenced frame.
+		// Returns false on timeout or if the output is not read.
+		bool waitFrames(std::optional<std::chrono::steady_clock::duration> timeout = {});
+
+		// ============ queries ===========
+
+		// Sends a command (one or more lines) and returns what gnuplot prints while
+		// executing it, the pipe must be already flushed. The future throws a
+		// GnuplotError if the command fails.
+		std::future<std::string> query(const std::string& command);
+
+		// The messages received so far that are not answers to queries
+		std::vector<Message> takeMessages(void);
+
+		// The standard output of gnuplot received so far, only when it is not
+		// forwarded
+		std::string takeOutput(void);
+
+		// If true (default) gnuplot output and messages are also written on
+		// our stdout and stderr
+		void setForwardOutput(bool forward);
+
 	protected:
 
 		// check if the pipe is open
@@ -64,8 +174,90 @@ namespace lc
 		// check if the pipe is open
 		operator bool() const { return this->isOpen(); };
 
+	private:
+
+		class PipeSink;
+
+		// a fence or a query not yet answered by gnuplot
+		struct PendingMarker
+		{
+			bool isQuery = false;
+			size_t id = 0;
+
+			// number of command lines sent before it
+			size_t commands = 0;
+
+			// fence times
+			std::chrono::steady_clock::time_point begin;
+			std::chrono::steady_clock::time_point enqueued;
+			std::chrono::steady_clock::time_point transmitted;
+
+			// query answer (fences do not need it)
+			std::optional<std::promise<std::string>> answer;
+		};
+
+		// a command line sent on the pipe
+		struct SentCommand
+		{
+			size_t index = 0;
+			std::string text;
+		};
+
+		// body of the reader thread
+		void read(void);
+
+		// handles a complete line of the gnuplot standard error
+		void onErrorLine(std::string_view line);
+
+		// handles a parsed message
+		void onMessage(Message message);
+
+		// handles the line kept while waiting to know if it is part of an error
+		void flushPendingLine(void);
+
+		// adds the complete lines of a command chunk to m_sentCommands
+		void recordCommands(std::string_view lines);
+
+		// removes the markers before the given one, they will never be answered
+		// returns the marker (if found)
+		std::optional<PendingMarker> popMarker(bool isQuery, size_t id);
+
 	private:
 		PipeStreamBuf m_pipeStreamBuf;
+
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cv;
+		// a few at a time, a vector keeps its memory
+		std::vector<PendingMarker> m_markers;
+		size_t m_queries = 0;
+
+		// fences
+		std::optional<FrameTiming> m_lastFrameTiming;
+		std::shared_ptr<const std::function<void(const FrameTiming&)>> m_pFrameCallback;
+
+		// the last command lines sent, a ring of reused strings
+		std::vector<SentCommand> m_sentCommands;
+		size_t m_sentCommandsHead = 0;
+		size_t m_sentCommandsCount = 0;
+
+		// the command lines before this have been executed by gnuplot
+		size_t m_executedCommands = 0;
+
+		// received
+		std::deque<Message> m_messages;
+		std::string m_output;
+		std::atomic<bool> m_forward = true;
+
+		// reader thread state
+		std::optional<std::string> m_pendingLine;
+		bool m_caret = false;
+		std::optional<size_t> m_currentQuery;
+		std::string m_answer;
+		std::optional<std::string> m_queryError;
+
+		// written to stop the reader thread
+		int m_wakeFds[2] = { -1, -1 };
+		std::thread m_reader;
 	};
 
 	// ================================================================
@@ -106,6 +298,8 @@ namespace lc
 		{
 			size_t id = 0;
 
+			// called when the ID is released, at the beginning of the next
+			// draw() or cleanIDs()
 			std::function<void(void)> onExit = {};
 
 			CommandLineIDImpl() = default;
@@ -138,6 +332,10 @@ namespace lc
 
 		class DataBuffer;
 
+		// ========== retained ============
+
+		class Figure;
+
 		// ============ ... ===============
 
 		enum class ErrorBarDir
@@ -149,7 +347,7 @@ namespace lc
 
 		struct PlotStyle
 		{
-
+			bool operator==(const PlotStyle&) const = default;
 		};
 
 		struct Color
@@ -158,6 +356,8 @@ namespace lc
 			uint8_t g = 0;
 			uint8_t b = 0;
 			uint8_t transparency = 0;
+
+			bool operator==(const Color&) const = default;
 		};
 
 		enum class PointType : int
@@ -198,6 +398,8 @@ namespace lc
 		{
 			std::optional<std::variant<int, PointType>> pointType = PointType::Cross;
 			std::optional<double> pointSize = {};
+
+			bool operator==(const Marker&) const = default;
 		};
 
 		struct MarkerSerializer : public GnuplotSerializer
@@ -208,6 +410,9 @@ namespace lc
 
 			void prepare(Gnuplotpp& os) const override;
 			void print(Gnuplotpp& os) const override;
+
+			// appends what print() writes
+			void write(std::string& out) const;
 		};
 
 		struct LineStyle
@@ -217,6 +422,8 @@ namespace lc
 			std::optional<std::variant<std::string, Color>> lineColor = {};
 			std::optional<std::variant<int, std::string>> dashType = {};
 			std::optional<Marker> marker = {};
+
+			bool operator==(const LineStyle&) const = default;
 		};
 
 		struct LineStyleSerializer : public GnuplotSerializer
@@ -230,6 +437,9 @@ namespace lc
 
 			void prepare(Gnuplotpp& os) const override;
 			void print(Gnuplotpp& os) const override;
+
+			// appends what print() writes
+			void write(std::string& out) const;
 		};
 
 		enum class PlotAxes
@@ -251,6 +461,19 @@ namespace lc
 			std::optional<Marker> marker = Marker{};
 
 			std::optional<PlotAxes> axes = {};
+
+			// The gnuplot binary keywords of binary data (see Plot2dBase::getBinaryData()),
+			// for example "array=(640,480) format='%float32'"
+			std::optional<std::string> binary = {};
+
+			// The plot style, for example "image", if not set it depends on the
+			// line style and on the error bars
+			std::optional<std::string> with = {};
+
+			// true for 3D plots, drawn with "splot"
+			bool splot = false;
+
+			bool operator==(const PlotOptions&) const = default;
 		};
 
 		struct PlotOptionsSerializer : public GnuplotSerializer
@@ -266,12 +489,17 @@ namespace lc
 
 			void prepare(Gnuplotpp& os) const override;
 			void print(Gnuplotpp& os) const override;
+
+			// appends what print() writes
+			void write(std::string& out) const;
 		};
 
 		struct TicksOptions
 		{
 			size_t minorXdivider = 5;
 			size_t minorYdivider = 5;
+
+			bool operator==(const TicksOptions&) const = default;
 		};
 
 		struct GridOptions
@@ -282,13 +510,15 @@ namespace lc
 				bool y = {};
 
 				Enabled(bool x, bool y) : x{ x }, y{ y } {};
-				Enabled(Enabled&) = default;
+				Enabled(const Enabled&) = default;
 				Enabled(Enabled&&) = default;
 				Enabled(bool value) : x{ value }, y{ value } {};
 
 				Enabled& operator=(const Enabled&) = default;
 				Enabled& operator=(Enabled&&) = default;
 				Enabled& operator=(bool value) { return *this = Enabled{ value }; };
+
+				bool operator==(const Enabled&) const = default;
 			};
 
 			enum class GridLevel
@@ -304,6 +534,57 @@ namespace lc
 
 			LineStyle majorLineStyle = { .lineColor = Color{ 0, 0, 0, 192 } };
 			LineStyle minorLineStyle = { .lineColor = Color{ 0, 0, 0, 224 } };
+
+			bool operator==(const GridOptions&) const = default;
+		};
+
+		// A table of colors, values are mapped linearly on its entries
+		struct Colormap
+		{
+			std::vector<Color> colors;
+
+			// Interpolates linearly some colors (at least one) on a table of size entries
+			static Colormap fromColors(const std::vector<Color>& colors, size_t size = 256);
+
+			// perceptually uniform, from dark blue to yellow (matplotlib default)
+			static Colormap viridis(void);
+
+			// from black to white
+			static Colormap grey(void);
+
+			bool operator==(const Colormap&) const = default;
+		};
+
+		// The color box of a colormap, see Gnuplotpp::setColorbox()
+		struct Colorbox
+		{
+			Colormap colormap = Colormap::viridis();
+
+			// the values of the first and of the last color
+			double min = 0;
+			double max = 1;
+
+			bool operator==(const Colorbox&) const = default;
+		};
+
+		// How Gnuplotpp::kde() estimates the density
+		struct KdeOptions
+		{
+			// bandwidth of the gaussian kernel, by default Silverman's rule of thumb
+			std::optional<double> bandwidth = {};
+
+			// the range of the curve, by default the range of the samples plus
+			// 3 bandwidths on each side
+			std::optional<Vector2d> range = {};
+
+			// number of points of the curve
+			size_t points = 512;
+
+			static KdeOptions defaultValues(void)
+			{
+				KdeOptions opt;
+				return opt;
+			}
 		};
 
 		struct SinglePlotOptions
@@ -351,8 +632,82 @@ namespace lc
 			std::unique_ptr<PlotOptionsSerializer> pSerializer;
 		};
 
+		struct PlotOptionsHash
+		{
+			size_t operator()(const PlotOptions& options) const;
+		};
+
+		struct LineStyleHash
+		{
+			size_t operator()(const LineStyle& lineStyle) const;
+		};
+
+		// The IDs in use and the released ones. It is shared with the IDs (they
+		// could outlive the Gnuplotpp object), when an ID is released it goes
+		// into the released list, then cleanIDs() undefines it and puts it in
+		// the free list.
+		struct IDRegistry
+		{
+			// the first ID never used
+			size_t next = 50;
+
+			// IDs that can be reused
+			std::vector<size_t> free;
+
+			// IDs released since the last cleanIDs(), with their onExit
+			std::vector<std::pair<size_t, std::function<void(void)>>> released;
+		};
+
+		// The plot clause ("using ... with ... title ...") of some options, already
+		// formatted. The serializer keeps the line styles it has defined.
+		struct PlotFragment
+		{
+			std::unique_ptr<PlotOptionsSerializer> pSerializer;
+			std::string text;
+
+			// the last frame that used it
+			size_t frame = 0;
+		};
+
 	public:
 
+		// Bytes of a plot sent to gnuplot as they are, see Plot2dBase::getBinaryData()
+		struct BinaryData
+		{
+			// the bytes, if null they are the ones written in *pBuffer
+			const char* data = nullptr;
+			size_t size = 0;
+
+			// If set, it keeps data valid (and unchanged) after draw() returned:
+			// the streams keep it instead of copying the bytes. Otherwise data is
+			// only read during draw().
+			std::shared_ptr<const void> pOwner = {};
+
+			// an empty buffer given by draw(), for bytes that are not in memory as
+			// they shall be sent (it is kept as long as needed)
+			std::pmr::string* pBuffer = nullptr;
+		};
+
+		// A row-major matrix of float or double values, like a 2D std::mdspan with
+		// a strided layout. The strides are in elements, a null row stride means
+		// cols (rows one after the other).
+		template <class T>
+		struct MatrixView
+		{
+			using value_type = T;
+
+			const T* data = nullptr;
+			size_t rows = 0;
+			size_t cols = 0;
+			size_t rowStride = 0;
+			size_t colStride = 1;
+
+			// true if the values are one after the other, row by row
+			bool contiguous(void) const { return colStride == 1 && (rowStride == 0 || rowStride == cols || rows <= 1); };
+
+			const T& at(size_t i, size_t j) const { return data[i * (rowStride ? rowStride : cols) + j * colStride]; };
+		};
+
 		class Plot2dBase
 		{
 		public:
@@ -363,6 +718,20 @@ namespace lc
 
 			virtual PlotOptions getOptions(void) const { return (PlotOptions)this->options; };
 			virtual DataBuffer getData(void) const = 0;
+
+			// Like the functions above, but they overwrite existing objects reusing
+			// their memory, draw() uses these. By default they call the ones above.
+			virtual void getOptions(PlotOptions& options) const;
+			virtual void getData(DataBuffer& buffer) const;
+
+			// Binary data, used instead of getData() if the options have
+			// PlotOptions::binary, which tells gnuplot their format.
+			// By default it throws.
+			virtual void getBinaryData(BinaryData& data) const;
+
+			// sets options to the SinglePlotOptions and the columns, reusing its memory
+			void assignOptions(PlotOptions& options, std::initializer_list<size_t> cols = { 0 }) const;
+
 			friend class Gnuplotpp;
 		};
 
@@ -396,6 +765,63 @@ namespace lc
 		protected:
 			virtual PlotOptions getOptions(void) const;
 			DataBuffer getData(void) const;
+
+			void getOptions(PlotOptions& options) const override;
+			void getData(DataBuffer& buffer) const override;
+		};
+
+		// A kernel density estimation of some samples, drawn as a curve. The
+		// density is computed by the constructor (binning the samples and
+		// convolving them with the kernel through the FFT), then it is a Plot2d.
+		class Kde : public Plot2d
+		{
+			using BASE = Plot2d;
+		public:
+
+			Kde() = default;
+			Kde(const Kde&) = default;
+			Kde(Kde&&) = default;
+
+			Kde(std::span<const double> samples, KdeOptions kdeOptions = KdeOptions::defaultValues(), SinglePlotOptions options = SinglePlotOptions::defaultValues());
+
+			// the bandwidth used
+			double bandwidth = 0;
+
+		protected:
+			void getOptions(PlotOptions& options) const override;
+		};
+
+		// A plot of a DataBuffer with a gnuplot style, the plots that compute
+		// their data (for example Boxplot) are made of these.
+		class DataPlot : public Plot2dBase
+		{
+			using BASE = Plot2dBase;
+		public:
+
+			DataPlot() = default;
+			DataPlot(const DataPlot&) = default;
+			DataPlot(DataPlot&&) = default;
+
+			DataPlot(std::shared_ptr<const DataBuffer> pData, std::list<size_t> cols, std::string with, SinglePlotOptions options = SinglePlotOptions::defaultValues()) :
+				pData{ std::move(pData) },
+				cols{ std::move(cols) },
+				with{ std::move(with) }
+			{
+				this->options = options;
+			};
+
+			std::shared_ptr<const DataBuffer> pData;
+
+			// the columns used (from 0) and the style, for example { 0, 1 } and "lines"
+			std::list<size_t> cols = { 0 };
+			std::string with = "points";
+
+		protected:
+			virtual PlotOptions getOptions(void) const;
+			DataBuffer getData(void) const;
+
+			void getOptions(PlotOptions& options) const override;
+			void getData(DataBuffer& buffer) const override;
 		};
 
 		struct ErrorbarData
@@ -422,124 +848,857 @@ namespace lc
 		protected:
 			virtual PlotOptions getOptions(void) const;
 			DataBuffer getData(void) const;
-		};
 
-		enum class Terminal
-		{
-			None,
-			Qt,
-			PNG,
-			JPEG,
-			PDF
+			void getOptions(PlotOptions& options) const override;
+			void getData(DataBuffer& buffer) const override;
 		};
 
-		struct MultiplotGuard final : private ScopeGuard
+		// A heatmap ("with image" and the palette): the value (i, j) of the matrix
+		// is the pixel of column j and row i, rows go up along Y. The matrix is sent
+		// as binary data, if its values are contiguous they are sent as they are,
+		// without copies, otherwise they are packed first.
+		class Image : public Plot2dBase
 		{
-			MultiplotGuard(Gnuplotpp* pGp) : ScopeGuard([pGp]() { pGp->endMultiplot(); }) {};
-			operator bool() const { return true; };
-			friend class Gnuplotpp;
-		};
+			using BASE = Plot2dBase;
+		public:
 
-		// ================================
-		//          CONSTRUCTORS
-		// ================================
+			Image() = default;
+			Image(const Image&) = default;
+			Image(Image&&) = default;
 
-		// Default constructor
-		Gnuplotpp(bool persist = true, size_t buffSize = 1 << 10);
+			Image(MatrixView<float> matrix, SinglePlotOptions options = SinglePlotOptions::defaultValues()) :
+				matrix{ matrix }
+			{
+				this->options = options;
+			};
 
-		// use a file
-		Gnuplotpp(std::ofstream&& oFileStream);
+			Image(MatrixView<double> matrix, SinglePlotOptions options = SinglePlotOptions::defaultValues()) :
+				matrix{ matrix }
+			{
+				this->options = options;
+			};
 
-		// use a different ostream
-		// not necessary, unique is convertible to shared...
-		// TODO modify to avoid ambiguity
-		//Gnuplotpp(std::unique_ptr<std::ostream>&& ostream);
+			std::variant<MatrixView<float>, MatrixView<double>> matrix;
 
-		// use a different ostream
-		Gnuplotpp(std::shared_ptr<std::ostream> ostream);
+			// position of the center of the pixel (0, 0) and size of the pixels,
+			// by default the pixel (i, j) is centered on (j, i)
+			std::optional<Vector2d> origin = {};
+			std::optional<Vector2d> pixelSize = {};
 
-		// default move costructor
-		Gnuplotpp(Gnuplotpp&&) = default;
+			// If set, it keeps the matrix valid (and unchanged) after draw(): the
+			// streams can keep it instead of copying it and refresh() can send it
+			// again. Otherwise the matrix is only read during draw().
+			std::shared_ptr<const void> pOwner = {};
 
-		// ================================
-		//           DESTRUCTOR
-		// ================================
+			// If set, the values are shaded here (on multiple threads for large
+			// matrices) and sent as RGBA pixels ("with rgbalpha"): gnuplot draws
+			// them without the palette. NaN values are transparent.
+			// Gnuplot does not draw a color box for them, see Gnuplotpp::setColorbox().
+			std::optional<Colormap> colormap = {};
 
-		~Gnuplotpp();
+			// the values of the first and of the last color of the colormap, by
+			// default the minimum and the maximum of the matrix
+			std::optional<Vector2d> range = {};
 
-		// ================================
-		//          COMUNICATION
-		// ================================
+		protected:
+			virtual PlotOptions getOptions(void) const;
+			DataBuffer getData(void) const;
 
-		void sendLine(const std::string& line);
+			void getOptions(PlotOptions& options) const override;
+			void getBinaryData(BinaryData& data) const override;
+		};
 
-		void resetSession(void);
+		// A 3D surface ("splot") of a matrix: the value (i, j) is the height of the
+		// point of column j and row i. The matrix is sent as binary data, like the
+		// Image one. With a tolerance the rows and columns that add no details are
+		// dropped first, large grids become much smaller meshes for gnuplot.
+		class Surface : public Plot2dBase
+		{
+			using BASE = Plot2dBase;
+		public:
 
-		void setTerminal(Terminal term = Terminal::None, std::optional<std::string> outFile = {}, std::optional<Vector2i> size = {});
+			enum class Style
+			{
+				// colored by height with the palette
+				Pm3d,
 
-		void setTitle(std::optional<std::string> title = {});
+				// a wireframe, with the line style of the options
+				Lines,
+			};
 
-		void xLabel(std::optional<std::string> label = {});
-		void yLabel(std::optional<std::string> label = {});
+			Surface() = default;
+			Surface(const Surface&) = default;
+			Surface(Surface&&) = default;
 
-		// Plot a vector of double values
-		// Note that options.cols is ignored
-		// examples:
-		//  - gnuplot.plot(your_data)
-		//  - gnuplot.plot(your_data, { .spacing=0.1 })
-		//  - gnuplot.plot(your_data, { .spacing=0.1, .options={ .title="Hello There!" } })
-		//  - gnuplot.plot({ 42, 40, 30, 20, 10, 0 }, { .spacing=0.1, .options={ .title="Hello There!" } })
-		// TODO update examples
-		// TODO STATIC
-		static Plot2d plot(const std::vector<double>& data, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+			Surface(MatrixView<float> matrix, SinglePlotOptions options = SinglePlotOptions::defaultValues()) :
+				matrix{ matrix }
+			{
+				this->options = options;
+			};
 
-#if defined(_GNUPLOTPP_USE_CONCEPTS)
-		// Plot a vector of real values
-		// Note that options.cols is ignored
-		// examples:
-		//  - gnuplot.plot(your_data)
-		//  - gnuplot.plot(your_data, { .spacing=0.1 })
-		//  - gnuplot.plot(your_data, { .spacing=0.1, .options={ .title="Hello There!" } })
-		//  - gnuplot.plot({ 42, 40, 30, 20, 10, 0 }, { .spacing=0.1, .options={ .title="Hello There!" } })
-		// TODO update examples
-		template <std::convertible_to<double> Ty>
-		static Plot2d plot(const std::vector<Ty>& data, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
-#endif
+			Surface(MatrixView<double> matrix, SinglePlotOptions options = SinglePlotOptions::defaultValues()) :
+				matrix{ matrix }
+			{
+				this->options = options;
+			};
 
-		static Plot2d plot(const std::vector<double>& xData, const std::vector<double>& yData, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+			std::variant<MatrixView<float>, MatrixView<double>> matrix;
 
-#if defined(_GNUPLOTPP_USE_CONCEPTS)
-		template <std::convertible_to<double> Ty>
-		static Plot2d plot(const std::vector<Ty>& xData, const std::vector<Ty>& yData, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
-#endif
+			// position of the point (0, 0) and distance of the points along X and
+			// Y, by default the point (i, j) is at (j, i)
+			std::optional<Vector2d> origin = {};
+			std::optional<Vector2d> step = {};
 
-		// Creates an errorbar plot.
-		// Data can be passes through an ErrorbarData struct, at leas one of X or Y errrors
-		// must be present
-		static Errorbar errorbar(ErrorbarData data, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+			Style style = Style::Pm3d;
 
-		using Plot2dRef = std::reference_wrapper<const Plot2dBase>;
+			// If set, the rows and the columns that can be dropped are not sent:
+			// every height of the surface drawn is within tolerance of the matrix
+			// one (half of it for the rows, half for the columns). The rows and
+			// the columns are dropped on the whole matrix, a surface smooth only
+			// in some regions shrinks less. Then the points are always packed.
+			std::optional<double> tolerance = {};
 
-		// TOOD description ...
-		void draw(const std::list<Plot2dRef>& plots);
+			// see Image::pOwner
+			std::shared_ptr<const void> pOwner = {};
 
-		void setTicksOptions(std::optional<TicksOptions> options = {});
+		protected:
+			virtual PlotOptions getOptions(void) const;
+			DataBuffer getData(void) const;
 
-		void setGridOptions(std::optional<GridOptions> options = {});
+			void getOptions(PlotOptions& options) const override;
+			void getBinaryData(BinaryData& data) const override;
 
-		Vector2d getMouseClick(void);
+		private:
 
-		void setOrigin(const Vector2d& pos);
-		void setOrigin(void);
+			// fills m_keptRows and m_keptCols
+			template <class T>
+			void decimate(const MatrixView<T>& matrix) const;
 
-		void setSize(const Vector2d& pos);
-		void setSize(void);
+			// the rows and the columns sent, with a tolerance
+			mutable std::vector<size_t> m_keptRows;
+			mutable std::vector<size_t> m_keptCols;
+		};
+
+		// A scatter plot of many points drawn as an image: the points are counted
+		// on a grid of cells (on multiple threads), the cells are drawn with the
+		// palette or with a colormap, like an Image. Empty cells are not drawn.
+		// The time gnuplot takes does not depend on the number of points.
+		class Density : public Plot2dBase
+		{
+			using BASE = Plot2dBase;
+		public:
+
+			// what the color of a cell shows
+			enum class Aggregation
+			{
+				// the number of points
+				Count,
+
+				// the mean of the values of the points
+				Mean,
+
+				// log10 of the number of points, to see sparse and dense areas together
+				LogCount,
+			};
+
+			Density() = default;
+			Density(const Density&) = default;
+			Density(Density&&) = default;
+
+			Density(std::span<const double> x, std::span<const double> y, SinglePlotOptions options = SinglePlotOptions::defaultValues()) :
+				x{ x },
+				y{ y }
+			{
+				this->options = options;
+			};
+
+			// The coordinates of the points (and their values for the mean), they
+			// are not copied: they are read only by rasterize()
+			std::span<const double> x;
+			std::span<const double> y;
+			std::span<const double> values;
+
+			Aggregation aggregation = Aggregation::Count;
+
+			// number of cells along X and Y, Gnuplotpp::density() uses the
+			// terminal size, one cell for each pixel
+			Vector2i resolution = Vector2i(640, 480);
+
+			// the area of the grid, the points outside are ignored, by default
+			// the minimum and maximum coordinates
+			std::optional<Vector2d> xRange = {};
+			std::optional<Vector2d> yRange = {};
+
+			// see Image::colormap and Image::range
+			std::optional<Colormap> colormap = {};
+			std::optional<Vector2d> range = {};
+
+			// Bins the points on the grid (on multiple threads), draw() sends the
+			// last grid: call it again after changing the points or the settings
+			// above. Gnuplotpp::density() calls it.
+			void rasterize(void);
+
+		protected:
+			virtual PlotOptions getOptions(void) const;
+			DataBuffer getData(void) const;
+
+			void getOptions(PlotOptions& options) const override;
+			void getBinaryData(BinaryData& data) const override;
+
+		private:
+
+			MatrixView<float> grid(void) const;
+
+			// the cells, row by row, and the position of their centers
+			std::vector<float> m_grid;
+			size_t m_rows = 0;
+			size_t m_cols = 0;
+			Vector2d m_origin = Vector2d(0, 0);
+			Vector2d m_step = Vector2d(1, 1);
+		};
+
+		// The spectrogram of a stream of samples: a short time Fourier transform
+		// of windowed frames (overlapped by fftSize - hop samples), computed here
+		// as the samples are appended. The magnitudes are drawn like an Image,
+		// time along X and frequency along Y.
+		class Spectrogram : public Plot2dBase
+		{
+			using BASE = Plot2dBase;
+		public:
+
+			enum class Window
+			{
+				Rectangular,
+				Hann,
+				Hamming,
+				Blackman,
+			};
+
+			struct Options
+			{
+				// samples of each frame, a power of two
+				size_t fftSize = 1024;
+
+				// samples between the start of two frames
+				size_t hop = 512;
+
+				// samples per second, for the time and frequency axes
+				double sampleRate = 1;
+
+				Window window = Window::Hann;
+
+				// 20 log10 of the magnitudes
+				bool decibels = true;
+
+				// if not 0, only the last maxFrames frames are kept (live data)
+				size_t maxFrames = 0;
+
+				static Options defaultValues(void)
+				{
+					Options opt;
+					return opt;
+				}
+			};
+
+			Spectrogram(Options spectrogramOptions = Options::defaultValues(), SinglePlotOptions options = SinglePlotOptions::defaultValues());
+			Spectrogram(const Spectrogram&) = default;
+			Spectrogram(Spectrogram&&) = default;
+
+			// Computes the frames completed by the samples (on multiple threads
+			// if they are many), the rest is kept for the next call
+			void append(std::span<const double> samples);
+
+			size_t frames(void) const { return m_frames; };
+
+			// fftSize / 2 + 1, from 0 to the Nyquist frequency
+			size_t bins(void) const { return m_spectrogramOptions.fftSize / 2 + 1; };
+
+			// the magnitude of a bin in a frame (of the kept ones)
+			float magnitude(size_t frame, size_t bin) const;
+
+			// see Image::colormap and Image::range
+			std::optional<Colormap> colormap = {};
+			std::optional<Vector2d> range = {};
+
+		protected:
+			virtual PlotOptions getOptions(void) const;
+			DataBuffer getData(void) const;
+
+			void getOptions(PlotOptions& options) const override;
+			void getBinaryData(BinaryData& data) const override;
+
+		private:
+
+			// bins along the rows, frames along the columns
+			MatrixView<float> view(void) const;
+
+			Options m_spectrogramOptions;
+			std::vector<double> m_window;
+
+			// the samples of the next frames
+			std::vector<double> m_pending;
+
+			// the frames one after the other, the kept ones start from the frame
+			// m_first; m_dropped frames have been dropped since the first one
+			std::vector<float> m_magnitudes;
+			size_t m_first = 0;
+			size_t m_frames = 0;
+			size_t m_dropped = 0;
+		};
+
+		// A histogram of some samples: the samples are counted here (on multiple
+		// threads), only the bins are sent to gnuplot.
+		class Histogram : public Plot2dBase
+		{
+			using BASE = Plot2dBase;
+		public:
+
+			enum class Style
+			{
+				// a box for each bin
+				Boxes,
+
+				// the outline of the bins
+				Steps,
+			};
+
+			Histogram() = default;
+			Histogram(const Histogram&) = default;
+			Histogram(Histogram&&) = default;
+
+			Histogram(std::span<const double> samples, SinglePlotOptions options = SinglePlotOptions::defaultValues()) :
+				samples{ samples }
+			{
+				this->options = options;
+			};
+
+			// the samples, they are not copied: they must be valid when the plot is drawn
+			std::span<const double> samples;
+
+			// number of bins of the same width, between the range
+			size_t bins = 100;
+
+			// the range of the bins, by default the minimum and maximum samples,
+			// the samples outside are ignored
+			std::optional<Vector2d> range = {};
+
+			// the bins have the same width on a logarithmic scale, the range must
+			// be positive
+			bool logWidth = false;
+
+			// If not empty, the edges of the bins (increasing), instead of bins,
+			// range and logWidth
+			std::vector<double> edges = {};
+
+			Style style = Style::Boxes;
+
+		protected:
+			virtual PlotOptions getOptions(void) const;
+			DataBuffer getData(void) const;
+
+			void getOptions(PlotOptions& options) const override;
+			void getData(DataBuffer& buffer) const override;
+
+		private:
+
+			// counts the samples in the bins, returns the edges (bins + 1)
+			std::vector<double> count(std::vector<uint64_t>& counts) const;
+		};
+
+		// Candlesticks of time stamped ticks: the ticks are aggregated here (on
+		// multiple threads) in intervals of time, only the candles are sent to
+		// gnuplot. Live ticks update the last candle (or start a new one).
+		class Ohlc : public Plot2dBase
+		{
+			using BASE = Plot2dBase;
+		public:
+
+			struct Candle
+			{
+				// start of the interval
+				double time = 0;
+
+				double open = 0;
+				double high = 0;
+				double low = 0;
+				double close = 0;
+
+				size_t ticks = 0;
+			};
+
+			Ohlc() = default;
+			Ohlc(const Ohlc&) = default;
+			Ohlc(Ohlc&&) = default;
+
+			Ohlc(SinglePlotOptions options) { this->options = options; };
+
+			// Replaces the candles with the ones of some ticks, sorted by time.
+			// The intervals start from a multiple of the interval, the ones
+			// without ticks have no candle. NaN prices are ignored.
+			void aggregate(std::span<const double> time, std::span<const double> price);
+
+			// adds a tick, not before the last one
+			void add(double time, double price);
+
+			// The length of the intervals, if not set the smallest 1, 2 or 5
+			// times a power of 10 that makes at most maxCandles candles of
+			// the ticks given to aggregate(). Gnuplotpp::ohlc() gives a candle
+			// to every 4 pixels of the terminal.
+			std::optional<double> interval = {};
+			size_t maxCandles = 160;
+
+			// the width of the candles, relative to the interval
+			double width = 0.8;
+
+			std::vector<Candle> candles;
+
+			// the length of the intervals of the candles, 0 if there are none
+			double usedInterval(void) const { return m_interval; };
+
+		protected:
+			virtual PlotOptions getOptions(void) const;
+			DataBuffer getData(void) const;
+
+			void getOptions(PlotOptions& options) const override;
+			void getData(DataBuffer& buffer) const override;
+
+		private:
+
+			// the candles start at multiples of it
+			double m_interval = 0;
+		};
+
+		// Box plots (and violin plots) of groups of samples. The statistics are
+		// computed here, the groups on multiple threads, then only them are sent
+		// to gnuplot. The group i is at x = i + 1.
+		// Draw the plots you need, for example:
+		// auto boxes = stats.boxes(), medians = stats.medians();
+		// gp.draw({ boxes, medians });
+		class Boxplot
+		{
+		public:
+
+			struct Group
+			{
+				size_t count = 0;
+
+				double q1 = 0;
+				double median = 0;
+				double q3 = 0;
+
+				// the most extreme samples within 1.5 interquartile ranges from the box
+				double whiskerLow = 0;
+				double whiskerHigh = 0;
+
+				// the samples beyond the whiskers, at most Options::maxOutliers (the
+				// farthest from the median)
+				std::vector<double> outliers;
+
+				// the kernel density from the minimum to the maximum sample, if violins
+				std::vector<double> density;
+				double min = 0;
+				double max = 0;
+			};
+
+			struct Options
+			{
+				// outliers kept for each group
+				size_t maxOutliers = 100;
+
+				// points of the violins, 0 for no violins
+				size_t violinPoints = 0;
+
+				// width of the boxes and of the violins
+				double width = 0.5;
+
+				static Options defaultValues(void)
+				{
+					Options opt;
+					return opt;
+				}
+			};
+
+			Boxplot() = default;
+
+			// the samples are not copied, the groups can be empty
+			Boxplot(const std::vector<std::span<const double>>& groups, Options options = Options::defaultValues());
+
+			std::vector<Group> groups;
+			double width = 0.5;
+
+			// the boxes, from q1 to q3, with the whiskers
+			DataPlot boxes(SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+			// the medians, as lines across the boxes
+			DataPlot medians(SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+			DataPlot outliers(SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+			// the densities, mirrored around the groups (see Options::violinPoints)
+			DataPlot violins(SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+		};
+
+		// The envelope of many traces on the same x: for every x the minimum,
+		// the maximum, the mean and some quantiles across the traces. Only them
+		// are sent to gnuplot, as bands and lines.
+		// The traces can be given all together (the quantiles are exact and
+		// computed on multiple threads) or one by one with add(), then the
+		// quantiles are estimated with the P-square algorithm in constant memory.
+		class Ensemble
+		{
+		public:
+
+			struct Options
+			{
+				// the probabilities of the quantiles
+				std::vector<double> quantiles = { 0.05, 0.25, 0.5, 0.75, 0.95 };
+
+				static Options defaultValues(void)
+				{
+					Options opt;
+					return opt;
+				}
+			};
+
+			// streaming, see add()
+			Ensemble(std::vector<double> x, Options options = Options::defaultValues());
+
+			// every trace has a value for each x, the traces are not copied
+			Ensemble(std::vector<double> x, const std::vector<std::span<const double>>& traces, Options options = Options::defaultValues());
+
+			Ensemble(Ensemble&&);
+			Ensemble& operator=(Ensemble&&);
+			~Ensemble();
+
+			// Adds a trace (streaming), the trace can be discarded afterwards.
+			// The NaN values are skipped.
+			void add(std::span<const double> trace);
+
+			std::vector<double> x;
+
+			// the number of values for each x
+			std::vector<size_t> count;
+
+			std::vector<double> min;
+			std::vector<double> max;
+			std::vector<double> mean;
+
+			// quantiles[k][i] is the quantile of Options::quantiles[k] at x[i]
+			std::vector<double> probabilities;
+			std::vector<std::vector<double>> quantiles;
+
+			// The area between two quantiles, 0 and 1 are the minimum and the
+			// maximum. The quantiles must be computed (see Options::quantiles).
+			DataPlot band(double low, double high, SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+			// a quantile as a line, for example the median (0.5)
+			DataPlot quantile(double probability, SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+			DataPlot meanLine(SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+		private:
+
+			const std::vector<double>& values(double probability) const;
+
+			// the quantile estimators of the streaming traces
+			struct Sketches;
+			std::unique_ptr<Sketches> m_pSketches;
+		};
+
+		// The contour lines of a matrix, found here with marching squares (the
+		// rows are split across threads) and joined into polylines: only the
+		// lines are sent to gnuplot instead of the matrix.
+		class Contour
+		{
+		public:
+
+			struct Options
+			{
+				// the values of the lines, if empty levelCount values evenly
+				// spaced within the minimum and the maximum of the matrix
+				std::vector<double> levels = {};
+				size_t levelCount = 10;
+
+				// see Surface::origin and Surface::step
+				std::optional<Vector2d> origin = {};
+				std::optional<Vector2d> step = {};
+
+				static Options defaultValues(void)
+				{
+					Options opt;
+					return opt;
+				}
+			};
+
+			struct Line
+			{
+				double level = 0;
+
+				// closed lines end with their first point
+				std::vector<double> x;
+				std::vector<double> y;
+			};
+
+			Contour() = default;
+
+			// the matrix is only read here, NaN values have no lines around them
+			Contour(MatrixView<float> matrix, Options options = Options::defaultValues());
+			Contour(MatrixView<double> matrix, Options options = Options::defaultValues());
+
+			std::vector<double> levels;
+			std::vector<Line> lines;
+
+			// the lines, divided by empty lines
+			DataPlot isolines(SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+			// the level of each line written at its middle point, the lines shorter
+			// than minPoints are not labelled
+			DataPlot labels(size_t minPoints = 10, SinglePlotOptions options = SinglePlotOptions::defaultValues()) const;
+
+		private:
+
+			template <class T>
+			void trace(const MatrixView<T>& matrix, const Options& options);
+		};
+
+		enum class Terminal
+		{
+			None,
+			Qt,
+			PNG,
+			JPEG,
+			PDF
+		};
+
+		using FrameTiming = GnuplotPipe::FrameTiming;
+		using Message = GnuplotPipe::Message;
+
+		struct MultiplotGuard final : private ScopeGuard
+		{
+			MultiplotGuard(Gnuplotpp* pGp) : ScopeGuard([pGp]() { pGp->endMultiplot(); }) {};
+			operator bool() const { return true; };
+			friend class Gnuplotpp;
+		};
+
+		// ================================
+		//          CONSTRUCTORS
+		// ================================
+
+		// Default constructor
+		Gnuplotpp(bool persist = true, size_t buffSize = 1 << 10);
+
+		// use a file
+		Gnuplotpp(std::ofstream&& oFileStream);
+
+		// use a different ostream
+		// not necessary, unique is convertible to shared...
+		// TODO modify to avoid ambiguity
+		//Gnuplotpp(std::unique_ptr<std::ostream>&& ostream);
+
+		// use a different ostream
+		Gnuplotpp(std::shared_ptr<std::ostream> ostream);
+
+		// default move costructor
+		Gnuplotpp(Gnuplotpp&&) = default;
+
+		// ================================
+		//           DESTRUCTOR
+		// ================================
+
+		~Gnuplotpp();
+
+		// ================================
+		//          COMUNICATION
+		// ================================
+
+		void sendLine(const std::string& line);
+
+		void resetSession(void);
+
+		// Gnuplotpp remembers the settings it has sent (terminal, title, labels,
+		// ticks and grid) and does not send them again if they do not change.
+		// Call this after changing them in other ways, for example writing
+		// commands with <<. sendLine() and resetSession() call it.
+		// The next refresh() draws the last plot again instead of "refresh".
+		void invalidateSessionState(void);
+
+		void setTerminal(Terminal term = Terminal::None, std::optional<std::string> outFile = {}, std::optional<Vector2i> size = {});
+
+		void setTitle(std::optional<std::string> title = {});
+
+		void xLabel(std::optional<std::string> label = {});
+		void yLabel(std::optional<std::string> label = {});
+
+		// Sets the axis range (min, max), with no params the axis is autoscaled
+		void setXRange(std::optional<Vector2d> range = {});
+		void setYRange(std::optional<Vector2d> range = {});
+
+		// Plot a vector of double values
+		// Note that options.cols is ignored
+		// examples:
+		//  - gnuplot.plot(your_data)
+		//  - gnuplot.plot(your_data, { .spacing=0.1 })
+		//  - gnuplot.plot(your_data, { .spacing=0.1, .options={ .title="Hello There!" } })
+		//  - gnuplot.plot({ 42, 40, 30, 20, 10, 0 }, { .spacing=0.1, .options={ .title="Hello There!" } })
+		// TODO update examples
+		// TODO STATIC
+		static Plot2d plot(const std::vector<double>& data, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+#if defined(_GNUPLOTPP_USE_CONCEPTS)
+		// Plot a vector of real values
+		// Note that options.cols is ignored
+		// examples:
+		//  - gnuplot.plot(your_data)
+		//  - gnuplot.plot(your_data, { .spacing=0.1 })
+		//  - gnuplot.plot(your_data, { .spacing=0.1, .options={ .title="Hello There!" } })
+		//  - gnuplot.plot({ 42, 40, 30, 20, 10, 0 }, { .spacing=0.1, .options={ .title="Hello There!" } })
+		// TODO update examples
+		template <std::convertible_to<double> Ty>
+		static Plot2d plot(const std::vector<Ty>& data, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+#endif
+
+		static Plot2d plot(const std::vector<double>& xData, const std::vector<double>& yData, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+#if defined(_GNUPLOTPP_USE_CONCEPTS)
+		template <std::convertible_to<double> Ty>
+		static Plot2d plot(const std::vector<Ty>& xData, const std::vector<Ty>& yData, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+#endif
+
+		// Creates an errorbar plot.
+		// Data can be passes through an ErrorbarData struct, at leas one of X or Y errrors
+		// must be present
+		static Errorbar errorbar(ErrorbarData data, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+		// Creates a heatmap of a matrix, see Image
+		static Image image(MatrixView<float> matrix, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+		static Image image(MatrixView<double> matrix, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+		// Creates a density plot of some points with a cell for each pixel of
+		// the terminal, see Density
+		Density density(std::span<const double> x, std::span<const double> y, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues()) const;
+
+		// Aggregates some ticks in candles, about one for every 4 pixels of the
+		// terminal, see Ohlc
+		Ohlc ohlc(std::span<const double> time, std::span<const double> price, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues()) const;
+
+		// Creates a kernel density estimation of some samples, see Kde
+		static Kde kde(std::span<const double> samples, KdeOptions kdeOptions = KdeOptions::defaultValues(), SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+		// Computes the box plots of some groups of samples, see Boxplot
+		static Boxplot boxplot(const std::vector<std::span<const double>>& groups, Boxplot::Options options = Boxplot::Options::defaultValues());
+
+		// Computes the envelope of some traces on the same x, see Ensemble
+		static Ensemble ensemble(std::vector<double> x, const std::vector<std::span<const double>>& traces, Ensemble::Options options = Ensemble::Options::defaultValues());
+
+		// Computes the contour lines of a matrix, see Contour
+		static Contour contour(MatrixView<float> matrix, Contour::Options options = Contour::Options::defaultValues());
+		static Contour contour(MatrixView<double> matrix, Contour::Options options = Contour::Options::defaultValues());
+
+		// Creates the spectrogram of some samples, more can be appended later,
+		// see Spectrogram
+		static Spectrogram spectrogram(std::span<const double> samples, Spectrogram::Options spectrogramOptions = Spectrogram::Options::defaultValues(), SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+		// Creates a histogram of some samples, see Histogram
+		static Histogram histogram(std::span<const double> samples, size_t bins = 100, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+		// Creates a 3D surface of a matrix, see Surface
+		static Surface surface(MatrixView<float> matrix, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+		static Surface surface(MatrixView<double> matrix, SinglePlotOptions singlePlotOptions = SinglePlotOptions::defaultValues());
+
+		using Plot2dRef = std::reference_wrapper<const Plot2dBase>;
+
+		// TOOD description ...
+		// Once the plots options have been seen, drawing does not allocate memory
+		// (a list kept by the caller, or a braced list, and no asynchronous
+		// streams), internal buffers are reused.
+		void draw(const std::list<Plot2dRef>& plots);
+		void draw(std::initializer_list<Plot2dRef> plots);
+
+		// Draws again the plots of the last draw() with the current settings,
+		// to apply view changes (ranges, labels, ticks, grid, ...) without the
+		// data. Gnuplot "refresh" is used while the data of the last draw() is
+		// still in gnuplot memory, otherwise (for example after resetSession(),
+		// a Figure, a multiplot or sendLine()) the frame is drawn again with the
+		// data kept by Gnuplotpp.
+		// Throws in multiplot mode, if nothing has been drawn or if the data is
+		// needed but it was only borrowed (see Image::pOwner).
+		void refresh(void);
+
+		// Sets where the buffers of draw() are allocated: the formatted data,
+		// that the streams keep until it is sent, and the buffer the plots fill.
+		// The resource must outlive the Gnuplotpp object and be thread safe if
+		// there are asynchronous streams, a long lived pool (for example of huge
+		// pages) fits, a per frame arena does not: use it for your DataBuffers.
+		void setMemoryResource(std::pmr::memory_resource* resource);
+
+		void setTicksOptions(std::optional<TicksOptions> options = {});
+
+		void setGridOptions(std::optional<GridOptions> options = {});
+
+		// Draws a color box with the plots (palette and cbrange are set to the
+		// colorbox ones), for example for an Image shaded with a colormap:
+		// give them the same range. Not drawn by Figures.
+		void setColorbox(std::optional<Colorbox> colorbox = {});
+
+		Vector2d getMouseClick(void);
+
+		void setOrigin(const Vector2d& pos);
+		void setOrigin(void);
+
+		void setSize(const Vector2d& pos);
+		void setSize(void);
 
 		void beginMultiplot(size_t rows, size_t cols);
 		void endMultiplot(void);
 
 		MultiplotGuard multiplot(size_t rows, size_t cols);
 
+		// ================================
+		//          FRAME TIMING
+		// ================================
+
+		// After every draw() a fence is sent to gnuplot, when gnuplot prints it back
+		// the frame is done. These functions need the gnuplot pipe (the default
+		// constructor) on a POSIX system, otherwise they do nothing.
+
+		// Sets a function called every time gnuplot finishes a frame.
+		// Note: it is called from the thread reading the gnuplot output.
+		void setFrameCallback(std::function<void(const FrameTiming&)> callback);
+
+		// The timing of the last frame gnuplot has finished
+		std::optional<FrameTiming> lastFrameTiming(void) const;
+
+		// Waits for gnuplot to finish the frames drawn so far.
+		// Returns false on timeout or if there is no gnuplot pipe.
+		bool waitFrames(std::optional<std::chrono::steady_clock::duration> timeout = {});
+
+		// ================================
+		//            QUERIES
+		// ================================
+
+		// Queries are sent right away and answered by the thread reading the gnuplot
+		// output: send all the queries you need, then wait for the answers. The
+		// futures throw a GnuplotError if gnuplot reports an error.
+		// These functions need the gnuplot pipe on a POSIX system, otherwise they
+		// throw.
+
+		// Executes a command (for example "show xrange") and returns what gnuplot prints
+		std::future<std::string> query(const std::string& command);
+
+		// Returns the value of a gnuplot expression, for example "GPVAL_X_MAX"
+		std::future<std::string> queryValue(const std::string& expression);
+
+		// The gnuplot messages (errors, warnings, ...) received so far, errors
+		// tell the command that caused them
+		std::vector<Message> takeMessages(void);
+
+		// The gnuplot standard output received so far, only if it is not forwarded
+		std::string takeOutput(void);
+
+		// If true (default) gnuplot output and messages are also written on
+		// stdout and stderr
+		void setForwardOutput(bool forward);
+
 #ifdef _GNUPLOTPP_USE_LC_LIBRARY
 
 		// ...
@@ -548,35 +1707,179 @@ namespace lc
 
 		//void lineStyle(LineStyle style);
 
+		// Returns a new ID for a gnuplot line style. The released IDs are reused,
+		// but only after cleanIDs() has undefined them.
 		CommandLineID createNewID(void);
 
+		// Undefines the line styles (IDs) that are not used anymore and calls
+		// their onExit. It is done automatically by draw().
 		void cleanIDs(void);
 
+		// Returns the ID of a line style defined in gnuplot. Equal styles share
+		// the same ID and they are defined only once, when the returned IDs are
+		// released the style is undefined.
+		CommandLineID lineStyleID(const LineStyle& lineStyle);
+
 		// impossible, see https://stackoverflow.com/questions/20774587/why-cant-stdostream-be-moved
 		//void addOstream(std::ostream&& ostream);
 
 		//void addOstream(std::unique_ptr<std::ostream>&& pOstream);
 
-		void addOstream(const std::shared_ptr<std::ostream>& pOstream);
+		// Add an ostream the commands are sent to.
+		// params:
+		//  - async : write on the ostream from a dedicated thread, useful for slow
+		//    ostreams (for example files) that should not hold up gnuplot
+		void addOstream(const std::shared_ptr<std::ostream>& pOstream, bool async = false);
 
 		// already in MultiStream
 		//void addRdbuf(std::streambuf* streambuf);
 
+		// Write the commands also on a file.
+		// The file is written asynchronously and does not slow down the gnuplot pipe.
 		void writeCommandsOnFile(const std::filesystem::path& path);
 
 		void writeCommandsOnFile(std::ofstream&& file);
 
+		// Record the session in a compact binary file (see SessionRecorder), it can
+		// be replayed with the gnuplotpp_replay app.
+		// The file is written asynchronously.
+		void recordSession(const std::filesystem::path& path);
+
+		// Write the commands on a gnuplot script, like writeCommandsOnFile(), but
+		// with every inline data block saved on a binary file the script refers to
+		// (see ScriptExporter). The files are written asynchronously.
+		void exportScript(const std::filesystem::path& path);
+
 	private:
 
-		// TODO implement and use
+		struct TerminalState
+		{
+			Terminal term = Terminal::None;
+			std::optional<std::string> outFile = {};
+			std::optional<std::pair<int, int>> size = {};
+
+			bool operator==(const TerminalState&) const = default;
+		};
+
+		// The settings sent to gnuplot, an empty optional means unknown
+		struct SessionState
+		{
+			std::optional<TerminalState> terminal;
+			std::optional<std::optional<std::string>> title;
+			std::optional<std::optional<std::string>> xLabel;
+			std::optional<std::optional<std::string>> yLabel;
+			std::optional<std::optional<std::pair<double, double>>> xRange;
+			std::optional<std::optional<std::pair<double, double>>> yRange;
+			std::optional<std::optional<TicksOptions>> ticks;
+			std::optional<std::optional<GridOptions>> grid;
+			std::optional<std::optional<Colorbox>> colorbox;
+		};
+
+		// The data of a plot in a DrawnFrame
+		struct FrameData
+		{
+			// keeps data valid: a string of m_dataPool or the owner given by the
+			// plot, if null data was borrowed during draw() and it is not valid
+			std::shared_ptr<const void> pOwner;
+			const char* data = nullptr;
+			size_t size = 0;
+
+			bool binary = false;
+		};
+
+		// The plots of the last draw(), enough to draw them again
+		struct DrawnFrame
+		{
+			std::vector<PlotOptions> options;
+			std::vector<FrameData> data;
+
+			// the session it was drawn in
+			size_t session = 0;
+
+			// true if gnuplot can refresh it (it is the last plot, not in a multiplot)
+			bool resident = false;
+		};
+
 		std::shared_ptr<CommandLineIDImpl> createNewIDImpl(void);
 
+		// Drops the plot clauses not used for a while and the released line
+		// styles, called at the beginning of a frame
+		void beginFrame(void);
+
+		// Ends the frame started at begin and sends its fence
+		void finishFrame(std::chrono::steady_clock::time_point begin);
+
+		// draw() on a container of Plot2dRef
+		template <class Plots>
+		void drawPlots(const Plots& plots);
+
+		// Sends the plot command and the data of a frame
+		void drawFrame(DrawnFrame& frame, std::chrono::steady_clock::time_point begin);
+
+		// a string of m_dataPool not used by anybody else
+		std::shared_ptr<std::pmr::string> dataString(void);
+
+		// sets an axis range, axis is "x" or "y"
+		void setRange(const char* axis, std::optional<std::optional<std::pair<double, double>>>& sent, std::optional<Vector2d> range);
+
+		// Returns the plot clause of the options, the first time the options are
+		// seen the line styles they need are defined and the clause is formatted.
+		const std::string& plotFragment(const PlotOptions& options);
+
 	private:
 		std::list<std::variant<
 			std::unique_ptr<std::ostream>,
 			std::shared_ptr<std::ostream>>
 			> m_ostreams;
-		std::map<size_t, std::weak_ptr<CommandLineIDImpl>> m_idMap;
+		std::shared_ptr<IDRegistry> m_pIDs = std::make_shared<IDRegistry>();
+
+		// line styles defined in gnuplot
+		std::unordered_map<LineStyle, std::weak_ptr<CommandLineIDImpl>, LineStyleHash> m_lineStyles;
+
+		// the line styles of the grid, they are kept while the grid uses them
+		std::vector<CommandLineID> m_gridStyleIDs;
+
+		SessionState m_sessionState;
+
+		// plot clauses already formatted, they are valid until the session is reset
+		std::unordered_map<PlotOptions, PlotFragment, PlotOptionsHash> m_plotFragments;
+
+		// the pipe opened by the default constructor (owned by m_ostreams)
+		GnuplotPipe* m_pGnuplotPipe = nullptr;
+		size_t m_frames = 0;
+
+		std::optional<DrawnFrame> m_lastFrame;
+		bool m_multiplot = false;
+
+		// the color box drawn with the plots, see setColorbox()
+		std::optional<Colorbox> m_colorbox;
+
+		// the size of the terminal in pixels, see density()
+		Vector2i m_canvasSize = Vector2i(640, 480);
+
+		// commands are formatted here, it keeps its memory
+		std::string m_command;
+
+		// scratch state of draw(), kept to reuse its memory
+		std::unique_ptr<DataBuffer> m_pDataBuffer;
+		std::vector<const std::string*> m_fragments;
+
+		// the strings with the formatted data, they are reused when the streams
+		// (for example the gnuplot pipe while it sends them) do not use them anymore
+		std::vector<std::shared_ptr<std::pmr::string>> m_dataPool;
+
+		// where the data strings and the scratch data buffer are allocated
+		std::pmr::memory_resource* m_pResource = std::pmr::get_default_resource();
+
+		// incremented by resetSession(), what was defined before is gone
+		size_t m_session = 0;
+
+		// used to name the datablocks of the figures
+		size_t m_figures = 0;
+
+		// the figure that sent the last multiplot, the one "remultiplot" draws
+		// again; none after another multiplot or a session reset
+		std::optional<size_t> m_multiplotFigure;
 	};
 
 	// ================================================================
@@ -598,7 +1901,8 @@ namespace lc
 		// Construct a buffer with a specific number of columns
 		// params:
 		//  - cols : number of columns, default value is 1
-		DataBuffer(size_t cols = 1);
+		//  - resource : where the values are allocated, it must outlive the buffer
+		DataBuffer(size_t cols = 1, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
 		// Copy constructor
 		DataBuffer(const DataBuffer&) = default;
@@ -621,6 +1925,16 @@ namespace lc
 		// Get the number of rows
 		size_t rows(void) const { return m_data.size() / this->cols(); };
 
+		// Removes the data and sets the number of columns, the memory is kept
+		void reset(size_t cols = 1);
+
+		// Reserves the memory for some rows
+		void reserve(size_t rows) { m_data.reserve(rows * this->cols()); };
+
+		// The memory resource of the values. Copies use the default resource
+		// (as std::pmr containers do), moves keep it.
+		std::pmr::memory_resource* resource(void) const { return m_data.get_allocator().resource(); };
+
 		// =========== access =============
 
 		// Acces a specific element
@@ -671,19 +1985,166 @@ namespace lc
 		// TODO description
 		DataBuffer& operator<<(std::function<DataBuffer&(DataBuffer&)> f);
 
+		// ========== blocks ==============
+
+		// Ends a block of rows, gnuplot sees an empty line: for example the
+		// curves of a plot are not joined and the polygons are filled one by one
+		void endBlock(void) { m_blockEnds.push_back(this->rows()); };
+
+		// the number of rows at the end of each block
+		const std::pmr::vector<size_t>& blockEnds(void) const { return m_blockEnds; };
+
 	private:
 
 		friend DataBuffer& endRow(DataBuffer&);
 
 	private:
 		size_t m_cols = 0;
-		std::vector<double> m_data;
-		std::vector<double> m_tmpData;
+		std::pmr::vector<double> m_data;
+		std::pmr::vector<double> m_tmpData;
+		std::pmr::vector<size_t> m_blockEnds;
 	};
-}
 
-std::ostream& operator<<(std::ostream& ostream, const lc::Gnuplotpp::DataBuffer& buffer);
-std::ostream& operator<<(std::ostream& ostream, const lc::Gnuplotpp::Color& color);
+	// these are in the lc namespace so that they are found (through ADL) by
+	// the MultiStream::operator<< template
+	std::ostream& operator<<(std::ostream& ostream, const Gnuplotpp::DataBuffer& buffer);
+	std::ostream& operator<<(std::ostream& ostream, const Gnuplotpp::Color& color);
+
+	// ================================================================
+	//                        GNUPLOT++ FIGURE
+	// ================================================================
+
+	// A multiplot kept by the library: every panel remembers its settings and
+	// its plots, the data of the plots is kept in gnuplot datablocks.
+	// draw() sends only the datablocks whose data changed, if the panels
+	// commands did not change either the multiplot is redrawn with
+	// "remultiplot", otherwise the (already formatted) commands of every panel
+	// are sent again, without the data.
+	// Empty panels and remultiplot need gnuplot 5.4, see Options.
+	// The Gnuplotpp object must outlive the figure.
+	class Gnuplotpp::Figure : ::lc::NonCopyable
+	{
+	public:
+
+		// ================================
+		//        SUB-CLASSES/ENUMS
+		// ================================
+
+		struct Options
+		{
+			// redraw with "remultiplot" when only the data changed, if false
+			// the panels commands are always sent
+			bool remultiplot = true;
+		};
+
+		class Panel
+		{
+		public:
+
+			Panel(Panel&&) = default;
+
+			void setTitle(std::optional<std::string> title = {});
+
+			void xLabel(std::optional<std::string> label = {});
+			void yLabel(std::optional<std::string> label = {});
+
+			// Sets the plots of the panel. The data is formatted now and sent
+			// by the next Figure::draw(), only if it is different from the data
+			// already sent.
+			void setPlots(const std::list<Plot2dRef>& plots);
+
+			// Removes the plots
+			void clear(void);
+
+		private:
+
+			Panel(std::string name) : m_name(std::move(name)) {};
+
+			// a plot of the panel
+			struct Series
+			{
+				PlotOptions options;
+
+				// formatted data, shared with the streams while it is sent
+				std::shared_ptr<const std::string> pData;
+
+				// true if the datablock has been sent
+				bool sent = false;
+
+				// set by Figure::draw(), it keeps the line styles defined
+				std::unique_ptr<PlotOptionsSerializer> pSerializer;
+			};
+
+			// name of the datablock of a series
+			std::string datablock(size_t i) const;
+
+			// the commands drawing the panel, inside the multiplot
+			void formatCommands(Gnuplotpp& gp);
+
+			friend class Figure;
+
+		private:
+			std::string m_name;
+
+			std::optional<std::string> m_title;
+			std::optional<std::string> m_xLabel;
+			std::optional<std::string> m_yLabel;
+
+			std::vector<Series> m_series;
+
+			// number of datablocks defined in gnuplot, the ones of the removed
+			// series are undefined by the next draw()
+			size_t m_definedSeries = 0;
+
+			// the formatted commands, valid if not m_changed
+			std::string m_commands;
+			bool m_changed = true;
+		};
+
+		// ================================
+		//          CONSTRUCTORS
+		// ================================
+
+		Figure(Gnuplotpp& gp, size_t rows, size_t cols);
+		Figure(Gnuplotpp& gp, size_t rows, size_t cols, Options options);
+
+		// ================================
+		//            PANELS
+		// ================================
+
+		size_t rows(void) const { return m_rows; };
+		size_t cols(void) const { return m_cols; };
+
+		// The panel in a position, panels are filled by rows
+		Panel& panel(size_t row, size_t col);
+
+		// ================================
+		//            DRAWING
+		// ================================
+
+		// Sends what changed since the last draw() and redraws the figure
+		void draw(void);
+
+		// Forgets what was sent, the next draw() sends everything.
+		// It is done automatically after Gnuplotpp::resetSession().
+		void invalidate(void);
+
+	private:
+		Gnuplotpp& m_gp;
+		size_t m_rows = 0;
+		size_t m_cols = 0;
+		Options m_options;
+
+		std::vector<Panel> m_panels;
+
+		// the multiplot commands have been sent in this session
+		bool m_sent = false;
+		size_t m_session = 0;
+
+		// see Gnuplotpp::m_multiplotFigure
+		size_t m_id = 0;
+	};
+}
 
 // ================================================================================================================================
 // ================================================================================================================================
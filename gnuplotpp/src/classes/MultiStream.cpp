@@ -11,16 +11,513 @@
 LC_NOTICE_END */
 
 #include <gnuplotpp/classes/MultiStream.hpp>
+#include <gnuplotpp/classes/PipeStreamBuf.hpp>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <utility>
+#include <locale>
 
 namespace lc
 {
+	// ================================================================
+	//                       STREAMBUF SINK
+	// ================================================================
+
+	namespace
+	{
+		// Adapts a plain streambuf to the Sink interface, the chunk kinds are ignored
+		class StreambufSink : public MultiStream::Sink
+		{
+		public:
+
+			StreambufSink(std::streambuf* streambuf) : m_pStreambuf(streambuf) {};
+
+			void write(const MultiStream::Chunk& chunk) override
+			{
+				if (chunk.size > 0)
+					m_pStreambuf->sputn(chunk.data, chunk.size);
+			}
+
+			void sync(void) override
+			{
+				m_pStreambuf->pubsync();
+			}
+
+		private:
+			std::streambuf* m_pStreambuf;
+		};
+
+		// Like StreambufSink, but large chunks that have an owner are given to the
+		// pipe without copying them
+		class PipeSink : public MultiStream::Sink
+		{
+		public:
+
+			PipeSink(PipeStreamBuf* pipeStreamBuf) : m_pPipeStreamBuf(pipeStreamBuf) {};
+
+			void write(const MultiStream::Chunk& chunk) override
+			{
+				if (chunk.owner && chunk.size >= PipeStreamBuf::zeroCopyThreshold)
+					m_pPipeStreamBuf->writeShared(chunk.data, chunk.size, chunk.owner);
+				else if (chunk.size > 0)
+					m_pPipeStreamBuf->sputn(chunk.data, chunk.size);
+			}
+
+			void sync(void) override
+			{
+				m_pPipeStreamBuf->pubsync();
+			}
+
+		private:
+			PipeStreamBuf* m_pPipeStreamBuf;
+		};
+	}
+
+	// ================================================================
+	//                    MULTI-STREAM STREAMBUF
+	// ================================================================
+
+	// This is the streambuf the MultiStream formats into. It collects the bytes
+	// of a command (or of a data block) and, on sync(), hands them to every sink.
+	class MultiStream::FanOutStreamBuf : public std::streambuf
+	{
+	public:
+
+		FanOutStreamBuf();
+
+		~FanOutStreamBuf() override;
+
+		void addSink(std::shared_ptr<Sink> pSink, bool async);
+
+		// sends the pending bytes as a chunk of the given kind and sets the kind
+		// of the following chunks
+		void send(ChunkKind kind, ChunkKind nextKind);
+
+		// sends the pending bytes and then a chunk owned by pOwner
+		void sendShared(std::shared_ptr<const void> pOwner, const char* data, size_t size);
+
+		// waits for the asynchronous sinks to write everything they received
+		void wait(void);
+
+		// sends the pending bytes and detaches all the sinks
+		void close(void);
+
+	protected:
+
+		int sync(void) override;
+
+		int_type overflow(int_type ch = std::char_traits<char>::eof()) override;
+
+	private:
+
+		// writes the pending bytes on every sink
+		// params:
+		//  - flush : tells the sinks to flush after writing
+		void dispatch(ChunkKind kind, bool flush);
+
+		// writes a chunk on every sink
+		void dispatch(const Chunk& chunk, bool flush);
+
+	private:
+
+		struct Destination;
+
+		// above this size the pending bytes are dispatched even if no sync() was
+		// requested, this way huge data blocks do not accumulate in memory
+		static constexpr size_t maxPending = 1 << 20;
+
+		// the bytes queued for an asynchronous sink (and not yet written) are at
+		// most this, above it the writer waits: a slow sink cannot use up the memory
+		static constexpr size_t maxQueued = 64 << 20;
+
+		std::vector<char> m_buff;
+		ChunkKind m_kind = ChunkKind::Command;
+		std::list<std::unique_ptr<Destination>> m_destinations;
+	};
+
+	// ================================
+	//          DESTINATION
+	// ================================
+
+	// A sink as seen by the fan-out buffer. Synchronous sinks are written directly
+	// from the fan-out buffer, asynchronous sinks receive a shared copy of each
+	// chunk and are written on their own thread. An exception thrown by an
+	// asynchronous sink is kept and reported by wait(), the sink is not written
+	// anymore.
+	struct MultiStream::FanOutStreamBuf::Destination : NonCopyable
+	{
+		struct QueuedChunk
+		{
+			Chunk chunk;
+			bool flush = false;
+		};
+
+		std::shared_ptr<Sink> pSink;
+		bool async = false;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<QueuedChunk> queue;
+		size_t queuedBytes = 0;
+		bool busy = false;
+		bool stop = false;
+		std::thread worker;
+
+		// the error of the sink, not yet reported
+		std::exception_ptr error;
+		bool failed = false;
+
+		Destination(std::shared_ptr<Sink> pSink, bool async) :
+			pSink(std::move(pSink)),
+			async(async)
+		{
+			if (async)
+				worker = std::thread([this]() { this->run(); });
+		}
+
+		~Destination()
+		{
+			if (worker.joinable())
+			{
+				{
+					std::lock_guard lock(mutex);
+					stop = true;
+				}
+				cv.notify_all();
+				worker.join();
+			}
+		}
+
+		void push(QueuedChunk chunk)
+		{
+			{
+				std::unique_lock lock(mutex);
+
+				// a chunk larger than the limit passes alone
+				cv.wait(lock, [&]() { return queuedBytes == 0 || queuedBytes + chunk.chunk.size <= maxQueued; });
+
+				queuedBytes += chunk.chunk.size;
+				queue.push_back(std::move(chunk));
+			}
+			cv.notify_all();
+		}
+
+		// returns (and forgets) the error of the sink, if any
+		std::exception_ptr wait(void)
+		{
+			std::unique_lock lock(mutex);
+			cv.wait(lock, [this]() { return queue.empty() && !busy; });
+			return std::exchange(error, nullptr);
+		}
+
+		void run(void)
+		{
+			std::unique_lock lock(mutex);
+			while (true)
+			{
+				cv.wait(lock, [this]() { return stop || !queue.empty(); });
+
+				if (queue.empty())
+					// stop requested and nothing left to write
+					return;
+
+				// take everything queued so far and write it without holding the lock
+				std::deque<QueuedChunk> chunks;
+				chunks.swap(queue);
+				busy = true;
+				const bool skip = failed;
+				lock.unlock();
+
+				// a throwing sink must not end the thread (std::terminate)
+				std::exception_ptr exception;
+				size_t bytes = 0;
+				for (const auto& queued : chunks)
+					bytes += queued.chunk.size;
+				try
+				{
+					bool flush = false;
+					for (const auto& queued : chunks)
+					{
+						if (skip)
+							break;
+						pSink->write(queued.chunk);
+						flush = flush || queued.flush;
+					}
+
+					// a single flush for the whole batch
+					if (flush)
+						pSink->sync();
+				}
+				catch (...)
+				{
+					exception = std::current_exception();
+				}
+
+				// the chunks are released before the writer can queue more
+				chunks.clear();
+
+				lock.lock();
+				queuedBytes -= bytes;
+				if (exception)
+				{
+					error = exception;
+					failed = true;
+				}
+				busy = false;
+				cv.notify_all();
+			}
+		}
+	};
+
+	// ================================
+	//       FAN-OUT STREAMBUF
+	// ================================
+
+	////////////////////////////////////////////////////////////////
+	MultiStream::FanOutStreamBuf::FanOutStreamBuf()
+	{
+		m_buff.resize(1 << 10);
+		this->setp(m_buff.data(), m_buff.data() + m_buff.size());
+	}
+
+	////////////////////////////////////////////////////////////////
+	MultiStream::FanOutStreamBuf::~FanOutStreamBuf()
+	{
+		this->close();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::FanOutStreamBuf::addSink(std::shared_ptr<Sink> pSink, bool async)
+	{
+		m_destinations.emplace_back(std::make_unique<Destination>(std::move(pSink), async));
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::FanOutStreamBuf::send(ChunkKind kind, ChunkKind nextKind)
+	{
+		this->dispatch(kind, true);
+		m_kind = nextKind;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::FanOutStreamBuf::sendShared(std::shared_ptr<const void> pOwner, const char* data, size_t size)
+	{
+		this->dispatch(m_kind, false);
+		this->dispatch(Chunk{ m_kind, data, size, std::chrono::steady_clock::now(), std::move(pOwner) }, false);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::FanOutStreamBuf::wait(void)
+	{
+		// every destination is waited, then the first error is thrown
+		std::exception_ptr error;
+		for (auto& pDestination : m_destinations)
+			if (pDestination->async)
+				if (auto e = pDestination->wait(); e && !error)
+					error = e;
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::FanOutStreamBuf::close(void)
+	{
+		this->dispatch(m_kind, true);
+
+		// this joins the asynchronous writers after they have written everything
+		m_destinations.clear();
+	}
+
+	////////////////////////////////////////////////////////////////
+	int MultiStream::FanOutStreamBuf::sync(void)
+	{
+		this->dispatch(m_kind, true);
+
+		// a failing sink shall not stop the others, therefore this never fails
+		return 0;
+	}
+
+	////////////////////////////////////////////////////////////////
+	MultiStream::FanOutStreamBuf::int_type MultiStream::FanOutStreamBuf::overflow(int_type ch)
+	{
+		const size_t N = this->pptr() - this->pbase();
+
+		if (N >= maxPending && m_kind == ChunkKind::Data)
+		{
+			// a large data block: instead of copying, the buffer itself is given
+			// to the sinks and a new one is used
+			auto pBuff = std::make_shared<const std::vector<char>>(std::move(m_buff));
+			m_buff = std::vector<char>(pBuff->size());
+			this->setp(m_buff.data(), m_buff.data() + m_buff.size());
+			this->dispatch(Chunk{ m_kind, pBuff->data(), N, std::chrono::steady_clock::now(), pBuff }, false);
+		}
+		else if (N >= maxPending)
+		{
+			// too much pending data, send it without flushing
+			this->dispatch(m_kind, false);
+		}
+		else
+		{
+			// grow the buffer keeping the pending bytes
+			m_buff.resize(m_buff.size() * 2);
+			this->setp(m_buff.data(), m_buff.data() + m_buff.size());
+			this->pbump(static_cast<int>(N));
+		}
+
+		if (ch != std::char_traits<char>::eof())
+		{
+			*this->pptr() = std::char_traits<char>::to_char_type(ch);
+			this->pbump(1);
+		}
+
+		return std::char_traits<char>::not_eof(ch);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::FanOutStreamBuf::dispatch(ChunkKind kind, bool flush)
+	{
+		const size_t N = this->pptr() - this->pbase();
+
+		// empty commands and data parts carry no information, the
+		// markers (DataEnd, Frame) are always sent
+		if (N == 0 && (kind == ChunkKind::Command || kind == ChunkKind::Data))
+		{
+			if (flush)
+				this->dispatch(Chunk{}, true);
+			return;
+		}
+
+		this->dispatch(Chunk{ kind, this->pbase(), N, std::chrono::steady_clock::now() }, flush);
+
+		// reset pointers
+		this->setp(m_buff.data(), m_buff.data() + m_buff.size());
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::FanOutStreamBuf::dispatch(const Chunk& chunk, bool flush)
+	{
+		// an empty command only carries the flush
+		const bool empty = chunk.size == 0 && chunk.kind == ChunkKind::Command;
+
+		// the chunk for the asynchronous sinks is copied only once and shared
+		std::shared_ptr<const std::string> pCopy;
+
+		for (auto& pDestination : m_destinations)
+		{
+			if (pDestination->async)
+			{
+				Destination::QueuedChunk queued{ chunk, flush };
+				if (!queued.chunk.owner)
+				{
+					// the data must outlive this call
+					if (!pCopy)
+						pCopy = std::make_shared<const std::string>(chunk.data, chunk.size);
+					queued.chunk.data = pCopy->data();
+					queued.chunk.owner = pCopy;
+				}
+				pDestination->push(std::move(queued));
+			}
+			else
+			{
+				if (!empty)
+					pDestination->pSink->write(chunk);
+				if (flush)
+					pDestination->pSink->sync();
+			}
+		}
+	}
+
 	// ================================================================
 	//                         MULTI-STREAM
 	// ================================================================
 
 	////////////////////////////////////////////////////////////////
-	void MultiStream::addRdbuf(std::streambuf* streambuf)
+	MultiStream::MultiStream() :
+		m_pFanOut(std::make_unique<FanOutStreamBuf>()),
+		m_pFormatter(std::make_unique<std::ostream>(m_pFanOut.get()))
+	{
+		// gnuplot wants "1.5", whatever the global locale is
+		m_pFormatter->imbue(std::locale::classic());
+	}
+
+	////////////////////////////////////////////////////////////////
+	MultiStream::MultiStream(MultiStream&&) = default;
+
+	////////////////////////////////////////////////////////////////
+	MultiStream::~MultiStream()
+	{
+		this->closeRdbufs();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::write(const char* data, size_t size)
+	{
+		m_pFormatter->write(data, static_cast<std::streamsize>(size));
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::write(std::shared_ptr<const void> pOwner, const char* data, size_t size)
 	{
-		m_ostreams.emplace_back(streambuf);
+		m_pFormatter->flush();
+		m_pFanOut->sendShared(std::move(pOwner), data, size);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::beginData(void)
+	{
+		m_pFanOut->send(ChunkKind::Command, ChunkKind::Data);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::endData(void)
+	{
+		m_pFanOut->send(ChunkKind::DataEnd, ChunkKind::Command);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::endFrame(void)
+	{
+		m_pFanOut->send(ChunkKind::Command, ChunkKind::Command);
+		m_pFanOut->send(ChunkKind::Frame, ChunkKind::Command);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::addRdbuf(std::streambuf* streambuf, bool async)
+	{
+		if (auto* pPipeStreamBuf = dynamic_cast<PipeStreamBuf*>(streambuf))
+			this->addSink(std::make_shared<PipeSink>(pPipeStreamBuf), async);
+		else
+			this->addSink(std::make_shared<StreambufSink>(streambuf), async);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::addSink(std::shared_ptr<Sink> pSink, bool async)
+	{
+		m_pFanOut->addSink(std::move(pSink), async);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::flush(void)
+	{
+		m_pFormatter->flush();
+		m_pFanOut->wait();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void MultiStream::closeRdbufs(void)
+	{
+		// moved-from object
+		if (!m_pFanOut)
+			return;
+
+		m_pFanOut->close();
 	}
-}
\ No newline at end of file
+}
@@ -18,6 +18,21 @@ LC_NOTICE_END */
 
 #include "../pipe.hpp"
 
+#if !defined(_WIN32)
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#endif
+
 namespace lc
 {
 	// ================================================================
@@ -32,12 +47,17 @@ namespace lc
 	// https://blog.csdn.net/tangyin025/article/details/50487544
 
 	////////////////////////////////////////////////////////////////
-	PipeStreamBuf::PipeStreamBuf(const std::string& command, size_t buffSize)
+	PipeStreamBuf::PipeStreamBuf(const std::string& command, size_t buffSize, bool captureOutput)
 	{
 		// TODO is a buffer necessary? maybe directly print on the pipe
 		m_buff.resize(buffSize);
 
-		m_pipe = _LC_GNUPLOT_POPEN(command.c_str(), "w");
+#if !defined(_WIN32)
+		if (captureOutput)
+			this->spawn(command);
+		else
+#endif
+			m_pipe = _LC_GNUPLOT_POPEN(command.c_str(), "w");
 		//m_pipe = std::fopen("a.txt", "w");
 
 		if (!m_pipe)
@@ -47,11 +67,152 @@ namespace lc
 	////////////////////////////////////////////////////////////////
 	PipeStreamBuf::~PipeStreamBuf()
 	{
+		this->close();
+
+#if !defined(_WIN32)
+		if (m_outFd >= 0)
+			::close(m_outFd);
+		if (m_errFd >= 0)
+			::close(m_errFd);
+#endif
+	}
+
+	////////////////////////////////////////////////////////////////
+	void PipeStreamBuf::close(void)
+	{
+		if (!m_pipe)
+			return;
+
 		// for flush ??? I don't know if it is necessary
 		this->sync();
 
-		if (m_pipe)
+#if !defined(_WIN32)
+		if (m_pid >= 0)
+		{
+			std::fclose(m_pipe);
+
+			int status = 0;
+			while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR);
+			m_pid = -1;
+		}
+		else
+#endif
 			_LC_GNUPLOT_PCLOSE(m_pipe);
+
+		m_pipe = nullptr;
+
+		// nobody reads the pipe anymore
+		m_pinned.clear();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void PipeStreamBuf::spawn(const std::string& command)
+	{
+#if !defined(_WIN32)
+		// the pipes must not leak into the child, apart from the ends it uses
+		auto makePipe = [](int fds[2]) -> bool
+		{
+			if (pipe(fds) != 0)
+				return false;
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+			return true;
+		};
+
+		int in[2] = { -1, -1 };
+		int out[2] = { -1, -1 };
+		int err[2] = { -1, -1 };
+		auto closeAll = [&]()
+		{
+			for (int fd : { in[0], in[1], out[0], out[1], err[0], err[1] })
+				if (fd >= 0)
+					::close(fd);
+		};
+
+		if (!makePipe(in) || !makePipe(out) || !makePipe(err))
+		{
+			closeAll();
+			throw std::runtime_error("could not open the pipe");
+		}
+
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+
+		// like popen()
+		char* argv[] = { const_cast<char*>("sh"), const_cast<char*>("-c"), const_cast<char*>(command.c_str()), nullptr };
+
+		pid_t pid = -1;
+		const int result = posix_spawn(&pid, "/bin/sh", &actions, nullptr, argv, environ);
+		posix_spawn_file_actions_destroy(&actions);
+
+		if (result != 0)
+		{
+			closeAll();
+			throw std::runtime_error("could not open the pipe");
+		}
+
+		// the child ends
+		::close(in[0]);
+		::close(out[1]);
+		::close(err[1]);
+
+		m_pid = static_cast<int>(pid);
+		m_pipe = fdopen(in[1], "w");
+		m_outFd = out[0];
+		m_errFd = err[0];
+#endif
+	}
+
+	////////////////////////////////////////////////////////////////
+	void PipeStreamBuf::writeShared(const char* data, size_t size, std::shared_ptr<const void> pOwner)
+	{
+		// what is in the buffer comes first
+		this->sync();
+
+#if defined(__linux__)
+		if (m_pipe && m_canSplice && pOwner && size >= zeroCopyThreshold)
+		{
+			const int fd = fileno(m_pipe);
+
+			// a larger pipe means less round trips with gnuplot, it is not
+			// a problem if this fails
+			if (m_pinned.empty())
+				fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+
+			// the pipe refers to the pages of data instead of copying them, therefore
+			// they must not change (or be freed) until gnuplot has read them
+			iovec iov{ const_cast<char*>(data), size };
+			while (iov.iov_len > 0)
+			{
+				const ssize_t n = vmsplice(fd, &iov, 1, 0);
+				if (n < 0)
+				{
+					if (errno == EINTR)
+						continue;
+
+					// not supported (or not a pipe), copy from now on
+					m_canSplice = false;
+					break;
+				}
+
+				iov.iov_base = static_cast<char*>(iov.iov_base) + n;
+				iov.iov_len -= static_cast<size_t>(n);
+				m_written += static_cast<size_t>(n);
+			}
+
+			if (iov.iov_len < size)
+				m_pinned.emplace_back(m_written, std::move(pOwner));
+
+			// the rest is copied
+			data = static_cast<const char*>(iov.iov_base);
+			size = iov.iov_len;
+		}
+#endif
+
+		this->writeRaw(data, size);
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -62,6 +223,8 @@ namespace lc
 			// error
 			return -1;
 
+		this->releaseConsumed();
+
 		// success
 		return 0;
 	}
@@ -69,32 +232,54 @@ namespace lc
 	////////////////////////////////////////////////////////////////
 	PipeStreamBuf::int_type PipeStreamBuf::overflow(int_type ch)
 	{
-		std::string s;
-
 		// number of char in the buffer
-		auto N = this->pptr() - this->pbase();
+		const size_t N = this->pptr() - this->pbase();
 
-		s = std::string(this->pbase(), this->pptr());
+		bool success = this->writeRaw(this->pbase(), N);
 
 		if (ch != std::char_traits<char>::eof())
 		{
-			s += ch;
-			N++;
+			const char c = std::char_traits<char>::to_char_type(ch);
+			success = this->writeRaw(&c, 1) && success;
 		}
 
-		if (N > 0)
-			// print the data on the pipe
-			std::fprintf(m_pipe, "%s", s.c_str());
+		// reset pointers
+		this->setp(m_buff.data(), m_buff.data() + m_buff.size());
+
+		return success ? std::char_traits<char>::not_eof(ch) : std::char_traits<char>::eof();
+	}
+
+	////////////////////////////////////////////////////////////////
+	bool PipeStreamBuf::writeRaw(const char* data, size_t size)
+	{
+		if (!m_pipe)
+			return false;
+
+		// fwrite is binary safe, the data can contain '\0'
+		const size_t written = size > 0 ? std::fwrite(data, 1, size, m_pipe) : 0;
+		m_written += written;
 
 		// flush the pipe
-		std::fflush(m_pipe);
+		return std::fflush(m_pipe) == 0 && written == size;
+	}
 
-		// reset pointers
-		this->setp(m_buff.data(), m_buff.data() + m_buff.capacity());
+	////////////////////////////////////////////////////////////////
+	void PipeStreamBuf::releaseConsumed(void)
+	{
+#if defined(__linux__)
+		if (m_pinned.empty() || !m_pipe)
+			return;
 
-		// success
-		// giusto ?!?!? not_eof?
-		//return std::char_traits<char>::eof() + 1;
-		return std::char_traits<char>::not_eof(ch);
+		// the bytes still in the pipe, the others have been read by gnuplot
+		int inPipe = 0;
+		if (ioctl(fileno(m_pipe), FIONREAD, &inPipe) != 0)
+			return;
+
+		const size_t consumed = m_written - static_cast<size_t>(inPipe);
+		auto it = m_pinned.begin();
+		while (it != m_pinned.end() && it->first <= consumed)
+			it++;
+		m_pinned.erase(m_pinned.begin(), it);
+#endif
 	}
 }
\ No newline at end of file
@@ -0,0 +1,309 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#include <gnuplotpp/classes/ScriptExporter.hpp>
+
+#include <stdexcept>
+#include <string_view>
+#include <cstdio>
+
+#include "../serialization.hpp"
+
+namespace lc
+{
+	namespace
+	{
+		using namespace _gnuplot_impl_;
+
+		// tells if a line is a plot command, the only ones that read inline data
+		bool isPlotCommand(std::string_view line)
+		{
+			const size_t begin = line.find_first_not_of(" \t");
+			if (begin == std::string_view::npos)
+				return false;
+			line = line.substr(begin);
+
+			for (std::string_view command : { "plot", "splot", "replot" })
+				if (line.substr(0, command.size()) == command && (line.size() == command.size() || line[command.size()] == ' '))
+					return true;
+
+			return false;
+		}
+
+		// the text of a plot element, from a position to the next top level ','
+		std::string_view plotElement(std::string_view line, size_t from)
+		{
+			int depth = 0;
+			for (size_t i = from; i < line.size(); i++)
+			{
+				if (line[i] == '(' || line[i] == '[')
+					depth++;
+				else if (line[i] == ')' || line[i] == ']')
+					depth--;
+				else if (line[i] == ',' && depth <= 0)
+					return line.substr(from, i - from);
+			}
+			return line.substr(from);
+		}
+
+		// tells if the word before a position is "title" (the '-' would be a title)
+		bool isTitle(std::string_view line, size_t position)
+		{
+			const std::string_view before = line.substr(0, position);
+
+			const size_t end = before.find_last_not_of(" \t");
+			if (end == std::string_view::npos)
+				return false;
+
+			size_t begin = before.find_last_of(" \t,", end);
+			begin = (begin == std::string_view::npos) ? 0 : begin + 1;
+
+			const std::string_view word = before.substr(begin, end + 1 - begin);
+			return word == "title" || word == "t";
+		}
+
+		void writeFile(const std::filesystem::path& path, const char* data, size_t size)
+		{
+			std::ofstream file(path, std::ios::binary);
+			file.write(data, static_cast<std::streamsize>(size));
+			if (!file)
+				throw std::runtime_error("ScriptExporter: could not write \"" + path.string() + "\"");
+		}
+	}
+
+	// ================================================================
+	//                        SCRIPT EXPORTER
+	// ================================================================
+
+	////////////////////////////////////////////////////////////////
+	ScriptExporter::ScriptExporter(const std::filesystem::path& path) :
+		m_script(path, std::ios::binary)
+	{
+		if (!m_script)
+			throw std::runtime_error("ScriptExporter: could not open the file");
+
+		m_dataDirName = path.stem().string() + "_data";
+		m_dataDir = path.parent_path() / m_dataDirName;
+	}
+
+	////////////////////////////////////////////////////////////////
+	ScriptExporter::~ScriptExporter()
+	{
+		// a destructor cannot throw, an error here only loses the last block
+		try
+		{
+			// an interrupted data block
+			if (m_inBlock)
+				this->writeBlock();
+		}
+		catch (...)
+		{
+		}
+
+		// unresolved sources are left as they are
+		m_sources.clear();
+		this->writePending();
+
+		m_script.flush();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void ScriptExporter::write(const MultiStream::Chunk& chunk)
+	{
+		using ChunkKind = MultiStream::ChunkKind;
+
+		switch (chunk.kind)
+		{
+		case ChunkKind::Command:
+		{
+			const size_t from = m_pending.size();
+			m_pending.append(chunk.data, chunk.size);
+			this->findSources(from);
+			this->writePending();
+			break;
+		}
+
+		case ChunkKind::Data:
+		case ChunkKind::DataEnd:
+			m_inBlock = true;
+			m_block.append(chunk.data, chunk.size);
+			if (chunk.kind == ChunkKind::DataEnd)
+				this->writeBlock();
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void ScriptExporter::sync(void)
+	{
+		m_script.flush();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void ScriptExporter::findSources(size_t from)
+	{
+		// start from the beginning of the line
+		const size_t previousLine = m_pending.rfind('\n', from == 0 ? 0 : from - 1);
+		size_t lineBegin = (previousLine == std::string::npos || from == 0) ? 0 : previousLine + 1;
+
+		// sources already found in this line
+		while (!m_sources.empty() && m_sources.back().position >= lineBegin)
+			m_sources.pop_back();
+
+		while (lineBegin < m_pending.size())
+		{
+			size_t lineEnd = m_pending.find('\n', lineBegin);
+			if (lineEnd == std::string::npos)
+				lineEnd = m_pending.size();
+
+			const std::string_view line = std::string_view(m_pending).substr(lineBegin, lineEnd - lineBegin);
+
+			if (isPlotCommand(line))
+			{
+				for (size_t i = line.find("'-'"); i != std::string_view::npos; i = line.find("'-'", i + 3))
+				{
+					if (isTitle(line, i))
+						continue;
+
+					Source source;
+					source.position = lineBegin + i;
+					source.binary = plotElement(line, i + 3).find("binary") != std::string_view::npos;
+					m_sources.push_back(source);
+				}
+			}
+
+			lineBegin = lineEnd + 1;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void ScriptExporter::writeBlock(void)
+	{
+		m_inBlock = false;
+
+		if (m_sources.empty())
+		{
+			// no plot command is waiting for this block, leave it inline
+			m_pending += m_block;
+			m_block.clear();
+			this->writePending();
+			return;
+		}
+
+		const Source source = m_sources.front();
+		m_sources.pop_front();
+
+		// the content of the data file, its extension and the format of the spec
+		std::string_view content;
+		std::string bytes;
+		std::string type;
+
+		Table table;
+		if (source.binary)
+		{
+			// already binary, the command has the format
+			content = m_block;
+			type = ".bin";
+		}
+		else if (parseTable(m_block, table) && table.rows > 0)
+		{
+			// values in the machine byte order, as gnuplot expects by default
+			const bool float32 = formatsAsFloat32(table.values);
+			for (const double v : table.values)
+			{
+				if (float32)
+				{
+					const float f = static_cast<float>(v);
+					bytes.append(reinterpret_cast<const char*>(&f), sizeof(f));
+				}
+				else
+					bytes.append(reinterpret_cast<const char*>(&v), sizeof(v));
+			}
+			content = bytes;
+
+			type = ".bin' binary record=(" + std::to_string(table.rows) + ") format='";
+			for (size_t j = 0; j < table.cols; j++)
+				type += float32 ? "%float32" : "%float64";
+		}
+		else
+		{
+			// not numeric, keep it as text without the end of data line
+			content = m_block;
+			const size_t lastLine = content.rfind('\n', content.size() >= 2 ? content.size() - 2 : 0);
+			const std::string_view last = content.substr(lastLine == std::string_view::npos ? 0 : lastLine + 1);
+			if (last == "e\n" || last == "EOD\n" || last == "EOF\n")
+				content = content.substr(0, content.size() - last.size());
+			type = ".dat";
+		}
+
+		const uint64_t hash = fnv1a(type.data(), type.size(), fnv1a(content.data(), content.size()));
+
+		// equal hashes are not enough, the saved file is read back and compared
+		const File* pFile = nullptr;
+		for (auto [it, end] = m_files.equal_range(hash); it != end && !pFile; ++it)
+			if (it->second.type == type && this->isSaved(it->second, content))
+				pFile = &it->second;
+
+		if (!pFile)
+		{
+			std::filesystem::create_directories(m_dataDir);
+
+			char name[32];
+			std::snprintf(name, sizeof(name), "%06zu", m_files.size());
+			const std::string extension = type.substr(0, 4);
+
+			File file;
+			file.path = m_dataDir / (name + extension);
+			file.type = type;
+			file.size = content.size();
+			file.spec = "'" + m_dataDirName + "/" + name + type + "'";
+
+			writeFile(file.path, content.data(), content.size());
+			pFile = &m_files.emplace(hash, std::move(file))->second;
+		}
+
+		// replace the '-' and move the following sources accordingly
+		const std::string& spec = pFile->spec;
+		m_pending.replace(source.position, 3, spec);
+		for (auto& other : m_sources)
+			other.position += spec.size() - 3;
+
+		m_block.clear();
+		this->writePending();
+	}
+
+	////////////////////////////////////////////////////////////////
+	bool ScriptExporter::isSaved(const File& file, std::string_view content)
+	{
+		if (file.size != content.size())
+			return false;
+
+		std::ifstream in(file.path, std::ios::binary);
+		m_saved.resize(file.size);
+		in.read(m_saved.data(), static_cast<std::streamsize>(m_saved.size()));
+
+		return static_cast<size_t>(in.gcount()) == m_saved.size() && m_saved == content;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void ScriptExporter::writePending(void)
+	{
+		if (!m_sources.empty())
+			return;
+
+		m_script.write(m_pending.data(), static_cast<std::streamsize>(m_pending.size()));
+		m_pending.clear();
+	}
+}
@@ -0,0 +1,372 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#include <gnuplotpp/classes/SessionRecording.hpp>
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <bit>
+
+#include "../serialization.hpp"
+
+namespace lc
+{
+	// The recording is made of a header followed by records. Every record starts
+	// with a tag byte and the time since the previous record (µs, varint):
+	//  - Command : varint size, text
+	//  - Table   : encoding byte, varint rows, varint cols, varint terminator size,
+	//              terminator, rows * cols values (little endian)
+	//  - Raw     : varint size, bytes (data blocks that are not numeric tables)
+	//  - Ref     : varint index of a previous Table or Raw record
+	//  - Frame   : nothing
+
+	namespace
+	{
+		using namespace _gnuplot_impl_;
+
+		constexpr char magic[8] = { 'G', 'P', 'P', 'R', 'E', 'C', '\0', 1 };
+
+		enum Tag : uint8_t
+		{
+			TagCommand = 1,
+			TagTable = 2,
+			TagRaw = 3,
+			TagRef = 4,
+			TagFrame = 5,
+		};
+
+		enum Encoding : uint8_t
+		{
+			EncodingFloat64 = 0,
+			EncodingFloat32 = 1,
+			EncodingInteger = 2,
+		};
+
+		// the smallest encoding that gives back the same text
+		Encoding chooseEncoding(const std::vector<double>& values)
+		{
+			const bool integer = std::all_of(values.begin(), values.end(), [](const double v)
+				{
+					return std::isfinite(v) && v == std::trunc(v) && std::abs(v) < 9007199254740992.0 && !(v == 0 && std::signbit(v));
+				}
+			);
+
+			if (integer)
+				return EncodingInteger;
+			if (formatsAsFloat32(values))
+				return EncodingFloat32;
+			return EncodingFloat64;
+		}
+
+		void readExactly(std::istream& in, char* data, size_t size)
+		{
+			in.read(data, static_cast<std::streamsize>(size));
+			if (static_cast<size_t>(in.gcount()) != size)
+				throw std::runtime_error("SessionReader: truncated recording");
+		}
+
+		uint64_t readVarint(std::istream& in)
+		{
+			uint64_t value = 0;
+			if (!getVarint(in, value))
+				throw std::runtime_error("SessionReader: truncated recording");
+			return value;
+		}
+
+		// reads a data block just after its timestamp
+		void readBlock(std::istream& in, uint8_t tag, std::string& bytes)
+		{
+			if (tag == TagRaw)
+			{
+				bytes.resize(readVarint(in));
+				readExactly(in, bytes.data(), bytes.size());
+				return;
+			}
+
+			const int encoding = in.get();
+
+			Table table;
+			table.rows = readVarint(in);
+			table.cols = readVarint(in);
+			table.terminator.resize(readVarint(in));
+			readExactly(in, table.terminator.data(), table.terminator.size());
+
+			const size_t N = table.rows * table.cols;
+			table.values.resize(N);
+
+			if (encoding == EncodingInteger)
+			{
+				for (auto& v : table.values)
+					v = static_cast<double>(unzigzag(readVarint(in)));
+			}
+			else
+			{
+				const size_t size = (encoding == EncodingFloat32) ? sizeof(float) : sizeof(double);
+				std::string raw(N * size, '\0');
+				readExactly(in, raw.data(), raw.size());
+
+				for (size_t i = 0; i < N; i++)
+				{
+					if (encoding == EncodingFloat32)
+						table.values[i] = std::bit_cast<float>(getLE<uint32_t>(raw.data() + i * size));
+					else
+						table.values[i] = std::bit_cast<double>(getLE<uint64_t>(raw.data() + i * size));
+				}
+			}
+
+			formatTable(bytes, table);
+		}
+	}
+
+	// ================================================================
+	//                       SESSION RECORDER
+	// ================================================================
+
+	////////////////////////////////////////////////////////////////
+	SessionRecorder::SessionRecorder(const std::filesystem::path& path) :
+		m_file(path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary)
+	{
+		if (!m_file)
+			throw std::runtime_error("SessionRecorder: could not open the file");
+
+		m_file.write(magic, sizeof(magic));
+	}
+
+	////////////////////////////////////////////////////////////////
+	SessionRecorder::~SessionRecorder()
+	{
+		// a destructor cannot throw, an error here only loses the last block
+		try
+		{
+			// an interrupted data block
+			if (m_inBlock)
+				this->writeBlock();
+		}
+		catch (...)
+		{
+		}
+
+		m_file.flush();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void SessionRecorder::write(const MultiStream::Chunk& chunk)
+	{
+		using ChunkKind = MultiStream::ChunkKind;
+
+		switch (chunk.kind)
+		{
+		case ChunkKind::Command:
+			this->beginRecord(TagCommand, chunk.time);
+			putVarint(m_record, chunk.size);
+			m_record.append(chunk.data, chunk.size);
+			m_file.write(m_record.data(), m_record.size());
+			break;
+
+		case ChunkKind::Data:
+		case ChunkKind::DataEnd:
+			if (!m_inBlock)
+			{
+				m_inBlock = true;
+				m_blockTime = chunk.time;
+			}
+			m_block.append(chunk.data, chunk.size);
+			if (chunk.kind == ChunkKind::DataEnd)
+				this->writeBlock();
+			break;
+
+		case ChunkKind::Frame:
+			this->beginRecord(TagFrame, chunk.time);
+			m_file.write(m_record.data(), m_record.size());
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void SessionRecorder::sync(void)
+	{
+		m_file.flush();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void SessionRecorder::beginRecord(uint8_t tag, std::chrono::steady_clock::time_point time)
+	{
+		using namespace std::chrono;
+
+		const auto dt = m_started ? duration_cast<microseconds>(time - m_lastTime).count() : 0;
+		m_started = true;
+		m_lastTime = time;
+
+		m_record.clear();
+		m_record += static_cast<char>(tag);
+		putVarint(m_record, dt > 0 ? static_cast<uint64_t>(dt) : 0);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void SessionRecorder::writeBlock(void)
+	{
+		const uint64_t hash = fnv1a(m_block.data(), m_block.size());
+
+		// equal hashes are not enough, the recorded block is read back and compared
+		const Block* pRecorded = nullptr;
+		for (auto [it, end] = m_blocks.equal_range(hash); it != end && !pRecorded; ++it)
+			if (this->isRecorded(it->second))
+				pRecorded = &it->second;
+
+		if (pRecorded)
+		{
+			// already recorded, just reference it
+			this->beginRecord(TagRef, m_blockTime);
+			putVarint(m_record, pRecorded->index);
+		}
+		else
+		{
+			Block block;
+			block.index = m_blocks.size();
+			block.size = m_block.size();
+
+			Table table;
+			if (parseTable(m_block, table))
+			{
+				const Encoding encoding = chooseEncoding(table.values);
+
+				this->beginRecord(TagTable, m_blockTime);
+				block.tag = TagTable;
+				block.offset = static_cast<std::streamoff>(m_file.tellp()) + static_cast<std::streamoff>(m_record.size());
+				m_record += static_cast<char>(encoding);
+				putVarint(m_record, table.rows);
+				putVarint(m_record, table.cols);
+				putVarint(m_record, table.terminator.size());
+				m_record += table.terminator;
+
+				for (const double v : table.values)
+				{
+					switch (encoding)
+					{
+					case EncodingInteger:
+						putVarint(m_record, zigzag(static_cast<int64_t>(v)));
+						break;
+					case EncodingFloat32:
+						putLE(m_record, std::bit_cast<uint32_t>(static_cast<float>(v)));
+						break;
+					default:
+						putLE(m_record, std::bit_cast<uint64_t>(v));
+						break;
+					}
+				}
+			}
+			else
+			{
+				this->beginRecord(TagRaw, m_blockTime);
+				block.tag = TagRaw;
+				block.offset = static_cast<std::streamoff>(m_file.tellp()) + static_cast<std::streamoff>(m_record.size());
+				putVarint(m_record, m_block.size());
+				m_record += m_block;
+			}
+
+			m_blocks.emplace(hash, block);
+		}
+
+		m_file.write(m_record.data(), m_record.size());
+
+		m_block.clear();
+		m_inBlock = false;
+	}
+
+	////////////////////////////////////////////////////////////////
+	bool SessionRecorder::isRecorded(const Block& block)
+	{
+		if (block.size != m_block.size())
+			return false;
+
+		// reading moves the file position, writing goes on at the end
+		m_file.flush();
+		m_file.seekg(block.offset);
+		readBlock(m_file, block.tag, m_recorded);
+		m_file.seekp(0, std::ios::end);
+
+		return m_recorded == m_block;
+	}
+
+	// ================================================================
+	//                        SESSION READER
+	// ================================================================
+
+	////////////////////////////////////////////////////////////////
+	SessionReader::SessionReader(const std::filesystem::path& path) :
+		m_file(path, std::ios::binary)
+	{
+		if (!m_file)
+			throw std::runtime_error("SessionReader: could not open the file");
+
+		char header[sizeof(magic)] = {};
+		m_file.read(header, sizeof(header));
+		if (m_file.gcount() != sizeof(header) || !std::equal(header, header + sizeof(header), magic))
+			throw std::runtime_error("SessionReader: not a gnuplot++ session recording");
+	}
+
+	////////////////////////////////////////////////////////////////
+	bool SessionReader::next(Record& record)
+	{
+		const int tag = m_file.get();
+		if (tag == std::char_traits<char>::eof())
+			return false;
+
+		m_time += std::chrono::microseconds(readVarint(m_file));
+		record.time = m_time;
+		record.bytes.clear();
+
+		switch (tag)
+		{
+		case TagCommand:
+			record.kind = RecordKind::Command;
+			record.bytes.resize(readVarint(m_file));
+			readExactly(m_file, record.bytes.data(), record.bytes.size());
+			break;
+
+		case TagTable:
+		case TagRaw:
+			record.kind = RecordKind::Data;
+			m_blocks.emplace_back(static_cast<uint8_t>(tag), m_file.tellg());
+			readBlock(m_file, static_cast<uint8_t>(tag), record.bytes);
+			break;
+
+		case TagRef:
+		{
+			record.kind = RecordKind::Data;
+			const uint64_t index = readVarint(m_file);
+			if (index >= m_blocks.size())
+				throw std::runtime_error("SessionReader: invalid block reference");
+
+			// read the referenced block and come back
+			const auto position = m_file.tellg();
+			m_file.seekg(m_blocks[index].second);
+			readBlock(m_file, m_blocks[index].first, record.bytes);
+			m_file.seekg(position);
+			break;
+		}
+
+		case TagFrame:
+			record.kind = RecordKind::Frame;
+			break;
+
+		default:
+			throw std::runtime_error("SessionReader: corrupted recording");
+		}
+
+		return true;
+	}
+}
@@ -14,12 +14,30 @@ LC_NOTICE_END */
 
 #include <iostream>
 
+#include "serialization.hpp"
+#include "statistics.hpp"
+
 #include <assert.h>
 
 // !!!
 #include <chrono>
 #include <thread>
+#include <atomic>
 #include <iomanip>      // std::setw
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <utility>
+#include <charconv>
+#include <cmath>
+#include <limits>
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 // this macro is used to put a space
 #define _TMP_GNUPLOTPP_SPACE(s) s << " "
@@ -34,380 +52,2929 @@ namespace lc
 	//                         GNUPLOT PIPE
 	// ================================================================
 
+	namespace _gnuplot_impl_
+	{
+		// gnuplot prints these (on stderr) followed by a number, they all start
+		// with the same characters
+		constexpr std::string_view markerPrefix = "__GNUPLOTPP_";
+		constexpr std::string_view fencePrefix = "__GNUPLOTPP_FENCE__ ";
+		constexpr std::string_view queryBeginPrefix = "__GNUPLOTPP_BEGIN__ ";
+		constexpr std::string_view queryEndPrefix = "__GNUPLOTPP_END__ ";
+
+		// how many sent commands and received messages are kept
+		constexpr size_t maxSentCommands = 256;
+		constexpr size_t maxMessages = 1024;
+
+		std::string_view trim(std::string_view s)
+		{
+			const size_t begin = s.find_first_not_of(" \t\r");
+			if (begin == std::string_view::npos)
+				return {};
+			const size_t end = s.find_last_not_of(" \t\r");
+			return s.substr(begin, end + 1 - begin);
+		}
+
+		// If the line is the last one of a gnuplot error, like:
+		// > line 0: undefined variable: a
+		// > "script.gp" line 12: warning: Skipping data file with no valid points
+		// returns the message after the line number
+		std::optional<std::string_view> errorText(std::string_view line)
+		{
+			if (line.size() > 0 && line[0] == '"')
+			{
+				// file name
+				const size_t end = line.find('"', 1);
+				if (end == std::string_view::npos)
+					return {};
+				line = trim(line.substr(end + 1));
+				if (line.size() > 0 && line[0] == ',')
+					line = trim(line.substr(1));
+			}
+
+			if (line.substr(0, 5) != "line ")
+				return {};
+			line = line.substr(5);
+
+			const size_t digits = line.find_first_not_of("0123456789");
+			if (digits == 0 || digits == std::string_view::npos || line[digits] != ':')
+				return {};
+
+			return trim(line.substr(digits + 1));
+		}
+
+		bool isWarning(std::string_view text)
+		{
+			return text.substr(0, 8) == "warning:" || text.substr(0, 8) == "Warning:";
+		}
+	}
+
+	// ================================
+	//           PIPE SINK
+	// ================================
+
+	// The MultiStream sink of the gnuplot pipe: it writes on the pipe (large
+	// payloads without copies, see PipeStreamBuf::writeShared()) and keeps
+	// track of the command lines sent
+	class GnuplotPipe::PipeSink : public MultiStream::Sink
+	{
+	public:
+
+		PipeSink(GnuplotPipe* pGnuplotPipe) : m_pGnuplotPipe(pGnuplotPipe) {};
+
+		void write(const MultiStream::Chunk& chunk) override
+		{
+			PipeStreamBuf& pipeStreamBuf = m_pGnuplotPipe->m_pipeStreamBuf;
+
+			// borrowed payloads (no owner) are large as well, they are written
+			// directly instead of going through the buffer
+			if (chunk.size >= PipeStreamBuf::zeroCopyThreshold)
+				pipeStreamBuf.writeShared(chunk.data, chunk.size, chunk.owner);
+			else if (chunk.size > 0)
+				pipeStreamBuf.sputn(chunk.data, chunk.size);
+
+			if (chunk.kind == MultiStream::ChunkKind::Command && m_pGnuplotPipe->readsOutput())
+			{
+				m_line.append(chunk.data, chunk.size);
+				const size_t end = m_line.rfind('\n');
+				if (end != std::string::npos)
+				{
+					m_pGnuplotPipe->recordCommands(std::string_view(m_line).substr(0, end + 1));
+					m_line.erase(0, end + 1);
+				}
+			}
+		}
+
+		void sync(void) override
+		{
+			m_pGnuplotPipe->m_pipeStreamBuf.pubsync();
+		}
+
+	private:
+		GnuplotPipe* m_pGnuplotPipe;
+
+		// the last command line, not yet complete
+		std::string m_line;
+	};
+
+	// ================================
+	//          GNUPLOT PIPE
+	// ================================
+
 	////////////////////////////////////////////////////////////////
 	GnuplotPipe::GnuplotPipe(bool persist) :
 		std::ostream{ &m_pipeStreamBuf },
-		m_pipeStreamBuf{ persist ? "gnuplot --persist" : "gnuplot" }
+		m_pipeStreamBuf{ persist ? "gnuplot --persist" : "gnuplot", 1 << 10, true }
 	{
 		// necessary ???
 		this->rdbuf(&m_pipeStreamBuf);
+
+#if !defined(_WIN32)
+		if (m_pipeStreamBuf.errorFd() >= 0 && pipe(m_wakeFds) == 0)
+			m_reader = std::thread([this]() { this->read(); });
+#endif
 	}
 
-	namespace _gnuplot_impl_
+	////////////////////////////////////////////////////////////////
+	GnuplotPipe::~GnuplotPipe()
 	{
+		// gnuplot exits, after this its output is complete
+		m_pipeStreamBuf.close();
 
-		
-	}
-
-	// ================================================================
-	//                       GNUPLOT++ INTERFACE
-	// ================================================================
+#if !defined(_WIN32)
+		if (m_reader.joinable())
+		{
+			// the reader cannot wait for the end of the output: with --persist
+			// the gnuplot window keeps it open
+			const char stop = 0;
+			while (::write(m_wakeFds[1], &stop, 1) < 0 && errno == EINTR);
+			m_reader.join();
+		}
 
-	const char* Gnuplotpp::Datablock_E = "E";
-	const char* Gnuplotpp::Datablock_EOF = "EOF";
-	const char* Gnuplotpp::Datablock_EOD = "EOD";
+		for (int fd : m_wakeFds)
+			if (fd >= 0)
+				::close(fd);
+#endif
+	}
 
 	////////////////////////////////////////////////////////////////
-	void Gnuplotpp::MarkerSerializer::prepare(Gnuplotpp& os) const
+	std::shared_ptr<MultiStream::Sink> GnuplotPipe::sink(void)
 	{
-		// nothing to do
+		return std::make_shared<PipeSink>(this);
 	}
 
 	////////////////////////////////////////////////////////////////
-	void Gnuplotpp::MarkerSerializer::print(Gnuplotpp& os) const
+	void GnuplotPipe::fence(size_t frame, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point enqueued)
 	{
-		// pt = pointtype
-		// ps = pointsize
+		if (!this->readsOutput())
+			return;
 
-		if (m_m.pointType)
 		{
-			_TMP_GNUPLOTPP_SPACE(os);
-			if (const auto* pInt = std::get_if<int>(&m_m.pointType.value()))
-				os << "pt " << *pInt;
-			if (const auto* pType = std::get_if<PointType>(&m_m.pointType.value()))
-				os << "pt " << static_cast<std::underlying_type_t<const PointType>>(*pType);
+			std::lock_guard lock(m_mutex);
+
+			PendingMarker marker;
+			marker.id = frame;
+			marker.commands = m_sentCommandsCount;
+			marker.begin = begin;
+			marker.enqueued = enqueued;
+			marker.transmitted = std::chrono::steady_clock::now();
+			m_markers.push_back(std::move(marker));
 		}
 
-		if (m_m.pointSize)
-		{
-			_TMP_GNUPLOTPP_SPACE(os);
-			os << "ps " << m_m.pointSize.value();
-		}
+		// written directly on the pipe, the other streams do not need it
+		*this << "print \"" << _gnuplot_impl_::fencePrefix << frame << "\"" << std::endl;
 	}
 
 	////////////////////////////////////////////////////////////////
-	void Gnuplotpp::LineStyleSerializer::prepare(Gnuplotpp& os) const
+	void GnuplotPipe::setFrameCallback(std::function<void(const FrameTiming&)> callback)
 	{
-		auto id = m_id->id;
-		m_id->onExit = [&os, id]() { os << "unset style line " << id; };
+		std::lock_guard lock(m_mutex);
+		m_pFrameCallback = callback ? std::make_shared<const std::function<void(const FrameTiming&)>>(std::move(callback)) : nullptr;
+	}
 
-		if (m_ls.marker)
-		{
-			m_pms = std::make_unique<MarkerSerializer>(m_ls.marker.value());
-			m_pms->prepare(os);
-		}
+	////////////////////////////////////////////////////////////////
+	std::optional<GnuplotPipe::FrameTiming> GnuplotPipe::lastFrameTiming(void) const
+	{
+		std::lock_guard lock(m_mutex);
+		return m_lastFrameTiming;
 	}
 
 	////////////////////////////////////////////////////////////////
-	void Gnuplotpp::LineStyleSerializer::print(Gnuplotpp& os) const
+	bool GnuplotPipe::waitFrames(std::optional<std::chrono::steady_clock::duration> timeout)
 	{
-		// "lt" = "linetype"
-		// "lc" = "linecolor"
+		if (!this->readsOutput())
+			return false;
 
-		os << "unset style line " << m_id->id << std::endl;
+		std::unique_lock lock(m_mutex);
+		auto done = [this]()
+		{
+			return std::none_of(m_markers.begin(), m_markers.end(), [](const PendingMarker& marker) { return !marker.isQuery; });
+		};
 
-		os << "set style line " << m_id->id;
+		if (timeout)
+			return m_cv.wait_for(lock, timeout.value(), done);
 
-		if (m_ls.copyFrom)
-		{
-			_TMP_GNUPLOTPP_SPACE(os);
-			os << "lt " << m_ls.copyFrom.value();
-		}
+		m_cv.wait(lock, done);
+		return true;
+	}
 
-		if (m_ls.lineWidth)
-		{
-			_TMP_GNUPLOTPP_SPACE(os);
-			os << "lw " << m_ls.lineWidth.value();
-		}
+	////////////////////////////////////////////////////////////////
+	std::future<std::string> GnuplotPipe::query(const std::string& command)
+	{
+		if (!this->readsOutput())
+			throw std::runtime_error("GnuplotPipe::query() requires the gnuplot output");
 
-		if (m_ls.lineColor)
-		{
-			_TMP_GNUPLOTPP_SPACE(os);
-			if (const auto* pString = std::get_if<std::string>(&m_ls.lineColor.value()))
-				os << "lc \"" << *pString << "\"";
-			if (const auto* pColor = std::get_if<Color>(&m_ls.lineColor.value()))
-				os << "lc rgb \"#" << *pColor << "\"";
-		}
+		PendingMarker marker;
+		marker.isQuery = true;
+		std::future<std::string> answer = marker.answer.emplace().get_future();
 
-		if (m_ls.dashType)
+		size_t id = 0;
 		{
-			// "dt" = "dashtype"
-			_TMP_GNUPLOTPP_SPACE(os);
-			if (const auto* pInt = std::get_if<int>(&m_ls.dashType.value()))
-				os << "dt " << *pInt;
-			if (const auto* pString = std::get_if<std::string>(&m_ls.dashType.value()))
-				os << "dt \"" << *pString << "\"";
+			std::lock_guard lock(m_mutex);
+			id = m_queries++;
+			marker.id = id;
+			marker.commands = m_sentCommandsCount;
+			m_markers.push_back(std::move(marker));
 		}
 
-		if (m_pms)
-			m_pms->print(os);
+		// whatever gnuplot prints between the markers is the answer
+		*this
+			<< "print \"" << _gnuplot_impl_::queryBeginPrefix << id << "\"\n"
+			<< command << "\n"
+			<< "print \"" << _gnuplot_impl_::queryEndPrefix << id << "\"" << std::endl;
 
-		os << std::endl;
+		return answer;
 	}
 
 	////////////////////////////////////////////////////////////////
-	void Gnuplotpp::PlotOptionsSerializer::prepare(Gnuplotpp& os) const
+	std::vector<GnuplotPipe::Message> GnuplotPipe::takeMessages(void)
 	{
-		if (m_opt.lineStyle)
+		std::lock_guard lock(m_mutex);
+		std::vector<Message> messages(std::make_move_iterator(m_messages.begin()), std::make_move_iterator(m_messages.end()));
+		m_messages.clear();
+		return messages;
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::string GnuplotPipe::takeOutput(void)
+	{
+		std::lock_guard lock(m_mutex);
+		return std::exchange(m_output, {});
+	}
+
+	////////////////////////////////////////////////////////////////
+	void GnuplotPipe::setForwardOutput(bool forward)
+	{
+		m_forward = forward;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void GnuplotPipe::read(void)
+	{
+#if !defined(_WIN32)
+		pollfd fds[3] = {
+			{ m_pipeStreamBuf.outputFd(), POLLIN, 0 },
+			{ m_pipeStreamBuf.errorFd(), POLLIN, 0 },
+			{ m_wakeFds[0], POLLIN, 0 },
+		};
+
+		std::string errorLine;
+		char buff[1 << 12];
+		bool stopping = false;
+
+		while (fds[0].fd >= 0 || fds[1].fd >= 0)
 		{
-			if (m_opt.marker)
+			// when stopping only what is already there is read
+			const int n = poll(fds, 3, stopping ? 0 : -1);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+
+			if (fds[2].revents)
 			{
-				m_opt.lineStyle.value().marker = m_opt.marker;
-				m_opt.marker = {};
+				stopping = true;
+				fds[2].fd = -1;
 			}
 
-			m_lsSserializer = std::make_unique<LineStyleSerializer>(os.createNewID(), m_opt.lineStyle.value());
-			m_lsSserializer->prepare(os);
-			m_lsSserializer->print(os);
+			for (int i = 0; i < 2; i++)
+			{
+				if (!fds[i].revents)
+					continue;
+
+				const ssize_t size = ::read(fds[i].fd, buff, sizeof(buff));
+				if (size < 0 && errno == EINTR)
+					continue;
+				if (size <= 0)
+				{
+					// closed
+					fds[i].fd = -1;
+					continue;
+				}
+
+				if (i == 0)
+				{
+					// the standard output can be binary (for example a png), it is kept as it is
+					if (m_forward)
+					{
+						std::fwrite(buff, 1, static_cast<size_t>(size), stdout);
+						std::fflush(stdout);
+					}
+					else
+					{
+						std::lock_guard lock(m_mutex);
+						m_output.append(buff, static_cast<size_t>(size));
+					}
+					continue;
+				}
+
+				errorLine.append(buff, static_cast<size_t>(size));
+
+				size_t begin = 0;
+				for (size_t end = errorLine.find('\n'); end != std::string::npos; end = errorLine.find('\n', begin))
+				{
+					this->onErrorLine(std::string_view(errorLine).substr(begin, end - begin));
+					begin = end + 1;
+				}
+				errorLine.erase(0, begin);
+			}
 		}
 
-		if (m_opt.marker)
+		if (!errorLine.empty())
+			this->onErrorLine(errorLine);
+		this->flushPendingLine();
+
+		// what is still pending will never be answered
 		{
-			m_pms = std::make_unique<MarkerSerializer>(m_opt.marker.value());
-			m_pms->prepare(os);
+			std::lock_guard lock(m_mutex);
+			for (auto& marker : m_markers)
+				if (marker.answer)
+					marker.answer->set_exception(std::make_exception_ptr(GnuplotError("gnuplot closed before answering")));
+			m_markers.clear();
 		}
+		m_cv.notify_all();
+#endif
 	}
 
 	////////////////////////////////////////////////////////////////
-	void Gnuplotpp::PlotOptionsSerializer::print(Gnuplotpp& os) const
+	void GnuplotPipe::onErrorLine(std::string_view line)
 	{
-		// cols
-		{
-			_TMP_GNUPLOTPP_SPACE(os);
+		using namespace _gnuplot_impl_;
 
-			// to tell wich columns to use, we need to type something like:
-			// > plot ... using 1:2
-			// where 1:2 means: use the first and second column as coordinates, another option is
-			// to simply write something like:
-			// > plot ... using 1
-			// to plot only using ordinate values
-			os << "using ";
+		if (line.substr(0, markerPrefix.size()) == markerPrefix)
+		{
+			// markers end whatever was before them
+			this->flushPendingLine();
 
-			// now we type the column numbers:
-			for (auto it = m_opt.cols.begin(); it != m_opt.cols.end(); it++)
+			auto idAfter = [&](std::string_view prefix) -> std::optional<size_t>
 			{
-				// TODO this cekck in another function
-				if constexpr (0)
+				if (line.substr(0, prefix.size()) != prefix)
+					return {};
+				size_t id = 0;
+				std::from_chars(line.data() + prefix.size(), line.data() + line.size(), id);
+				return id;
+			};
+
+			if (auto id = idAfter(fencePrefix))
+			{
+				const auto now = std::chrono::steady_clock::now();
+
+				if (auto marker = this->popMarker(false, id.value()))
 				{
-					//if (*it >= buffer.cols())
-					//	throw std::runtime_error("cannot plot columns index higher than buffer columns");
+					FrameTiming timing;
+					timing.frame = marker->id;
+					timing.enqueue = marker->enqueued - marker->begin;
+					timing.transmit = marker->transmitted - marker->enqueued;
+					timing.render = now - marker->transmitted;
+
+					std::shared_ptr<const std::function<void(const FrameTiming&)>> pCallback;
+					{
+						std::lock_guard lock(m_mutex);
+						m_lastFrameTiming = timing;
+						pCallback = m_pFrameCallback;
+					}
+					m_cv.notify_all();
+
+					if (pCallback)
+						(*pCallback)(timing);
 				}
+				return;
+			}
 
-				// note that gnuplot indices start from 1, therfore we have to add 1
-				os << (*it + 1);
-
-				// insert a ":" between every number
-				if (std::next(it) != m_opt.cols.end())
-					os << ":";
+			if (auto id = idAfter(queryBeginPrefix))
+			{
+				m_currentQuery = id;
+				m_answer.clear();
+				m_queryError.reset();
+				return;
 			}
-		}
-	
-		if (m_opt.errorBars)
-		{
-			switch (m_opt.errorBars.value())
+
+			if (auto id = idAfter(queryEndPrefix))
 			{
-			case ErrorBarDir::X:
-				_TMP_GNUPLOTPP_SPACE(os);
-				os << "with ";
-				os << ((m_opt.lineStyle) ? "xerrorlines" : "xerr");
-				break;
-			case ErrorBarDir::Y:
-				_TMP_GNUPLOTPP_SPACE(os);
-				os << "with ";
-				os << ((m_opt.lineStyle) ? "yerrorlines" : "yerr");
-				break;
-			case ErrorBarDir::XY:
-				_TMP_GNUPLOTPP_SPACE(os);
-				os << "with ";
-				os << ((m_opt.lineStyle) ? "xyerrorlines" : "xyerrorbars");
-				break;
-			default:
-				break;
+				if (auto marker = this->popMarker(true, id.value()))
+				{
+					if (m_queryError)
+						marker->answer->set_exception(std::make_exception_ptr(GnuplotError(m_queryError.value())));
+					else
+					{
+						if (!m_answer.empty() && m_answer.back() == '\n')
+							m_answer.pop_back();
+						marker->answer->set_value(std::move(m_answer));
+					}
+				}
+
+				m_currentQuery.reset();
+				m_answer.clear();
+				m_queryError.reset();
+				return;
 			}
 		}
 
-		// setting plot line style
-		if (m_lsSserializer)
+		// a gnuplot message, forwarded as it is
+		if (m_forward && !m_currentQuery)
 		{
-			_TMP_GNUPLOTPP_SPACE(os);
+			std::fwrite(line.data(), 1, line.size(), stderr);
+			std::fputc('\n', stderr);
+			std::fflush(stderr);
+		}
 
-			if (!m_opt.errorBars)
-				// TODO change ?!?!?
-				os << "with linespoint ";
+		// an error looks like:
+		// > plot sin(x
+		// >           ^
+		// > line 0: ')' expected
+		// where the first two lines are not always there
+		const std::string_view trimmed = trim(line);
 
-			os << "ls " << m_lsSserializer->m_id->id;
+		if (trimmed.empty())
+		{
+			this->flushPendingLine();
+			return;
 		}
 
-		// setting plot title only if set
-		if (m_opt.title)
+		if (trimmed == "^")
 		{
-			_TMP_GNUPLOTPP_SPACE(os);
-
-			// TODO check no special characters in title
-
-			// tell gnuplot the plot title
-			os << "title '" << m_opt.title.value() << "'";
+			m_caret = true;
+			return;
 		}
 
-		if (m_pms)
-			m_pms->print(os);
-
-		if (m_opt.axes)
+		if (auto text = errorText(trimmed))
 		{
-			_TMP_GNUPLOTPP_SPACE(os);
+			Message message;
+			message.kind = isWarning(text.value()) ? Message::Kind::Warning : Message::Kind::Error;
+			message.text = text.value();
 
-			os << "axes ";
-			auto v = m_opt.axes.value();
-			switch (v)
-			{
-			case PlotAxes::x1y1:
-				os << "x1y1";
-				break;
-			case PlotAxes::x1y2:
-				os << "x1y2";
-				break;
-			case PlotAxes::x2y1:
-				os << "x2y1";
-				break;
-			case PlotAxes::x2y2:
-				os << "x2y2";
-				break;
-			default:
-				break;
-			}
+			// the line before the caret is the command
+			if (m_caret && m_pendingLine)
+				message.command = std::exchange(m_pendingLine, {});
+
+			this->flushPendingLine();
+			this->onMessage(std::move(message));
+			return;
 		}
+
+		this->flushPendingLine();
+		m_pendingLine = std::string(line);
 	}
 
 	////////////////////////////////////////////////////////////////
-	Gnuplotpp::PlotOptions Gnuplotpp::Plot2d::getOptions(void) const
+	void GnuplotPipe::onMessage(Message message)
+	{
+		if (m_currentQuery)
+		{
+			// part of the answer
+			if (message.kind == Message::Kind::Error)
+			{
+				if (!m_queryError)
+					m_queryError = message.text;
+			}
+			else
+				m_answer += message.text + "\n";
+			return;
+		}
+
+		std::lock_guard lock(m_mutex);
+
+		if (message.command)
+		{
+			const std::string_view command = _gnuplot_impl_::trim(message.command.value());
+
+			// the first command with this text that gnuplot could be executing
+			const SentCommand* pFound = nullptr;
+			for (const SentCommand& sent : m_sentCommands)
+				if (sent.index >= m_executedCommands && (!pFound || sent.index < pFound->index) && _gnuplot_impl_::trim(sent.text) == command)
+					pFound = &sent;
+
+			if (pFound)
+			{
+				message.command = pFound->text;
+				message.commandIndex = pFound->index;
+			}
+		}
+
+		m_messages.push_back(std::move(message));
+		if (m_messages.size() > _gnuplot_impl_::maxMessages)
+			m_messages.pop_front();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void GnuplotPipe::flushPendingLine(void)
+	{
+		m_caret = false;
+
+		if (!m_pendingLine)
+			return;
+
+		Message message;
+		message.text = std::exchange(m_pendingLine, {}).value();
+		message.kind = _gnuplot_impl_::isWarning(_gnuplot_impl_::trim(message.text)) ? Message::Kind::Warning : Message::Kind::Info;
+		this->onMessage(std::move(message));
+	}
+
+	////////////////////////////////////////////////////////////////
+	void GnuplotPipe::recordCommands(std::string_view lines)
+	{
+		std::lock_guard lock(m_mutex);
+
+		size_t begin = 0;
+		for (size_t end = lines.find('\n'); end != std::string_view::npos; end = lines.find('\n', begin))
+		{
+			if (end > begin)
+			{
+				// the oldest one is overwritten
+				if (m_sentCommands.size() < _gnuplot_impl_::maxSentCommands)
+					m_sentCommands.emplace_back();
+				SentCommand& sent = m_sentCommands[m_sentCommandsHead];
+				m_sentCommandsHead = (m_sentCommandsHead + 1) % _gnuplot_impl_::maxSentCommands;
+
+				sent.index = m_sentCommandsCount;
+				sent.text.assign(lines.substr(begin, end - begin));
+			}
+			m_sentCommandsCount++;
+			begin = end + 1;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::optional<GnuplotPipe::PendingMarker> GnuplotPipe::popMarker(bool isQuery, size_t id)
+	{
+		std::lock_guard lock(m_mutex);
+
+		// gnuplot executes the commands in order, the markers before this one are lost
+		while (!m_markers.empty())
+		{
+			PendingMarker marker = std::move(m_markers.front());
+			m_markers.erase(m_markers.begin());
+
+			if (marker.isQuery == isQuery && marker.id == id)
+			{
+				m_executedCommands = marker.commands;
+				return marker;
+			}
+
+			if (marker.answer)
+				marker.answer->set_exception(std::make_exception_ptr(GnuplotError("no answer from gnuplot")));
+		}
+
+		return {};
+	}
+
+	// ================================================================
+	//                       GNUPLOT++ INTERFACE
+	// ================================================================
+
+	const char* Gnuplotpp::Datablock_E = "E";
+	const char* Gnuplotpp::Datablock_EOF = "EOF";
+	const char* Gnuplotpp::Datablock_EOD = "EOD";
+
+	namespace _gnuplot_impl_
+	{
+		// "aarrggbb", as gnuplot wants it
+		void writeColor(CommandWriter& os, const Gnuplotpp::Color& color)
+		{
+			os.hex(color.transparency).hex(color.r).hex(color.g).hex(color.b);
+		}
+
+		// "#rrggbb", without the transparency
+		void writeOpaqueColor(CommandWriter& os, const Gnuplotpp::Color& color)
+		{
+			os << '#';
+			os.hex(color.r).hex(color.g).hex(color.b);
+		}
+
+		// Calls f(task, begin, end) on tasks ranges of [0, count), the first
+		// one on this thread and the others on their own threads
+		template <class F>
+		void parallelFor(size_t count, size_t tasks, F f)
+		{
+			if (tasks <= 1)
+			{
+				f(0, 0, count);
+				return;
+			}
+
+			std::vector<std::thread> threads;
+			threads.reserve(tasks - 1);
+			for (size_t k = 1; k < tasks; k++)
+				threads.emplace_back([&, k]() { f(k, count * k / tasks, count * (k + 1) / tasks); });
+
+			f(0, 0, count / tasks);
+
+			for (auto& thread : threads)
+				thread.join();
+		}
+
+		// the threads worth using for count rows of cols values
+		size_t parallelTasks(size_t rows, size_t cols)
+		{
+			// less than this is faster on a single thread
+			constexpr size_t minValues = 1 << 16;
+
+			if (rows == 0)
+				return 1;
+
+			const size_t hardware = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+			return std::clamp<size_t>(rows * cols / minValues, 1, std::min(hardware, rows));
+		}
+
+		// minimum and maximum of a matrix, NaN and infinite values excluded
+		template <class T>
+		std::pair<double, double> matrixRange(const Gnuplotpp::MatrixView<T>& matrix)
+		{
+			const size_t tasks = parallelTasks(matrix.rows, matrix.cols);
+			std::vector<std::pair<T, T>> ranges(tasks, { std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity() });
+
+			parallelFor(matrix.rows, tasks, [&](size_t task, size_t begin, size_t end)
+				{
+					T lo = ranges[task].first;
+					T hi = ranges[task].second;
+					for (size_t i = begin; i < end; i++)
+						for (size_t j = 0; j < matrix.cols; j++)
+						{
+							const T v = matrix.at(i, j);
+							const bool finite = std::isfinite(v);
+							lo = (finite && v < lo) ? v : lo;
+							hi = (finite && v > hi) ? v : hi;
+						}
+					ranges[task] = { lo, hi };
+				});
+
+			std::pair<double, double> range = ranges.front();
+			for (const auto& [lo, hi] : ranges)
+				range = { std::min<double>(range.first, lo), std::max<double>(range.second, hi) };
+
+			// only NaN (or infinite) values
+			if (range.first > range.second)
+				range = { 0, 0 };
+
+			return range;
+		}
+
+		// Maps the values of a matrix on the colors of lut, writing a RGBA pixel
+		// (4 bytes) for each one. The loop has no branches, so that the compiler
+		// can vectorize the arithmetic.
+		template <class T>
+		void shadeMatrix(const Gnuplotpp::MatrixView<T>& matrix, const std::vector<uint32_t>& lut, std::pair<double, double> range, char* out)
+		{
+			const T lo = static_cast<T>(range.first);
+			const T last = static_cast<T>(lut.size() - 1);
+			const T scale = (range.second > range.first) ? static_cast<T>(lut.size() / (range.second - range.first)) : T(0);
+
+			parallelFor(matrix.rows, parallelTasks(matrix.rows, matrix.cols), [&](size_t, size_t begin, size_t end)
+				{
+					for (size_t i = begin; i < end; i++)
+					{
+						// out is not aligned for uint32_t (see matrixBinary())
+						char* pOut = out + i * matrix.cols * sizeof(uint32_t);
+						for (size_t j = 0; j < matrix.cols; j++)
+						{
+							const T v = matrix.at(i, j);
+							const bool isNan = v != v;
+
+							// NaN also for an infinite value times a zero scale (or an
+							// infinite range), the infinite values go to the ends
+							T t = (v - lo) * scale;
+							t = (t == t) ? t : T(0);
+							t = (v > std::numeric_limits<T>::max()) ? last : t;
+							t = (t < T(0)) ? T(0) : t;
+							t = (t > last) ? last : t;
+
+							// transparent
+							const uint32_t pixel = isNan ? 0u : lut[static_cast<size_t>(t)];
+							std::memcpy(pOut + j * sizeof(uint32_t), &pixel, sizeof(pixel));
+						}
+					}
+				});
+		}
+
+		// the gnuplot binary format of a value
+		template <class T>
+		const char* binaryFormat(void)
+		{
+			return std::is_same_v<T, float> ? "%float32" : "%float64";
+		}
+
+		// the gnuplot binary keywords of a matrix sent by matrixBinary(), for example:
+		// > array=(640,480) format='%float32' origin=(0,0) dx=1 dy=1
+		template <class T>
+		void writeArrayKeywords(CommandWriter& os, const Gnuplotpp::MatrixView<T>& matrix, const char* format,
+			const std::optional<Vector2d>& origin, const std::optional<Vector2d>& step)
+		{
+			os << "array=(" << matrix.cols << "," << matrix.rows << ") format='" << format << "'";
+
+			if (origin)
+				os << " origin=(" << origin->x() << "," << origin->y() << ")";
+
+			if (step)
+				os << " dx=" << step->x() << " dy=" << step->y();
+		}
+
+		// The values of a matrix, row by row: contiguous matrices are sent as
+		// they are, the others are packed in data.pBuffer
+		template <class T>
+		void matrixBinary(Gnuplotpp::BinaryData& data, const Gnuplotpp::MatrixView<T>& matrix, const std::shared_ptr<const void>& pOwner)
+		{
+			if (matrix.contiguous())
+			{
+				data.data = reinterpret_cast<const char*>(matrix.data);
+				data.size = matrix.rows * matrix.cols * sizeof(T);
+				data.pOwner = pOwner;
+				return;
+			}
+
+			// the buffer (a pmr string) is not aligned for T, the values are copied
+			data.pBuffer->resize(matrix.rows * matrix.cols * sizeof(T));
+			char* pOut = data.pBuffer->data();
+			for (size_t i = 0; i < matrix.rows; i++)
+				for (size_t j = 0; j < matrix.cols; j++, pOut += sizeof(T))
+					std::memcpy(pOut, &matrix.at(i, j), sizeof(T));
+		}
+
+		// Greedy error bounded decimation of the columns (or of the rows) of a
+		// matrix, returns the indices kept: in every line the values of a dropped
+		// one are within tolerance of the linear interpolation of the kept ones
+		// around it. NaN values are never dropped.
+		// Every span is found doubling it and then bisecting, the lines are
+		// checked in parallel.
+		template <class T>
+		std::vector<size_t> decimateMatrix(const Gnuplotpp::MatrixView<T>& matrix, bool columns, double tolerance)
+		{
+			const size_t n = columns ? matrix.cols : matrix.rows;
+			const size_t lines = columns ? matrix.rows : matrix.cols;
+
+			// true if the indices between a and b can be dropped in the lines [begin, end)
+			// both loops read the matrix row by row
+			auto fitsLines = [&](size_t a, size_t b, size_t begin, size_t end)
+				{
+					const double span = double(b - a);
+					if (columns)
+					{
+						for (size_t i = begin; i < end; i++)
+						{
+							const double za = matrix.at(i, a);
+							const double zb = matrix.at(i, b);
+							for (size_t c = a + 1; c < b; c++)
+							{
+								// false for NaN
+								const double z = za + (zb - za) * double(c - a) / span;
+								if (!(std::abs(matrix.at(i, c) - z) <= tolerance))
+									return false;
+							}
+						}
+					}
+					else
+					{
+						for (size_t c = a + 1; c < b; c++)
+						{
+							const double t = double(c - a) / span;
+							for (size_t j = begin; j < end; j++)
+							{
+								const double za = matrix.at(a, j);
+								const double z = za + (double(matrix.at(b, j)) - za) * t;
+								if (!(std::abs(matrix.at(c, j) - z) <= tolerance))
+									return false;
+							}
+						}
+					}
+					return true;
+				};
+
+			auto fits = [&](size_t a, size_t b)
+				{
+					std::atomic<bool> result = true;
+					parallelFor(lines, parallelTasks(lines, b - a), [&](size_t, size_t begin, size_t end)
+						{
+							if (!fitsLines(a, b, begin, end))
+								result = false;
+						}
+					);
+					return result.load();
+				};
+
+			std::vector<size_t> kept = { 0 };
+			size_t a = 0;
+			while (a + 1 < n)
+			{
+				// good can be reached from a, bad cannot (n is past the end)
+				size_t good = a + 1;
+				size_t bad = n;
+
+				for (size_t step = 2; good + 1 < n; step *= 2)
+				{
+					const size_t b = std::min(a + step, n - 1);
+					if (!fits(a, b))
+					{
+						bad = b;
+						break;
+					}
+					good = b;
+				}
+
+				while (bad - good > 1)
+				{
+					const size_t b = good + (bad - good) / 2;
+					if (fits(a, b))
+						good = b;
+					else
+						bad = b;
+				}
+
+				kept.push_back(good);
+				a = good;
+			}
+
+			return kept;
+		}
+
+		// The RGBA pixels of a matrix shaded with a colormap, in data.pBuffer
+		template <class T>
+		void shadeBinary(Gnuplotpp::BinaryData& data, const Gnuplotpp::MatrixView<T>& matrix, const Gnuplotpp::Colormap& colormap, const std::optional<Vector2d>& range)
+		{
+			if (colormap.colors.empty())
+				throw std::runtime_error("image: empty colormap");
+
+			// the colors as they are sent: r, g, b, alpha
+			std::vector<uint32_t> lut(colormap.colors.size());
+			for (size_t k = 0; k < lut.size(); k++)
+			{
+				const Gnuplotpp::Color& color = colormap.colors[k];
+				const uint8_t rgba[4] = { color.r, color.g, color.b, static_cast<uint8_t>(255 - color.transparency) };
+				std::memcpy(&lut[k], rgba, sizeof(rgba));
+			}
+
+			std::pair<double, double> values;
+			if (range)
+				values = { range->x(), range->y() };
+			else
+				values = matrixRange(matrix);
+
+			data.pBuffer->resize(matrix.rows * matrix.cols * sizeof(uint32_t));
+			shadeMatrix(matrix, lut, values, data.pBuffer->data());
+		}
+
+		// rows of tab separated values
+		template <class String>
+		void formatData(String& out, const Gnuplotpp::DataBuffer& buffer)
+		{
+			BasicCommandWriter<String> os(out);
+
+			auto blockEnd = buffer.blockEnds().begin();
+			for (size_t i = 0; i < buffer.rows(); i++)
+			{
+				// an empty line between the blocks (only one, two would end the data set)
+				bool newBlock = false;
+				for (; blockEnd != buffer.blockEnds().end() && *blockEnd <= i; blockEnd++)
+					newBlock = newBlock || *blockEnd == i;
+				if (newBlock && i > 0)
+					os << '\n';
+
+				for (size_t j = 0; j < buffer.cols(); j++)
+				{
+					os << buffer.at(i, j);
+					if (j < buffer.cols() - 1)
+						os << '\t';
+				}
+				os << '\n';
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::MarkerSerializer::prepare(Gnuplotpp& os) const
+	{
+		// nothing to do
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::MarkerSerializer::print(Gnuplotpp& os) const
+	{
+		std::string text;
+		this->write(text);
+		os.write(text.data(), text.size());
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::MarkerSerializer::write(std::string& out) const
+	{
+		_gnuplot_impl_::CommandWriter os(out);
+
+		// pt = pointtype
+		// ps = pointsize
+
+		if (m_m.pointType)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+			if (const auto* pInt = std::get_if<int>(&m_m.pointType.value()))
+				os << "pt " << *pInt;
+			if (const auto* pType = std::get_if<PointType>(&m_m.pointType.value()))
+				os << "pt " << static_cast<std::underlying_type_t<const PointType>>(*pType);
+		}
+
+		if (m_m.pointSize)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+			os << "ps " << m_m.pointSize.value();
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::LineStyleSerializer::prepare(Gnuplotpp& os) const
+	{
+		// the style is undefined by Gnuplotpp::cleanIDs() when m_id is released
+
+		if (m_ls.marker)
+		{
+			m_pms = std::make_unique<MarkerSerializer>(m_ls.marker.value());
+			m_pms->prepare(os);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::LineStyleSerializer::print(Gnuplotpp& os) const
+	{
+		std::string text;
+		this->write(text);
+		os.write(text.data(), text.size());
+		os << std::flush;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::LineStyleSerializer::write(std::string& out) const
+	{
+		_gnuplot_impl_::CommandWriter os(out);
+
+		// "lt" = "linetype"
+		// "lc" = "linecolor"
+
+		os << "unset style line " << m_id->id << '\n';
+
+		os << "set style line " << m_id->id;
+
+		if (m_ls.copyFrom)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+			os << "lt " << m_ls.copyFrom.value();
+		}
+
+		if (m_ls.lineWidth)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+			os << "lw " << m_ls.lineWidth.value();
+		}
+
+		if (m_ls.lineColor)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+			if (const auto* pString = std::get_if<std::string>(&m_ls.lineColor.value()))
+				os << "lc \"" << *pString << "\"";
+			if (const auto* pColor = std::get_if<Color>(&m_ls.lineColor.value()))
+			{
+				os << "lc rgb \"#";
+				_gnuplot_impl_::writeColor(os, *pColor);
+				os << "\"";
+			}
+		}
+
+		if (m_ls.dashType)
+		{
+			// "dt" = "dashtype"
+			_TMP_GNUPLOTPP_SPACE(os);
+			if (const auto* pInt = std::get_if<int>(&m_ls.dashType.value()))
+				os << "dt " << *pInt;
+			if (const auto* pString = std::get_if<std::string>(&m_ls.dashType.value()))
+				os << "dt \"" << *pString << "\"";
+		}
+
+		if (m_pms)
+			m_pms->write(out);
+
+		os << '\n';
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::PlotOptionsSerializer::prepare(Gnuplotpp& os) const
+	{
+		if (m_opt.lineStyle)
+		{
+			if (m_opt.marker)
+			{
+				m_opt.lineStyle.value().marker = m_opt.marker;
+				m_opt.marker = {};
+			}
+
+			// defined only if it is a new style
+			m_lsSserializer = std::make_unique<LineStyleSerializer>(os.lineStyleID(m_opt.lineStyle.value()), m_opt.lineStyle.value());
+		}
+
+		if (m_opt.marker)
+		{
+			m_pms = std::make_unique<MarkerSerializer>(m_opt.marker.value());
+			m_pms->prepare(os);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::PlotOptionsSerializer::print(Gnuplotpp& os) const
+	{
+		std::string text;
+		this->write(text);
+		os.write(text.data(), text.size());
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::PlotOptionsSerializer::write(std::string& out) const
+	{
+		_gnuplot_impl_::CommandWriter os(out);
+
+		// the binary keywords come before "using"
+		if (m_opt.binary)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+			os << "binary " << m_opt.binary.value();
+		}
+
+		// cols
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+
+			// to tell wich columns to use, we need to type something like:
+			// > plot ... using 1:2
+			// where 1:2 means: use the first and second column as coordinates, another option is
+			// to simply write something like:
+			// > plot ... using 1
+			// to plot only using ordinate values
+			os << "using ";
+
+			// now we type the column numbers:
+			for (auto it = m_opt.cols.begin(); it != m_opt.cols.end(); it++)
+			{
+				// TODO this cekck in another function
+				if constexpr (0)
+				{
+					//if (*it >= buffer.cols())
+					//	throw std::runtime_error("cannot plot columns index higher than buffer columns");
+				}
+
+				// note that gnuplot indices start from 1, therfore we have to add 1
+				os << (*it + 1);
+
+				// insert a ":" between every number
+				if (std::next(it) != m_opt.cols.end())
+					os << ":";
+			}
+		}
+	
+		if (m_opt.with)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+			os << "with " << m_opt.with.value();
+		}
+		else if (m_opt.errorBars)
+		{
+			switch (m_opt.errorBars.value())
+			{
+			case ErrorBarDir::X:
+				_TMP_GNUPLOTPP_SPACE(os);
+				os << "with ";
+				os << ((m_opt.lineStyle) ? "xerrorlines" : "xerr");
+				break;
+			case ErrorBarDir::Y:
+				_TMP_GNUPLOTPP_SPACE(os);
+				os << "with ";
+				os << ((m_opt.lineStyle) ? "yerrorlines" : "yerr");
+				break;
+			case ErrorBarDir::XY:
+				_TMP_GNUPLOTPP_SPACE(os);
+				os << "with ";
+				os << ((m_opt.lineStyle) ? "xyerrorlines" : "xyerrorbars");
+				break;
+			default:
+				break;
+			}
+		}
+
+		// setting plot line style
+		if (m_lsSserializer)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+
+			if (!m_opt.errorBars && !m_opt.with)
+				// TODO change ?!?!?
+				os << "with linespoint ";
+
+			os << "ls " << m_lsSserializer->m_id->id;
+		}
+
+		// setting plot title only if set
+		if (m_opt.title)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+
+			// TODO check no special characters in title
+
+			// tell gnuplot the plot title
+			os << "title '" << m_opt.title.value() << "'";
+		}
+
+		if (m_pms)
+			m_pms->write(out);
+
+		if (m_opt.axes)
+		{
+			_TMP_GNUPLOTPP_SPACE(os);
+
+			os << "axes ";
+			auto v = m_opt.axes.value();
+			switch (v)
+			{
+			case PlotAxes::x1y1:
+				os << "x1y1";
+				break;
+			case PlotAxes::x1y2:
+				os << "x1y2";
+				break;
+			case PlotAxes::x2y1:
+				os << "x2y1";
+				break;
+			case PlotAxes::x2y2:
+				os << "x2y2";
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Plot2dBase::getOptions(PlotOptions& options) const
+	{
+		options = this->getOptions();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Plot2dBase::getData(DataBuffer& buffer) const
+	{
+		buffer = this->getData();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Plot2dBase::assignOptions(PlotOptions& options, std::initializer_list<size_t> cols) const
+	{
+		// assigning the members (instead of the whole object) keeps the memory
+		// of the strings and of the list
+		options.cols = cols;
+		options.title = this->options.title;
+		options.style = {};
+		options.errorBars = {};
+		options.lineStyle = this->options.lineStyle;
+		options.marker = this->options.marker;
+		options.axes = this->options.axes;
+		options.binary.reset();
+		options.with.reset();
+		options.splot = false;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Plot2dBase::getBinaryData(BinaryData&) const
+	{
+		throw std::runtime_error("this plot has no binary data");
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Plot2d::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Plot2d::getOptions(PlotOptions& options) const
 	{
-		auto options = BASE::getOptions();
 		if (this->xData.size() > 0 || this->options.spacing)
-			options.cols = { 0, 1 };
+			this->assignOptions(options, { 0, 1 });
+		else
+			this->assignOptions(options, { 0 });
+	}
+
+	// TODO private namespace and change name
+	double m_ValueOrConstant(const std::vector<double>& v, size_t i)
+	{
+		assert(v.size() > 0);
+		return (i < v.size()) ? v[i] : v.back();
+	}
+
+	// TODO private namespace and change name
+	double m_ValueOrSpacing(const std::vector<double>& v, size_t i, double spacing)
+	{
+		return (i < v.size()) ? v[i] : (spacing * i);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Plot2d::getData(void) const
+	{
+		DataBuffer buffer;
+		this->getData(buffer);
+		return buffer;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Plot2d::getData(DataBuffer& buffer) const
+	{
+		if (this->xData.size() > 0)
+			if (this->xData.size() != this->yData.size())
+				throw std::runtime_error("wrong sizes");
+
+		buffer.reset((this->xData.size() > 0 || this->options.spacing) ? 2 : 1);
+		buffer.reserve(this->yData.size());
+
+		double spacing = 0;
+		if (this->options.spacing)
+			spacing = this->options.spacing.value();
+
+		for (size_t i = 0; i < this->yData.size(); i++)
+		{
+			// X
+			if (this->xData.size() > 0 || this->options.spacing)
+				buffer << m_ValueOrSpacing(this->xData, i, spacing);
+
+			// Y
+			buffer << this->yData[i];
+
+			// ;
+			buffer << endRow;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Kde::Kde(std::span<const double> samples, KdeOptions kdeOptions, SinglePlotOptions options)
+	{
+		this->options = options;
+
+		// NaN (and infinite) values are not samples, they are copied away only
+		// if there are some
+		std::vector<double> finite;
+		if (!std::all_of(samples.begin(), samples.end(), [](double x) { return std::isfinite(x); }))
+		{
+			std::copy_if(samples.begin(), samples.end(), std::back_inserter(finite), [](double x) { return std::isfinite(x); });
+			samples = finite;
+		}
+
+		if (samples.empty())
+			throw std::runtime_error("kde: no samples");
+
+		this->bandwidth = kdeOptions.bandwidth.value_or(_gnuplot_impl_::silvermanBandwidth(samples));
+
+		std::pair<double, double> range;
+		if (kdeOptions.range)
+			range = { kdeOptions.range->x(), kdeOptions.range->y() };
+		else
+		{
+			const auto [lo, hi] = std::minmax_element(samples.begin(), samples.end());
+			range = { *lo - 3 * this->bandwidth, *hi + 3 * this->bandwidth };
+		}
+
+		this->yData.resize(kdeOptions.points);
+		_gnuplot_impl_::kdeGrid(samples, this->bandwidth, range.first, range.second, this->yData);
+
+		this->xData.resize(kdeOptions.points);
+		for (size_t i = 0; i < kdeOptions.points; i++)
+			this->xData[i] = range.first + (range.second - range.first) * i / (kdeOptions.points - 1);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Kde::getOptions(PlotOptions& options) const
+	{
+		BASE::getOptions(options);
+
+		// a curve, without markers
+		options.marker = {};
+		options.with = "lines";
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Errorbar::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Errorbar::getOptions(PlotOptions& options) const
+	{
+		if (this->xErr.size() > 0 && this->yErr.size() > 0)
+			this->assignOptions(options, { 0, 1, 2, 3 }), options.errorBars = ErrorBarDir::XY;
+		else if (this->yErr.size() > 0)
+			this->assignOptions(options, { 0, 1, 2 }), options.errorBars = ErrorBarDir::Y;
+		else if (this->xErr.size() > 0)
+			this->assignOptions(options, { 0, 1, 2 }), options.errorBars = ErrorBarDir::X;
+		else
+			this->assignOptions(options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Errorbar::getData(void) const
+	{
+		DataBuffer buffer;
+		this->getData(buffer);
+		return buffer;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Errorbar::getData(DataBuffer& buffer) const
+	{
+		struct ColumnIndices
+		{
+			std::optional<size_t> x, y, dx, dy;
+		};
+
+		size_t indicesCounter = 0;
+		ColumnIndices indices;
+
+		indices.x = indicesCounter++;
+		indices.y = indicesCounter++;
+
+		size_t N = std::max(this->x.size(), this->y.size());
+
+		if (this->x.size() <= 0 && this->y.size() <= 0)
+			throw std::runtime_error("errorbar: no x-y data");
+
+		if (this->x.size() != this->y.size() || ((this->x.size() == 0 || this->y.size() == 0) && !this->options.spacing))
+			if (this->x.size() > 0 && this->y.size() > 0)
+				throw std::runtime_error("invalid data sizes");
+
+		double spacing = 1;
+		if (this->options.spacing)
+			spacing = this->options.spacing.value();
+
+		if (this->xErr.size() <= 0 && this->yErr.size())
+			throw std::runtime_error("errorbar: no x-y error data");
+
+		if (
+			this->xErr.size() != this->x.size() && this->xErr.size() != 1 &&
+			this->yErr.size() != this->y.size() && this->yErr.size() != 1
+			)
+			throw std::runtime_error("invalid error-data sizes");
+
+		if (this->xErr.size() > 0) indices.dx = indicesCounter++;
+		if (this->yErr.size() > 0) indices.dy = indicesCounter++;
+
+		buffer.reset(indicesCounter);
+		buffer.reserve(N);
+		for (size_t i = 0; i < N; i++)
+		{
+			if (indices.x)
+				buffer << m_ValueOrSpacing(this->x, i, spacing);
+
+			if (indices.y)
+				buffer << m_ValueOrSpacing(this->y, i, spacing);
+
+			if (indices.dx)
+				buffer << m_ValueOrConstant(this->xErr, i);
+
+			if (indices.dy)
+				buffer << m_ValueOrConstant(this->yErr, i);
+
+			buffer << endRow;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Image::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Image::getData(void) const
+	{
+		throw std::runtime_error("image: the matrix is sent as binary data only");
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Image::getOptions(PlotOptions& options) const
+	{
+		// shaded: 4 unsigned chars per pixel
+		if (this->colormap)
+			this->assignOptions(options, { 0, 1, 2, 3 });
+		else
+			this->assignOptions(options);
+
+		options.lineStyle = {};
+		options.marker = {};
+		options.with = this->colormap ? "rgbalpha" : "image";
+
+		// the format of the matrix, for example:
+		// > plot '-' binary array=(640,480) format='%float32' origin=(0,0) dx=1 dy=1 using 1 with image
+		if (!options.binary)
+			options.binary.emplace();
+		options.binary->clear();
+		_gnuplot_impl_::CommandWriter os(options.binary.value());
+
+		std::visit([&](const auto& matrix)
+			{
+				using T = typename std::decay_t<decltype(matrix)>::value_type;
+				const char* format = this->colormap ? "%uchar" : _gnuplot_impl_::binaryFormat<T>();
+				_gnuplot_impl_::writeArrayKeywords(os, matrix, format, this->origin, this->pixelSize);
+			}, this->matrix);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Image::getBinaryData(BinaryData& data) const
+	{
+		std::visit([&](const auto& matrix)
+			{
+				if (matrix.rows == 0 || matrix.cols == 0)
+					throw std::runtime_error("image: empty matrix");
+
+				if (this->colormap)
+					_gnuplot_impl_::shadeBinary(data, matrix, this->colormap.value(), this->range);
+				else
+					_gnuplot_impl_::matrixBinary(data, matrix, this->pOwner);
+			}, this->matrix);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Surface::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Surface::getData(void) const
+	{
+		throw std::runtime_error("surface: the matrix is sent as binary data only");
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Surface::getOptions(PlotOptions& options) const
+	{
+		// decimated: the coordinates of every point, for example
+		// > splot '-' binary record=(120,80) format='%float32%float32%float32' using 1:2:3 with pm3d
+		// otherwise the matrix as it is
+		// > splot '-' binary array=(640,480) format='%float32' using 1 with pm3d
+		if (this->tolerance)
+			this->assignOptions(options, { 0, 1, 2 });
+		else
+			this->assignOptions(options);
+
+		options.splot = true;
+		options.marker = {};
+		if (this->style == Style::Pm3d)
+		{
+			options.lineStyle = {};
+			options.with = "pm3d";
+		}
+		else
+			options.with = "lines";
+
+		if (!options.binary)
+			options.binary.emplace();
+		options.binary->clear();
+		_gnuplot_impl_::CommandWriter os(options.binary.value());
+
+		std::visit([&](const auto& matrix)
+			{
+				using T = typename std::decay_t<decltype(matrix)>::value_type;
+				const char* format = _gnuplot_impl_::binaryFormat<T>();
+
+				if (!this->tolerance)
+				{
+					_gnuplot_impl_::writeArrayKeywords(os, matrix, format, this->origin, this->step);
+					return;
+				}
+
+				// the size is known only after the decimation, see getBinaryData()
+				this->decimate(matrix);
+				os << "record=(" << m_keptCols.size() << "," << m_keptRows.size() << ") format='" << format << format << format << "'";
+			}, this->matrix);
+	}
+
+	////////////////////////////////////////////////////////////////
+	template <class T>
+	void Gnuplotpp::Surface::decimate(const MatrixView<T>& matrix) const
+	{
+		if (matrix.rows == 0 || matrix.cols == 0)
+			throw std::runtime_error("surface: empty matrix");
+
+		// half of the tolerance each: a point between the kept rows and columns is
+		// interpolated on both, so its error is at most the sum of the two
+		// the rows and the columns are dropped on the whole matrix since pm3d
+		// needs a single grid (tiles would not match along their edges)
+		const double tolerance = this->tolerance.value() / 2;
+		m_keptCols = _gnuplot_impl_::decimateMatrix(matrix, true, tolerance);
+		m_keptRows = _gnuplot_impl_::decimateMatrix(matrix, false, tolerance);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Surface::getBinaryData(BinaryData& data) const
+	{
+		std::visit([&](const auto& matrix)
+			{
+				using T = typename std::decay_t<decltype(matrix)>::value_type;
+
+				if (matrix.rows == 0 || matrix.cols == 0)
+					throw std::runtime_error("surface: empty matrix");
+
+				if (!this->tolerance)
+				{
+					_gnuplot_impl_::matrixBinary(data, matrix, this->pOwner);
+					return;
+				}
+
+				// draw() calls getOptions() first, it has decimated the matrix
+				if (m_keptCols.empty())
+					this->decimate(matrix);
+
+				const Vector2d origin = this->origin.value_or(Vector2d(0, 0));
+				const Vector2d step = this->step.value_or(Vector2d(1, 1));
+
+				// x, y, z of the kept points, row by row
+				// see matrixBinary(), the buffer is not aligned for T
+				data.pBuffer->resize(m_keptRows.size() * m_keptCols.size() * 3 * sizeof(T));
+				char* pOut = data.pBuffer->data();
+				for (const size_t i : m_keptRows)
+					for (const size_t j : m_keptCols)
+					{
+						const T point[3] = {
+							static_cast<T>(origin.x() + step.x() * j),
+							static_cast<T>(origin.y() + step.y() * i),
+							matrix.at(i, j)
+						};
+						std::memcpy(pOut, point, sizeof(point));
+						pOut += sizeof(point);
+					}
+			}, this->matrix);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Density::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Density::getData(void) const
+	{
+		throw std::runtime_error("density: the grid is sent as binary data only");
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Density::getOptions(PlotOptions& options) const
+	{
+		// the position of the cells is known after the binning
+		if (m_grid.empty())
+			throw std::runtime_error("density: call rasterize() first");
+
+		if (this->colormap)
+			this->assignOptions(options, { 0, 1, 2, 3 });
+		else
+			this->assignOptions(options);
+
+		options.lineStyle = {};
+		options.marker = {};
+		options.with = this->colormap ? "rgbalpha" : "image";
+
+		if (!options.binary)
+			options.binary.emplace();
+		options.binary->clear();
+		_gnuplot_impl_::CommandWriter os(options.binary.value());
+
+		_gnuplot_impl_::writeArrayKeywords(os, this->grid(), this->colormap ? "%uchar" : "%float32", m_origin, m_step);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Density::getBinaryData(BinaryData& data) const
+	{
+		if (m_grid.empty())
+			throw std::runtime_error("density: call rasterize() first");
+
+		if (this->colormap)
+			_gnuplot_impl_::shadeBinary(data, this->grid(), this->colormap.value(), this->range);
+		else
+		{
+			// the grid is copied: the plot could change before the streams are done
+			const auto grid = this->grid();
+			data.pBuffer->assign(reinterpret_cast<const char*>(grid.data), grid.rows * grid.cols * sizeof(float));
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::MatrixView<float> Gnuplotpp::Density::grid(void) const
+	{
+		return { m_grid.data(), m_rows, m_cols };
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Density::rasterize(void)
+	{
+		if (this->x.size() != this->y.size())
+			throw std::runtime_error("density: x and y sizes differ");
+
+		const bool mean = this->aggregation == Aggregation::Mean;
+		if (mean && this->values.size() != this->x.size())
+			throw std::runtime_error("density: the mean needs a value for every point");
+
+		if (this->resolution.x() <= 0 || this->resolution.y() <= 0)
+			throw std::runtime_error("density: invalid resolution");
+
+		const size_t W = static_cast<size_t>(this->resolution.x());
+		const size_t H = static_cast<size_t>(this->resolution.y());
+		const size_t N = this->x.size();
+
+		// the area of the grid
+		auto extent = [N](const std::span<const double>& v, const std::optional<Vector2d>& given)
+			{
+				std::pair<double, double> range = given ?
+					std::make_pair(given->x(), given->y()) :
+					_gnuplot_impl_::matrixRange(MatrixView<double>{ v.data(), N, 1 });
+
+				// a single value in the middle of the grid
+				if (!(range.second > range.first))
+					range = { range.first - 0.5, range.first + 0.5 };
+
+				return range;
+			};
+		const auto [x0, x1] = extent(this->x, this->xRange);
+		const auto [y0, y1] = extent(this->y, this->yRange);
+
+		m_step = Vector2d((x1 - x0) / W, (y1 - y0) / H);
+		m_origin = Vector2d(x0 + m_step.x() / 2, y0 + m_step.y() / 2);
+
+		// every task counts (and sums) the points of its range on its own
+		// grid, the grids are added at the end
+		const size_t tasks = _gnuplot_impl_::parallelTasks(N, 1);
+		std::vector<std::vector<uint32_t>> counts(tasks);
+		std::vector<std::vector<double>> sums(mean ? tasks : 0);
+
+		const double sx = W / (x1 - x0);
+		const double sy = H / (y1 - y0);
+
+		_gnuplot_impl_::parallelFor(N, tasks, [&](size_t task, size_t begin, size_t end)
+			{
+				auto& count = counts[task];
+				count.assign(W * H, 0);
+				if (mean)
+					sums[task].assign(W * H, 0);
+
+				for (size_t k = begin; k < end; k++)
+				{
+					const double fx = (this->x[k] - x0) * sx;
+					const double fy = (this->y[k] - y0) * sy;
+
+					// outside (or NaN)
+					if (!(fx >= 0 && fx <= W && fy >= 0 && fy <= H))
+						continue;
+
+					// the points on the upper edges belong to the last cells
+					const size_t cell = std::min(static_cast<size_t>(fy), H - 1) * W + std::min(static_cast<size_t>(fx), W - 1);
+					count[cell]++;
+					if (mean)
+						sums[task][cell] += this->values[k];
+				}
+			});
+
+		// reduction, the cells are split among the tasks
+		m_grid.resize(W * H);
+		m_rows = H;
+		m_cols = W;
+		_gnuplot_impl_::parallelFor(W * H, _gnuplot_impl_::parallelTasks(W * H, 1), [&](size_t, size_t begin, size_t end)
+			{
+				for (size_t cell = begin; cell < end; cell++)
+				{
+					uint64_t count = 0;
+					double sum = 0;
+					for (size_t task = 0; task < tasks; task++)
+					{
+						count += counts[task][cell];
+						if (mean)
+							sum += sums[task][cell];
+					}
+
+					// empty cells are not drawn
+					float value = std::numeric_limits<float>::quiet_NaN();
+					if (count > 0)
+					{
+						switch (this->aggregation)
+						{
+						case Aggregation::Count:
+							value = static_cast<float>(count);
+							break;
+						case Aggregation::Mean:
+							value = static_cast<float>(sum / count);
+							break;
+						case Aggregation::LogCount:
+							value = static_cast<float>(std::log10(double(count)));
+							break;
+						default:
+							break;
+						}
+					}
+					m_grid[cell] = value;
+				}
+			});
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Spectrogram::Spectrogram(Options spectrogramOptions, SinglePlotOptions options) :
+		m_spectrogramOptions(spectrogramOptions)
+	{
+		this->options = options;
+
+		const size_t N = spectrogramOptions.fftSize;
+		if (N < 2 || (N & (N - 1)))
+			throw std::runtime_error("spectrogram: the fft size must be a power of two");
+		if (spectrogramOptions.hop == 0)
+			throw std::runtime_error("spectrogram: the hop must be > 0");
+		if (!(spectrogramOptions.sampleRate > 0))
+			throw std::runtime_error("spectrogram: the sample rate must be > 0");
+
+		// periodic windows, they add up to a constant when overlapped by half
+		m_window.resize(N);
+		for (size_t n = 0; n < N; n++)
+		{
+			const double phase = 2 * std::numbers::pi * n / N;
+			switch (spectrogramOptions.window)
+			{
+			case Window::Rectangular:
+				m_window[n] = 1;
+				break;
+			case Window::Hann:
+				m_window[n] = 0.5 - 0.5 * std::cos(phase);
+				break;
+			case Window::Hamming:
+				m_window[n] = 0.54 - 0.46 * std::cos(phase);
+				break;
+			case Window::Blackman:
+				m_window[n] = 0.42 - 0.5 * std::cos(phase) + 0.08 * std::cos(2 * phase);
+				break;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Spectrogram::append(std::span<const double> samples)
+	{
+		const size_t N = m_spectrogramOptions.fftSize;
+		const size_t H = m_spectrogramOptions.hop;
+		const size_t B = this->bins();
+
+		m_pending.insert(m_pending.end(), samples.begin(), samples.end());
+		if (m_pending.size() < N)
+			return;
+
+		const size_t count = (m_pending.size() - N) / H + 1;
+
+		// a sine of amplitude A has magnitude A (the bins 0 and N / 2 have no
+		// negative frequency twin)
+		double windowSum = 0;
+		for (const double w : m_window)
+			windowSum += w;
+
+		const size_t old = m_magnitudes.size();
+		m_magnitudes.resize(old + count * B);
+		float* pOut = m_magnitudes.data() + old;
+
+		_gnuplot_impl_::parallelFor(count, _gnuplot_impl_::parallelTasks(count, N), [&](size_t, size_t begin, size_t end)
+			{
+				std::vector<std::complex<double>> frame(N);
+				for (size_t f = begin; f < end; f++)
+				{
+					const double* pSamples = m_pending.data() + f * H;
+					for (size_t n = 0; n < N; n++)
+						frame[n] = pSamples[n] * m_window[n];
+
+					_gnuplot_impl_::fft(frame);
+
+					float* pFrame = pOut + f * B;
+					for (size_t k = 0; k < B; k++)
+					{
+						const double scale = ((k == 0 || k == N / 2) ? 1 : 2) / windowSum;
+						const double magnitude = std::abs(frame[k]) * scale;
+						pFrame[k] = static_cast<float>(m_spectrogramOptions.decibels ? 20 * std::log10(std::max(magnitude, 1e-12)) : magnitude);
+					}
+				}
+			});
+
+		m_pending.erase(m_pending.begin(), m_pending.begin() + count * H);
+		m_frames += count;
+
+		const size_t maxFrames = m_spectrogramOptions.maxFrames;
+		if (maxFrames > 0 && m_frames > maxFrames)
+		{
+			const size_t drop = m_frames - maxFrames;
+			m_first += drop;
+			m_dropped += drop;
+			m_frames = maxFrames;
+
+			// the dropped frames are erased once in a while, not at every call
+			if (m_first >= maxFrames)
+			{
+				m_magnitudes.erase(m_magnitudes.begin(), m_magnitudes.begin() + m_first * B);
+				m_first = 0;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	float Gnuplotpp::Spectrogram::magnitude(size_t frame, size_t bin) const
+	{
+		if (frame >= m_frames || bin >= this->bins())
+			throw std::runtime_error("spectrogram: frame or bin out of range");
+
+		return this->view().at(bin, frame);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::MatrixView<float> Gnuplotpp::Spectrogram::view(void) const
+	{
+		const size_t B = this->bins();
+		return { m_magnitudes.data() + m_first * B, B, m_frames, 1, B };
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Spectrogram::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Spectrogram::getData(void) const
+	{
+		throw std::runtime_error("spectrogram: the magnitudes are sent as binary data only");
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Spectrogram::getOptions(PlotOptions& options) const
+	{
+		if (m_frames == 0)
+			throw std::runtime_error("spectrogram: no frames");
+
+		if (this->colormap)
+			this->assignOptions(options, { 0, 1, 2, 3 });
+		else
+			this->assignOptions(options);
+
+		options.lineStyle = {};
+		options.marker = {};
+		options.with = this->colormap ? "rgbalpha" : "image";
+
+		if (!options.binary)
+			options.binary.emplace();
+		options.binary->clear();
+		_gnuplot_impl_::CommandWriter os(options.binary.value());
+
+		// a pixel is centered on the middle of its frame and on its frequency
+		const double rate = m_spectrogramOptions.sampleRate;
+		const double N = static_cast<double>(m_spectrogramOptions.fftSize);
+		const double H = static_cast<double>(m_spectrogramOptions.hop);
+		const Vector2d origin((m_dropped * H + N / 2) / rate, 0);
+		const Vector2d step(H / rate, rate / N);
+
+		_gnuplot_impl_::writeArrayKeywords(os, this->view(), this->colormap ? "%uchar" : "%float32", origin, step);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Spectrogram::getBinaryData(BinaryData& data) const
+	{
+		// the frames are not contiguous along the time axis, they are packed
+		if (this->colormap)
+			_gnuplot_impl_::shadeBinary(data, this->view(), this->colormap.value(), this->range);
+		else
+			_gnuplot_impl_::matrixBinary(data, this->view(), nullptr);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Histogram::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Histogram::getOptions(PlotOptions& options) const
+	{
+		// boxes: center, count, width
+		// steps: left edge, count
+		if (this->style == Style::Boxes)
+			this->assignOptions(options, { 0, 1, 2 });
+		else
+			this->assignOptions(options, { 0, 1 });
+
+		options.marker = {};
+		options.with = (this->style == Style::Boxes) ? "boxes" : "steps";
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Histogram::getData(void) const
+	{
+		DataBuffer buffer;
+		this->getData(buffer);
+		return buffer;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Histogram::getData(DataBuffer& buffer) const
+	{
+		std::vector<uint64_t> counts;
+		const std::vector<double> edges = this->count(counts);
+
+		if (this->style == Style::Boxes)
+		{
+			buffer.reset(3);
+			buffer.reserve(counts.size());
+			for (size_t k = 0; k < counts.size(); k++)
+				buffer << (edges[k] + edges[k + 1]) / 2 << static_cast<double>(counts[k]) << edges[k + 1] - edges[k] << endRow;
+		}
 		else
-			options.cols = { 0 };
+		{
+			// the last bin ends with its right edge
+			buffer.reset(2);
+			buffer.reserve(counts.size() + 1);
+			for (size_t k = 0; k < counts.size(); k++)
+				buffer << edges[k] << static_cast<double>(counts[k]) << endRow;
+			buffer << edges.back() << static_cast<double>(counts.back()) << endRow;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::vector<double> Gnuplotpp::Histogram::count(std::vector<uint64_t>& counts) const
+	{
+		const size_t N = this->samples.size();
+		const double* pSamples = this->samples.data();
+
+		std::vector<double> edges = this->edges;
+		if (edges.empty())
+		{
+			if (this->bins == 0)
+				throw std::runtime_error("histogram: no bins");
+
+			std::pair<double, double> range = this->range ?
+				std::make_pair(this->range->x(), this->range->y()) :
+				_gnuplot_impl_::matrixRange(MatrixView<double>{ pSamples, N, 1 });
+
+			if (!(range.second > range.first))
+				range = { range.first - 0.5, range.first + 0.5 };
+
+			if (this->logWidth && !(range.first > 0))
+				throw std::runtime_error("histogram: the range of logarithmic bins must be positive");
+
+			edges.resize(this->bins + 1);
+			for (size_t k = 0; k <= this->bins; k++)
+			{
+				const double t = double(k) / this->bins;
+				edges[k] = this->logWidth ?
+					range.first * std::pow(range.second / range.first, t) :
+					range.first + (range.second - range.first) * t;
+			}
+		}
+		else if (edges.size() < 2 || !std::is_sorted(edges.begin(), edges.end()))
+			throw std::runtime_error("histogram: the edges must be at least two and increasing");
+
+		const size_t bins = edges.size() - 1;
+		const bool explicitEdges = !this->edges.empty();
+
+		// the bin index is computed without branches (the samples outside go in
+		// the extra bin), so that the compiler can vectorize it
+		const double lo = this->logWidth ? std::log(edges.front()) : edges.front();
+		const double hi = this->logWidth ? std::log(edges.back()) : edges.back();
+		const double scale = bins / (hi - lo);
+		const double last = static_cast<double>(bins - 1);
+
+		// every task counts its samples on its own bins, they are added at the end
+		const size_t tasks = _gnuplot_impl_::parallelTasks(N, 1);
+		std::vector<std::vector<uint64_t>> taskCounts(tasks, std::vector<uint64_t>(bins + 1, 0));
+
+		_gnuplot_impl_::parallelFor(N, tasks, [&](size_t task, size_t begin, size_t end)
+			{
+				uint64_t* pCounts = taskCounts[task].data();
+
+				if (explicitEdges)
+				{
+					for (size_t k = begin; k < end; k++)
+					{
+						const double v = pSamples[k];
+						const auto it = std::upper_bound(edges.begin(), edges.end(), v);
+
+						// the last edge belongs to the last bin
+						size_t bin = static_cast<size_t>(it - edges.begin()) - 1;
+						bin = (v == edges.back()) ? bins - 1 : bin;
+						pCounts[(it == edges.begin() || bin >= bins) ? bins : bin]++;
+					}
+					return;
+				}
+
+				constexpr size_t block = 256;
+				uint32_t indices[block];
+				for (size_t k = begin; k < end; k += block)
+				{
+					const size_t n = std::min(block, end - k);
+
+					for (size_t i = 0; i < n; i++)
+					{
+						const double v = this->logWidth ? std::log(pSamples[k + i]) : pSamples[k + i];
+						const double t = (v - lo) * scale;
+
+						// false for NaN
+						const bool inside = t >= 0 && t <= bins;
+						const double clamped = inside ? std::min(t, last) : double(bins);
+						indices[i] = static_cast<uint32_t>(clamped);
+					}
+
+					for (size_t i = 0; i < n; i++)
+					{
+						// rounding can move the samples on an edge in the bin before
+						// (or after) it
+						const double v = pSamples[k + i];
+						size_t bin = indices[i];
+						if (bin < bins)
+						{
+							bin += (bin + 1 < bins && v >= edges[bin + 1]) ? 1 : 0;
+							bin -= (bin > 0 && v < edges[bin]) ? 1 : 0;
+
+							// and the samples just outside the range in the first or last bin
+							bin = (v < edges.front() || v > edges.back()) ? bins : bin;
+						}
+						pCounts[bin]++;
+					}
+				}
+			});
+
+		// the extra bin is dropped
+		counts.assign(bins, 0);
+		for (const auto& taskCount : taskCounts)
+			for (size_t k = 0; k < bins; k++)
+				counts[k] += taskCount[k];
+
+		return edges;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Ohlc::aggregate(std::span<const double> time, std::span<const double> price)
+	{
+		const size_t N = time.size();
+		if (price.size() != N)
+			throw std::runtime_error("ohlc: a price for each time is needed");
+
+		if (this->interval && !(this->interval.value() > 0))
+			throw std::runtime_error("ohlc: the interval must be > 0");
+
+		this->candles.clear();
+		m_interval = this->interval.value_or(0);
+		if (N == 0)
+			return;
+
+		if (!this->interval)
+		{
+			// rounded up to 1, 2 or 5 times a power of 10
+			double raw = (time.back() - time.front()) / std::max<size_t>(this->maxCandles, 1);
+			if (!(raw > 0))
+				raw = 1;
+
+			const double magnitude = std::pow(10, std::floor(std::log10(raw)));
+			const double fraction = raw / magnitude;
+			m_interval = magnitude * (fraction <= 1 ? 1 : fraction <= 2 ? 2 : fraction <= 5 ? 5 : 10);
+		}
+
+		// every task aggregates its ticks, the candles at the ends of two tasks
+		// can be the same one
+		const size_t tasks = _gnuplot_impl_::parallelTasks(N, 1);
+		std::vector<std::vector<Candle>> taskCandles(tasks);
+		std::vector<char> sorted(tasks, true);
+
+		_gnuplot_impl_::parallelFor(N, tasks, [&](size_t task, size_t begin, size_t end)
+			{
+				auto& out = taskCandles[task];
+
+				for (size_t k = begin; k < end; k++)
+				{
+					const double t = time[k];
+					const double p = price[k];
+
+					if (k > 0 && t < time[k - 1])
+						sorted[task] = false;
+
+					if (std::isnan(t) || std::isnan(p))
+						continue;
+
+					const double start = std::floor(t / m_interval) * m_interval;
+					if (out.empty() || out.back().time != start)
+					{
+						out.push_back({ start, p, p, p, p, 1 });
+						continue;
+					}
+
+					Candle& candle = out.back();
+					candle.high = std::max(candle.high, p);
+					candle.low = std::min(candle.low, p);
+					candle.close = p;
+					candle.ticks++;
+				}
+			});
+
+		if (std::find(sorted.begin(), sorted.end(), false) != sorted.end())
+			throw std::runtime_error("ohlc: the ticks must be sorted by time");
+
+		for (const auto& out : taskCandles)
+		{
+			for (const Candle& candle : out)
+			{
+				if (this->candles.empty() || this->candles.back().time != candle.time)
+				{
+					this->candles.push_back(candle);
+					continue;
+				}
+
+				Candle& last = this->candles.back();
+				last.high = std::max(last.high, candle.high);
+				last.low = std::min(last.low, candle.low);
+				last.close = candle.close;
+				last.ticks += candle.ticks;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Ohlc::add(double time, double price)
+	{
+		if (std::isnan(time) || std::isnan(price))
+			return;
+
+		if (m_interval == 0)
+		{
+			if (!this->interval || !(this->interval.value() > 0))
+				throw std::runtime_error("ohlc: set the interval (or aggregate some ticks) first");
+			m_interval = this->interval.value();
+		}
+
+		if (!this->candles.empty() && time < this->candles.back().time)
+			throw std::runtime_error("ohlc: the ticks must be sorted by time");
+
+		const double start = std::floor(time / m_interval) * m_interval;
+		if (this->candles.empty() || this->candles.back().time != start)
+		{
+			this->candles.push_back({ start, price, price, price, price, 1 });
+			return;
+		}
+
+		Candle& candle = this->candles.back();
+		candle.high = std::max(candle.high, price);
+		candle.low = std::min(candle.low, price);
+		candle.close = price;
+		candle.ticks++;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::Ohlc::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
 		return options;
 	}
 
-	// TODO private namespace and change name
-	double m_ValueOrConstant(const std::vector<double>& v, size_t i)
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Ohlc::getOptions(PlotOptions& options) const
 	{
-		assert(v.size() > 0);
-		return (i < v.size()) ? v[i] : v.back();
+		// center, open, low, high, close, width: gnuplot draws the falling
+		// candles (close < open) differently
+		this->assignOptions(options, { 0, 1, 2, 3, 4, 5 });
+
+		options.marker = {};
+		options.with = "candlesticks";
 	}
 
-	// TODO private namespace and change name
-	double m_ValueOrSpacing(const std::vector<double>& v, size_t i, double spacing)
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::Ohlc::getData(void) const
 	{
-		return (i < v.size()) ? v[i] : (spacing * i);
+		DataBuffer buffer;
+		this->getData(buffer);
+		return buffer;
 	}
 
 	////////////////////////////////////////////////////////////////
-	Gnuplotpp::DataBuffer Gnuplotpp::Plot2d::getData(void) const
+	void Gnuplotpp::Ohlc::getData(DataBuffer& buffer) const
+	{
+		buffer.reset(6);
+		buffer.reserve(this->candles.size());
+		for (const Candle& candle : this->candles)
+			buffer << candle.time + m_interval / 2 << candle.open << candle.low << candle.high << candle.close << m_interval * this->width << endRow;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::PlotOptions Gnuplotpp::DataPlot::getOptions(void) const
+	{
+		PlotOptions options;
+		this->getOptions(options);
+		return options;
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::DataPlot::getOptions(PlotOptions& options) const
+	{
+		this->assignOptions(options);
+		options.cols = this->cols;
+		options.with = this->with;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataBuffer Gnuplotpp::DataPlot::getData(void) const
 	{
 		DataBuffer buffer;
+		this->getData(buffer);
+		return buffer;
+	}
 
-		if (this->xData.size() > 0)
-			if (this->xData.size() != this->yData.size())
-				throw std::runtime_error("wrong sizes");
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::DataPlot::getData(DataBuffer& buffer) const
+	{
+		if (!this->pData)
+			throw std::runtime_error("no data");
 
-		if (this->xData.size() > 0 || this->options.spacing)
-			buffer = DataBuffer(2);
+		buffer.reset(this->pData->cols());
+		buffer.reserve(this->pData->rows());
 
-		double spacing = 0;
-		if (this->options.spacing)
-			spacing = this->options.spacing.value();
-		// TODO reserve
+		// the rows (and the blocks) are copied as they are
+		auto blockEnd = this->pData->blockEnds().begin();
+		for (size_t i = 0; i < this->pData->rows(); i++)
+		{
+			for (; blockEnd != this->pData->blockEnds().end() && *blockEnd <= i; blockEnd++)
+				buffer.endBlock();
 
-		for (size_t i = 0; i < this->yData.size(); i++)
+			for (size_t j = 0; j < this->pData->cols(); j++)
+				buffer << this->pData->at(i, j);
+			buffer << endRow;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Boxplot::Boxplot(const std::vector<std::span<const double>>& groups, Options options) :
+		groups(groups.size()),
+		width(options.width)
+	{
+		size_t total = 0;
+		for (const auto& samples : groups)
+			total += samples.size();
+
+		// one group per task, the selections are independent
+		const size_t count = groups.size();
+		const size_t tasks = count > 0 ? _gnuplot_impl_::parallelTasks(count, total / count) : 1;
+
+		_gnuplot_impl_::parallelFor(count, tasks, [&](size_t, size_t begin, size_t end)
+			{
+				std::vector<double> values;
+				for (size_t k = begin; k < end; k++)
+				{
+					Group& group = this->groups[k];
+
+					// NaN are not samples
+					values.clear();
+					for (const double x : groups[k])
+						if (!std::isnan(x))
+							values.push_back(x);
+
+					group.count = values.size();
+					if (values.empty())
+						continue;
+
+					const auto [lo, hi] = std::minmax_element(values.begin(), values.end());
+					group.min = *lo;
+					group.max = *hi;
+
+					group.q1 = _gnuplot_impl_::quantile(values, 0.25);
+					group.median = _gnuplot_impl_::quantile(values, 0.5);
+					group.q3 = _gnuplot_impl_::quantile(values, 0.75);
+
+					const double lowFence = group.q1 - 1.5 * (group.q3 - group.q1);
+					const double highFence = group.q3 + 1.5 * (group.q3 - group.q1);
+
+					// the outliers at the end
+					const auto outliers = std::partition(values.begin(), values.end(), [&](double x)
+						{
+							return x >= lowFence && x <= highFence;
+						});
+
+					// the box is always within the fences
+					const auto [wLo, wHi] = std::minmax_element(values.begin(), outliers);
+					group.whiskerLow = *wLo;
+					group.whiskerHigh = *wHi;
+
+					// only the farthest from the median are kept
+					const auto farther = [&](double a, double b) { return std::abs(a - group.median) > std::abs(b - group.median); };
+					const size_t outlierCount = std::min<size_t>(values.end() - outliers, options.maxOutliers);
+					std::nth_element(outliers, outliers + outlierCount, values.end(), farther);
+					group.outliers.assign(outliers, outliers + outlierCount);
+
+					if (options.violinPoints >= 2 && group.max > group.min)
+					{
+						group.density.resize(options.violinPoints);
+						_gnuplot_impl_::kdeGrid(values, _gnuplot_impl_::silvermanBandwidth(values), group.min, group.max, group.density);
+					}
+				}
+			});
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataPlot Gnuplotpp::Boxplot::boxes(SinglePlotOptions options) const
+	{
+		// x, box min, whisker min, whisker max, box max, width
+		auto pData = std::make_shared<DataBuffer>(6);
+		for (size_t k = 0; k < this->groups.size(); k++)
 		{
-			// X
-			if (this->xData.size() > 0 || this->options.spacing)
-				buffer << m_ValueOrSpacing(this->xData, i, spacing);
+			const Group& group = this->groups[k];
+			if (group.count > 0)
+				*pData << double(k + 1) << group.q1 << group.whiskerLow << group.whiskerHigh << group.q3 << this->width << endRow;
+		}
 
-			// Y
-			buffer << this->yData[i];
+		options.marker = {};
+		return DataPlot(pData, { 0, 1, 2, 3, 4, 5 }, "candlesticks whiskerbars", options);
+	}
 
-			// ;
-			buffer << endRow;
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataPlot Gnuplotpp::Boxplot::medians(SinglePlotOptions options) const
+	{
+		// boxes of zero height
+		auto pData = std::make_shared<DataBuffer>(3);
+		for (size_t k = 0; k < this->groups.size(); k++)
+		{
+			const Group& group = this->groups[k];
+			if (group.count > 0)
+				*pData << double(k + 1) << group.median << this->width << endRow;
 		}
 
-		return buffer;
+		options.marker = {};
+		return DataPlot(pData, { 0, 1, 1, 1, 1, 2 }, "candlesticks", options);
 	}
 
 	////////////////////////////////////////////////////////////////
-	Gnuplotpp::PlotOptions Gnuplotpp::Errorbar::getOptions(void) const
+	Gnuplotpp::DataPlot Gnuplotpp::Boxplot::outliers(SinglePlotOptions options) const
+	{
+		auto pData = std::make_shared<DataBuffer>(2);
+		for (size_t k = 0; k < this->groups.size(); k++)
+			for (const double y : this->groups[k].outliers)
+				*pData << double(k + 1) << y << endRow;
+
+		return DataPlot(pData, { 0, 1 }, "points", options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataPlot Gnuplotpp::Boxplot::violins(SinglePlotOptions options) const
+	{
+		// a closed polygon for each group: up on the right side, down on the left one
+		auto pData = std::make_shared<DataBuffer>(2);
+		for (size_t k = 0; k < this->groups.size(); k++)
+		{
+			const Group& group = this->groups[k];
+			const size_t n = group.density.size();
+			if (n < 2)
+				continue;
+
+			const double peak = *std::max_element(group.density.begin(), group.density.end());
+			const double scale = peak > 0 ? this->width / 2 / peak : 0;
+			const double step = (group.max - group.min) / (n - 1);
+
+			pData->endBlock();
+			for (size_t i = 0; i < n; i++)
+				*pData << (k + 1) + group.density[i] * scale << group.min + step * i << endRow;
+			for (size_t i = n; i-- > 0;)
+				*pData << (k + 1) - group.density[i] * scale << group.min + step * i << endRow;
+		}
+
+		options.marker = {};
+		return DataPlot(pData, { 0, 1 }, "filledcurves closed", options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	struct Gnuplotpp::Ensemble::Sketches
+	{
+		// quantiles[k][i] estimates the quantile k at x[i]
+		std::vector<std::vector<_gnuplot_impl_::P2Quantile>> quantiles;
+	};
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Ensemble::Ensemble(std::vector<double> x, Options options) :
+		x(std::move(x)),
+		probabilities(std::move(options.quantiles)),
+		m_pSketches(std::make_unique<Sketches>())
+	{
+		const size_t N = this->x.size();
+		const double nan = std::numeric_limits<double>::quiet_NaN();
+
+		this->count.assign(N, 0);
+		this->min.assign(N, nan);
+		this->max.assign(N, nan);
+		this->mean.assign(N, nan);
+		this->quantiles.assign(this->probabilities.size(), std::vector<double>(N, nan));
+
+		for (const double p : this->probabilities)
+			m_pSketches->quantiles.emplace_back(N, _gnuplot_impl_::P2Quantile(p));
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Ensemble::Ensemble(std::vector<double> x, const std::vector<std::span<const double>>& traces, Options options) :
+		x(std::move(x)),
+		probabilities(std::move(options.quantiles))
+	{
+		const size_t N = this->x.size();
+		const double nan = std::numeric_limits<double>::quiet_NaN();
+
+		for (const auto& trace : traces)
+			if (trace.size() != N)
+				throw std::runtime_error("ensemble: every trace must have a value for each x");
+
+		this->count.assign(N, 0);
+		this->min.assign(N, nan);
+		this->max.assign(N, nan);
+		this->mean.assign(N, nan);
+		this->quantiles.assign(this->probabilities.size(), std::vector<double>(N, nan));
+
+		// every task selects the quantiles of its x, across all the traces
+		const size_t tasks = N > 0 ? _gnuplot_impl_::parallelTasks(N, traces.size()) : 1;
+		_gnuplot_impl_::parallelFor(N, tasks, [&](size_t, size_t begin, size_t end)
+			{
+				std::vector<double> values;
+				values.reserve(traces.size());
+
+				for (size_t i = begin; i < end; i++)
+				{
+					values.clear();
+					for (const auto& trace : traces)
+						if (!std::isnan(trace[i]))
+							values.push_back(trace[i]);
+
+					this->count[i] = values.size();
+					if (values.empty())
+						continue;
+
+					const auto [lo, hi] = std::minmax_element(values.begin(), values.end());
+					this->min[i] = *lo;
+					this->max[i] = *hi;
+
+					double sum = 0;
+					for (const double v : values)
+						sum += v;
+					this->mean[i] = sum / values.size();
+
+					for (size_t k = 0; k < this->probabilities.size(); k++)
+						this->quantiles[k][i] = _gnuplot_impl_::quantile(values, this->probabilities[k]);
+				}
+			});
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Ensemble::Ensemble(Ensemble&&) = default;
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Ensemble& Gnuplotpp::Ensemble::operator=(Ensemble&&) = default;
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Ensemble::~Ensemble() = default;
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Ensemble::add(std::span<const double> trace)
+	{
+		if (!m_pSketches)
+			throw std::runtime_error("ensemble: the traces have already been given");
+
+		const size_t N = this->x.size();
+		if (trace.size() != N)
+			throw std::runtime_error("ensemble: every trace must have a value for each x");
+
+		_gnuplot_impl_::parallelFor(N, _gnuplot_impl_::parallelTasks(N, this->probabilities.size() + 1), [&](size_t, size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const double v = trace[i];
+					if (std::isnan(v))
+						continue;
+
+					// the first value sets them (they are NaN)
+					const size_t n = ++this->count[i];
+					this->min[i] = (n == 1 || v < this->min[i]) ? v : this->min[i];
+					this->max[i] = (n == 1 || v > this->max[i]) ? v : this->max[i];
+					this->mean[i] = (n == 1) ? v : this->mean[i] + (v - this->mean[i]) / n;
+
+					for (size_t k = 0; k < this->probabilities.size(); k++)
+					{
+						auto& sketch = m_pSketches->quantiles[k][i];
+						sketch.add(v);
+						this->quantiles[k][i] = sketch.value();
+					}
+				}
+			});
+	}
+
+	////////////////////////////////////////////////////////////////
+	const std::vector<double>& Gnuplotpp::Ensemble::values(double probability) const
+	{
+		if (probability == 0)
+			return this->min;
+		if (probability == 1)
+			return this->max;
+
+		for (size_t k = 0; k < this->probabilities.size(); k++)
+			if (std::abs(this->probabilities[k] - probability) < 1e-9)
+				return this->quantiles[k];
+
+		throw std::runtime_error("ensemble: the quantile has not been computed");
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataPlot Gnuplotpp::Ensemble::band(double low, double high, SinglePlotOptions options) const
+	{
+		const std::vector<double>& lows = this->values(low);
+		const std::vector<double>& highs = this->values(high);
+
+		auto pData = std::make_shared<DataBuffer>(3);
+		pData->reserve(this->x.size());
+		for (size_t i = 0; i < this->x.size(); i++)
+			if (this->count[i] > 0)
+				*pData << this->x[i] << lows[i] << highs[i] << endRow;
+
+		options.marker = {};
+		return DataPlot(pData, { 0, 1, 2 }, "filledcurves", options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataPlot Gnuplotpp::Ensemble::quantile(double probability, SinglePlotOptions options) const
+	{
+		const std::vector<double>& values = this->values(probability);
+
+		auto pData = std::make_shared<DataBuffer>(2);
+		pData->reserve(this->x.size());
+		for (size_t i = 0; i < this->x.size(); i++)
+			if (this->count[i] > 0)
+				*pData << this->x[i] << values[i] << endRow;
+
+		options.marker = {};
+		return DataPlot(pData, { 0, 1 }, "lines", options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataPlot Gnuplotpp::Ensemble::meanLine(SinglePlotOptions options) const
+	{
+		auto pData = std::make_shared<DataBuffer>(2);
+		pData->reserve(this->x.size());
+		for (size_t i = 0; i < this->x.size(); i++)
+			if (this->count[i] > 0)
+				*pData << this->x[i] << this->mean[i] << endRow;
+
+		options.marker = {};
+		return DataPlot(pData, { 0, 1 }, "lines", options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Contour::Contour(MatrixView<float> matrix, Options options)
+	{
+		this->trace(matrix, options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Contour::Contour(MatrixView<double> matrix, Options options)
+	{
+		this->trace(matrix, options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	template <class T>
+	void Gnuplotpp::Contour::trace(const MatrixView<T>& matrix, const Options& options)
+	{
+		const size_t R = matrix.rows;
+		const size_t C = matrix.cols;
+
+		this->levels = options.levels;
+		if (this->levels.empty())
+		{
+			// inside the range, the ends would have (almost) no lines
+			const auto [lo, hi] = _gnuplot_impl_::matrixRange(matrix);
+			for (size_t k = 0; k < options.levelCount; k++)
+				this->levels.push_back(lo + (hi - lo) * (k + 1) / (options.levelCount + 1));
+		}
+
+		std::sort(this->levels.begin(), this->levels.end());
+		this->levels.erase(std::unique(this->levels.begin(), this->levels.end()), this->levels.end());
+		this->lines.clear();
+
+		if (R < 2 || C < 2 || this->levels.empty())
+			return;
+
+		const size_t L = this->levels.size();
+
+		// a segment joins two edges of a cell, the edges are identified by
+		// their first point and their direction (even horizontal, odd vertical)
+		struct Segment
+		{
+			uint64_t a;
+			uint64_t b;
+		};
+
+		// ========== marching squares ==============
+
+		// every task finds the segments of its rows of cells, for every level
+		const size_t tasks = _gnuplot_impl_::parallelTasks(R - 1, C);
+		std::vector<std::vector<std::vector<Segment>>> taskSegments(tasks, std::vector<std::vector<Segment>>(L));
+
+		_gnuplot_impl_::parallelFor(R - 1, tasks, [&](size_t task, size_t begin, size_t end)
+			{
+				auto& segments = taskSegments[task];
+
+				for (size_t i = begin; i < end; i++)
+				{
+					for (size_t j = 0; j + 1 < C; j++)
+					{
+						const double v00 = matrix.at(i, j);
+						const double v01 = matrix.at(i, j + 1);
+						const double v11 = matrix.at(i + 1, j + 1);
+						const double v10 = matrix.at(i + 1, j);
+
+						if (std::isnan(v00) || std::isnan(v01) || std::isnan(v11) || std::isnan(v10))
+							continue;
+
+						// only the levels in (min, max] cross the cell
+						const double cellMin = std::min(std::min(v00, v01), std::min(v11, v10));
+						const double cellMax = std::max(std::max(v00, v01), std::max(v11, v10));
+						const size_t first = std::upper_bound(this->levels.begin(), this->levels.end(), cellMin) - this->levels.begin();
+
+						const uint64_t top = 2 * (i * C + j);
+						const uint64_t left = top + 1;
+						const uint64_t bottom = 2 * ((i + 1) * C + j);
+						const uint64_t right = 2 * (i * C + j + 1) + 1;
+
+						for (size_t k = first; k < L && this->levels[k] <= cellMax; k++)
+						{
+							const double level = this->levels[k];
+							const int corners = (v00 >= level) | (v01 >= level) << 1 | (v11 >= level) << 2 | (v10 >= level) << 3;
+
+							// the saddles are resolved with the center of the cell
+							const bool center = (v00 + v01 + v11 + v10) / 4 >= level;
+
+							auto& out = segments[k];
+							switch (corners)
+							{
+							case 1: case 14: out.push_back({ left, top }); break;
+							case 2: case 13: out.push_back({ top, right }); break;
+							case 3: case 12: out.push_back({ left, right }); break;
+							case 4: case 11: out.push_back({ right, bottom }); break;
+							case 6: case 9: out.push_back({ top, bottom }); break;
+							case 7: case 8: out.push_back({ bottom, left }); break;
+							case 5:
+								if (center)
+									out.push_back({ top, right }), out.push_back({ bottom, left });
+								else
+									out.push_back({ left, top }), out.push_back({ right, bottom });
+								break;
+							case 10:
+								if (center)
+									out.push_back({ left, top }), out.push_back({ right, bottom });
+								else
+									out.push_back({ top, right }), out.push_back({ bottom, left });
+								break;
+							default:
+								break;
+							}
+						}
+					}
+				}
+			});
+
+		// ========== stitching ==============
+
+		const Vector2d origin = options.origin.value_or(Vector2d(0, 0));
+		const Vector2d step = options.step.value_or(Vector2d(1, 1));
+
+		size_t total = 0;
+		for (const auto& segments : taskSegments)
+			for (const auto& levelSegments : segments)
+				total += levelSegments.size();
+
+		// every task joins the segments of its levels
+		std::vector<std::vector<Line>> levelLines(L);
+		_gnuplot_impl_::parallelFor(L, _gnuplot_impl_::parallelTasks(L, total / L), [&](size_t, size_t begin, size_t end)
+			{
+				constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+				for (size_t k = begin; k < end; k++)
+				{
+					const double level = this->levels[k];
+
+					std::vector<Segment> segments;
+					for (const auto& task : taskSegments)
+						segments.insert(segments.end(), task[k].begin(), task[k].end());
+					const size_t N = segments.size();
+
+					// an edge is shared by two segments at most, they are adjacent once sorted
+					std::vector<std::pair<uint64_t, uint32_t>> ends;
+					ends.reserve(2 * N);
+					for (size_t s = 0; s < N; s++)
+						ends.emplace_back(segments[s].a, uint32_t(s)), ends.emplace_back(segments[s].b, uint32_t(s));
+					std::sort(ends.begin(), ends.end());
+
+					// the side (0 = a, 1 = b) of a segment on an edge
+					auto side = [&](uint32_t s, uint64_t edge) -> size_t { return segments[s].a == edge ? 0 : 1; };
+
+					// next[2 * s + side] is the segment after that side
+					std::vector<uint32_t> next(2 * N, none);
+					for (size_t e = 0; e + 1 < ends.size(); e++)
+					{
+						if (ends[e].first != ends[e + 1].first)
+							continue;
+
+						const uint64_t edge = ends[e].first;
+						const uint32_t s = ends[e].second, t = ends[e + 1].second;
+						next[2 * s + side(s, edge)] = t;
+						next[2 * t + side(t, edge)] = s;
+					}
+
+					// where the level crosses an edge
+					auto crossing = [&](uint64_t edge, Line& line)
+					{
+						const size_t index = edge / 2;
+						const size_t i = index / C, j = index % C;
+						const bool vertical = edge & 1;
+
+						const double v0 = matrix.at(i, j);
+						const double v1 = vertical ? matrix.at(i + 1, j) : matrix.at(i, j + 1);
+						const double t = (level - v0) / (v1 - v0);
+						const double x = origin.x() + step.x() * (vertical ? j : j + t);
+						const double y = origin.y() + step.y() * (vertical ? i + t : i);
+
+						// the level on a point crosses two edges there
+						if (!line.x.empty() && line.x.back() == x && line.y.back() == y)
+							return;
+
+						line.x.push_back(x);
+						line.y.push_back(y);
+					};
+
+					std::vector<bool> visited(N, false);
+					auto walk = [&](uint32_t s, size_t enterSide)
+					{
+						Line line;
+						line.level = level;
+						crossing(enterSide == 0 ? segments[s].a : segments[s].b, line);
+
+						while (true)
+						{
+							visited[s] = true;
+
+							const size_t exitSide = 1 - enterSide;
+							const uint64_t exitEdge = exitSide == 0 ? segments[s].a : segments[s].b;
+							crossing(exitEdge, line);
+
+							const uint32_t t = next[2 * s + exitSide];
+							if (t == none || visited[t])
+								break;
+
+							enterSide = side(t, exitEdge);
+							s = t;
+						}
+
+						levelLines[k].push_back(std::move(line));
+					};
+
+					// the open lines start (and end) on the border (or next to NaN values)
+					for (uint32_t s = 0; s < N; s++)
+						if (!visited[s] && (next[2 * s] == none || next[2 * s + 1] == none))
+							walk(s, next[2 * s] == none ? 0 : 1);
+
+					// the others are closed
+					for (uint32_t s = 0; s < N; s++)
+						if (!visited[s])
+							walk(s, 0);
+				}
+			});
+
+		for (auto& lines : levelLines)
+			std::move(lines.begin(), lines.end(), std::back_inserter(this->lines));
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::DataPlot Gnuplotpp::Contour::isolines(SinglePlotOptions options) const
 	{
-		auto options = BASE::getOptions();
+		size_t points = 0;
+		for (const Line& line : this->lines)
+			points += line.x.size();
 
-		if (this->xErr.size() > 0)
-			options.errorBars = ErrorBarDir::X, options.cols = { 0, 1, 2 };
-		if (this->yErr.size() > 0)
-			options.errorBars = ErrorBarDir::Y, options.cols = { 0, 1, 2 };
-		if (this->xErr.size() > 0 && this->yErr.size() > 0)
-			options.errorBars = ErrorBarDir::XY, options.cols = { 0, 1, 2, 3 };
+		auto pData = std::make_shared<DataBuffer>(2);
+		pData->reserve(points);
+		for (const Line& line : this->lines)
+		{
+			pData->endBlock();
+			for (size_t i = 0; i < line.x.size(); i++)
+				*pData << line.x[i] << line.y[i] << endRow;
+		}
 
-		return options;
+		options.marker = {};
+		return DataPlot(pData, { 0, 1 }, "lines", options);
 	}
 
 	////////////////////////////////////////////////////////////////
-	Gnuplotpp::DataBuffer Gnuplotpp::Errorbar::getData(void) const
+	Gnuplotpp::DataPlot Gnuplotpp::Contour::labels(size_t minPoints, SinglePlotOptions options) const
 	{
-		struct ColumnIndices
+		auto pData = std::make_shared<DataBuffer>(3);
+		for (const Line& line : this->lines)
 		{
-			std::optional<size_t> x, y, dx, dy;
-		};
-
-		size_t indicesCounter = 0;
-		ColumnIndices indices;
-
-		indices.x = indicesCounter++;
-		indices.y = indicesCounter++;
-
-		size_t N = std::max(this->x.size(), this->y.size());
+			if (line.x.empty() || line.x.size() < minPoints)
+				continue;
 
-		if (this->x.size() <= 0 && this->y.size() <= 0)
-			throw std::runtime_error("errorbar: no x-y data");
-
-		if (this->x.size() != this->y.size() || ((this->x.size() == 0 || this->y.size() == 0) && !this->options.spacing))
-			if (this->x.size() > 0 && this->y.size() > 0)
-				throw std::runtime_error("invalid data sizes");
+			const size_t middle = line.x.size() / 2;
+			*pData << line.x[middle] << line.y[middle] << line.level << endRow;
+		}
 
-		double spacing = 1;
-		if (this->options.spacing)
-			spacing = this->options.spacing.value();
+		options.marker = {};
+		return DataPlot(pData, { 0, 1, 2 }, "labels", options);
+	}
 
-		if (this->xErr.size() <= 0 && this->yErr.size())
-			throw std::runtime_error("errorbar: no x-y error data");
+	namespace _gnuplot_impl_
+	{
+		void hashCombine(size_t& seed, const Gnuplotpp::Color& color);
+		void hashCombine(size_t& seed, const Gnuplotpp::Marker& marker);
+		void hashCombine(size_t& seed, const Gnuplotpp::LineStyle& lineStyle);
 
-		if (
-			this->xErr.size() != this->x.size() && this->xErr.size() != 1 &&
-			this->yErr.size() != this->y.size() && this->yErr.size() != 1
-			)
-			throw std::runtime_error("invalid error-data sizes");
+		template <class T>
+		void hashCombine(size_t& seed, const T& value)
+		{
+			seed ^= std::hash<T>{}(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+		}
 
-		if (this->xErr.size() > 0) indices.dx = indicesCounter++;
-		if (this->yErr.size() > 0) indices.dy = indicesCounter++;
+		template <class... Ts>
+		void hashCombine(size_t& seed, const std::variant<Ts...>& value)
+		{
+			hashCombine(seed, value.index());
+			std::visit([&](const auto& v) { hashCombine(seed, v); }, value);
+		}
 
-		DataBuffer buffer(indicesCounter);
-		for (size_t i = 0; i < N; i++)
+		template <class T>
+		void hashCombine(size_t& seed, const std::optional<T>& value)
 		{
-			if (indices.x)
-				buffer << m_ValueOrSpacing(this->x, i, spacing);
+			hashCombine(seed, value.has_value());
+			if (value)
+				hashCombine(seed, value.value());
+		}
 
-			if (indices.y)
-				buffer << m_ValueOrSpacing(this->y, i, spacing);
+		void hashCombine(size_t& seed, const Gnuplotpp::Color& color)
+		{
+			hashCombine(seed, (uint32_t(color.r) << 24) | (uint32_t(color.g) << 16) | (uint32_t(color.b) << 8) | color.transparency);
+		}
 
-			if (indices.dx)
-				buffer << m_ValueOrConstant(this->xErr, i);
+		void hashCombine(size_t& seed, const Gnuplotpp::Marker& marker)
+		{
+			hashCombine(seed, marker.pointType);
+			hashCombine(seed, marker.pointSize);
+		}
 
-			if (indices.dy)
-				buffer << m_ValueOrConstant(this->yErr, i);
+		// true if the value has to be sent, i.e. it is different from what was sent
+		template <class T>
+		bool updateSessionState(std::optional<T>& sent, const T& value)
+		{
+			if (sent && sent.value() == value)
+				return false;
+			sent = value;
+			return true;
+		}
 
-			buffer << endRow;
+		void hashCombine(size_t& seed, const Gnuplotpp::LineStyle& lineStyle)
+		{
+			hashCombine(seed, lineStyle.copyFrom);
+			hashCombine(seed, lineStyle.lineWidth);
+			hashCombine(seed, lineStyle.lineColor);
+			hashCombine(seed, lineStyle.dashType);
+			hashCombine(seed, lineStyle.marker);
 		}
+	}
 
-		return buffer;
+	////////////////////////////////////////////////////////////////
+	size_t Gnuplotpp::LineStyleHash::operator()(const LineStyle& lineStyle) const
+	{
+		size_t seed = 0;
+		_gnuplot_impl_::hashCombine(seed, lineStyle);
+		return seed;
+	}
+
+	////////////////////////////////////////////////////////////////
+	size_t Gnuplotpp::PlotOptionsHash::operator()(const PlotOptions& options) const
+	{
+		using _gnuplot_impl_::hashCombine;
+
+		size_t seed = options.cols.size();
+		for (const size_t col : options.cols)
+			hashCombine(seed, col);
+		hashCombine(seed, options.title);
+		hashCombine(seed, options.errorBars);
+		hashCombine(seed, options.lineStyle);
+		hashCombine(seed, options.marker);
+		hashCombine(seed, options.axes);
+		hashCombine(seed, options.binary);
+		hashCombine(seed, options.with);
+		hashCombine(seed, options.splot);
+		return seed;
 	}
 
 	// ================================
@@ -417,7 +2984,12 @@ namespace lc
 	////////////////////////////////////////////////////////////////
 	Gnuplotpp::Gnuplotpp(bool persist, size_t buffSize)
 	{
-		this->addOstream(std::make_unique<GnuplotPipe>(persist));
+		auto pGnuplotPipe = std::make_unique<GnuplotPipe>(persist);
+		m_pGnuplotPipe = pGnuplotPipe.get();
+
+		// its own sink instead of the streambuffer, see GnuplotPipe::sink()
+		this->addSink(m_pGnuplotPipe->sink());
+		m_ostreams.emplace_back(std::unique_ptr<std::ostream>(std::move(pGnuplotPipe)));
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -444,7 +3016,8 @@ namespace lc
 
 	Gnuplotpp::~Gnuplotpp()
 	{
-		// TODO ...
+		// the pending commands must reach the ostreams before m_ostreams destroys them
+		this->closeRdbufs();
 	}
 
 	// ================================
@@ -460,6 +3033,10 @@ namespace lc
 		//	throw std::runtime_error("GnuplotPipe::sendLine() requires an open pipe");
 
 		*this << line << std::endl;
+
+		// it could change anything, even start a multiplot
+		this->invalidateSessionState();
+		m_multiplotFigure.reset();
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -469,6 +3046,29 @@ namespace lc
 
 		//https://stackoverflow.com/questions/44813827/setting-line-opacity-in-gnuplot-without-using-a-hex-code
 		gp << "reset session" << std::endl;
+
+		// the line styles do not exist anymore, the IDs still in use are
+		// undefined again when released (harmless)
+		m_plotFragments.clear();
+		m_lineStyles.clear();
+		m_gridStyleIDs.clear();
+		m_colorbox.reset();
+		m_multiplotFigure.reset();
+
+		// datablocks included
+		m_session++;
+
+		this->invalidateSessionState();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::invalidateSessionState(void)
+	{
+		m_sessionState = {};
+
+		// gnuplot could have drawn something else, refresh() must draw again
+		if (m_lastFrame)
+			m_lastFrame->resident = false;
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -476,6 +3076,18 @@ namespace lc
 	{
 		auto& gp = *this;
 
+		TerminalState state{ term, outFile };
+		if (size)
+			state.size = std::make_pair(static_cast<int>(size.value().x()), static_cast<int>(size.value().y()));
+
+		m_canvasSize = size.value_or(Vector2i(640, 480));
+
+		if (m_sessionState.terminal == state)
+			return;
+
+		// unknown until the new one is set
+		m_sessionState.terminal.reset();
+
 		gp << "unset term" << std::endl;
 		gp << "unset output" << std::endl;
 
@@ -520,12 +3132,17 @@ namespace lc
 		if (outFile)
 			gp << "set output \"" << outFile.value() << "\"" << std::endl;
 
+		m_sessionState.terminal = state;
+
 		// http://www.math.utk.edu/~vasili/refs/How-to/gnuplot.print.html
 	}
 
 	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::setTitle(std::optional<std::string> title)
 	{
+		if (!_gnuplot_impl_::updateSessionState(m_sessionState.title, title))
+			return;
+
 		if (title)
 			*this << "set title \"" << title.value() << "\"" << std::endl;
 		else
@@ -535,6 +3152,9 @@ namespace lc
 	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::xLabel(std::optional<std::string> label)
 	{
+		if (!_gnuplot_impl_::updateSessionState(m_sessionState.xLabel, label))
+			return;
+
 		if (label)
 			*this << "set xlabel \"" << label.value() << "\"" << std::endl;
 		else
@@ -544,12 +3164,61 @@ namespace lc
 	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::yLabel(std::optional<std::string> label)
 	{
+		if (!_gnuplot_impl_::updateSessionState(m_sessionState.yLabel, label))
+			return;
+
 		if (label)
 			*this << "set ylabel \"" << label.value() << "\"" << std::endl;
 		else
 			*this << "unset ylabel" << std::endl;
 	}
 
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::setXRange(std::optional<Vector2d> range)
+	{
+		this->setRange("x", m_sessionState.xRange, range);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::setYRange(std::optional<Vector2d> range)
+	{
+		this->setRange("y", m_sessionState.yRange, range);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::setRange(const char* axis, std::optional<std::optional<std::pair<double, double>>>& sent, std::optional<Vector2d> range)
+	{
+		std::optional<std::pair<double, double>> value;
+		if (range)
+			value = std::make_pair(range.value().x(), range.value().y());
+
+		if (!_gnuplot_impl_::updateSessionState(sent, value))
+			return;
+
+		if (value)
+			*this << "set " << axis << "range [" << value.value().first << ":" << value.value().second << "]" << std::endl;
+		else
+			*this << "set autoscale " << axis << std::endl;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Density Gnuplotpp::density(std::span<const double> x, std::span<const double> y, SinglePlotOptions singlePlotOptions) const
+	{
+		Density plot(x, y, singlePlotOptions);
+		plot.resolution = m_canvasSize;
+		plot.rasterize();
+		return plot;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Ohlc Gnuplotpp::ohlc(std::span<const double> time, std::span<const double> price, SinglePlotOptions singlePlotOptions) const
+	{
+		Ohlc plot(singlePlotOptions);
+		plot.maxCandles = std::max(m_canvasSize.x() / 4, 1);
+		plot.aggregate(time, price);
+		return plot;
+	}
+
 	////////////////////////////////////////////////////////////////
 	Gnuplotpp::Plot2d Gnuplotpp::plot(const std::vector<double>& data, SinglePlotOptions singlePlotOptions)
 	{
@@ -576,73 +3245,385 @@ namespace lc
 		return plot;
 	}
 
-	// TODO move
-	void m_forEachPlot(std::list<Gnuplotpp::Plot2dRef> plots, std::function<void(const Gnuplotpp::Plot2dBase&, bool first)> func)
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Image Gnuplotpp::image(MatrixView<float> matrix, SinglePlotOptions singlePlotOptions)
+	{
+		return Image(matrix, singlePlotOptions);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Image Gnuplotpp::image(MatrixView<double> matrix, SinglePlotOptions singlePlotOptions)
+	{
+		return Image(matrix, singlePlotOptions);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Kde Gnuplotpp::kde(std::span<const double> samples, KdeOptions kdeOptions, SinglePlotOptions singlePlotOptions)
+	{
+		return Kde(samples, kdeOptions, singlePlotOptions);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Histogram Gnuplotpp::histogram(std::span<const double> samples, size_t bins, SinglePlotOptions singlePlotOptions)
+	{
+		Histogram plot(samples, singlePlotOptions);
+		plot.bins = bins;
+		return plot;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Boxplot Gnuplotpp::boxplot(const std::vector<std::span<const double>>& groups, Boxplot::Options options)
+	{
+		return Boxplot(groups, options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Ensemble Gnuplotpp::ensemble(std::vector<double> x, const std::vector<std::span<const double>>& traces, Ensemble::Options options)
+	{
+		return Ensemble(std::move(x), traces, options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Contour Gnuplotpp::contour(MatrixView<float> matrix, Contour::Options options)
+	{
+		return Contour(matrix, options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Contour Gnuplotpp::contour(MatrixView<double> matrix, Contour::Options options)
+	{
+		return Contour(matrix, options);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Spectrogram Gnuplotpp::spectrogram(std::span<const double> samples, Spectrogram::Options spectrogramOptions, SinglePlotOptions singlePlotOptions)
+	{
+		Spectrogram plot(spectrogramOptions, singlePlotOptions);
+		plot.append(samples);
+		return plot;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Surface Gnuplotpp::surface(MatrixView<float> matrix, SinglePlotOptions singlePlotOptions)
+	{
+		return Surface(matrix, singlePlotOptions);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Surface Gnuplotpp::surface(MatrixView<double> matrix, SinglePlotOptions singlePlotOptions)
+	{
+		return Surface(matrix, singlePlotOptions);
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Colormap Gnuplotpp::Colormap::fromColors(const std::vector<Color>& colors, size_t size)
+	{
+		if (colors.empty() || size == 0)
+			throw std::runtime_error("Colormap: no colors");
+
+		auto lerp = [](uint8_t a, uint8_t b, double t)
+			{
+				return static_cast<uint8_t>(std::lround(a + (double(b) - a) * t));
+			};
+
+		Colormap colormap;
+		colormap.colors.resize(size);
+		for (size_t k = 0; k < size; k++)
+		{
+			// position on the given colors
+			const double x = (size > 1) ? double(k) * (colors.size() - 1) / (size - 1) : 0;
+			const size_t i = std::min(static_cast<size_t>(x), colors.size() - 1);
+			const size_t next = std::min(i + 1, colors.size() - 1);
+			const double t = x - i;
+
+			colormap.colors[k] = {
+				.r = lerp(colors[i].r, colors[next].r, t),
+				.g = lerp(colors[i].g, colors[next].g, t),
+				.b = lerp(colors[i].b, colors[next].b, t),
+				.transparency = lerp(colors[i].transparency, colors[next].transparency, t)
+			};
+		}
+
+		return colormap;
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Colormap Gnuplotpp::Colormap::viridis(void)
+	{
+		// 10 evenly spaced samples of matplotlib viridis
+		return Colormap::fromColors({
+			{ 0x44, 0x01, 0x54 }, { 0x48, 0x28, 0x78 }, { 0x3e, 0x4a, 0x89 }, { 0x31, 0x68, 0x8e }, { 0x26, 0x82, 0x8e },
+			{ 0x1f, 0x9e, 0x89 }, { 0x35, 0xb7, 0x79 }, { 0x6d, 0xcd, 0x59 }, { 0xb4, 0xde, 0x2c }, { 0xfd, 0xe7, 0x25 },
+			});
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Colormap Gnuplotpp::Colormap::grey(void)
+	{
+		return Colormap::fromColors({ { 0, 0, 0 }, { 255, 255, 255 } });
+	}
+
+	////////////////////////////////////////////////////////////////
+	template <class Plots>
+	void Gnuplotpp::drawPlots(const Plots& plots)
 	{
-		using Plot2dBase = Gnuplotpp::Plot2dBase;
+		const auto begin = std::chrono::steady_clock::now();
+
+		// TODO chack not empty
+
+		if (!m_pDataBuffer)
+			m_pDataBuffer = std::make_unique<DataBuffer>(1, m_pResource);
 
-		bool first = true;
+		// the data is kept to draw the frame again (see refresh()), the memory of
+		// the previous frame is reused
+		DrawnFrame frame;
+		if (m_lastFrame)
+			frame = std::move(m_lastFrame.value());
+		m_lastFrame.reset();
 
-		for (auto it = plots.begin(); it != plots.end(); it++)
+		// the strings of the previous frame go back to the pool
+		frame.data.clear();
+		frame.options.resize(plots.size());
+
+		size_t i = 0;
+		for (const Plot2dRef& ref : plots)
 		{
-			const Plot2dBase& plot = it->get();
+			const Plot2dBase& plot = ref.get();
+
+			PlotOptions& options = frame.options[i++];
+			plot.getOptions(options);
+
+			auto pData = this->dataString();
+			FrameData& data = frame.data.emplace_back();
+
+			if (options.binary)
+			{
+				BinaryData binary{ .pBuffer = pData.get() };
+				plot.getBinaryData(binary);
 
-			func(plot, first);
-			first = false;
+				data.binary = true;
+				if (!binary.data)
+				{
+					data.data = pData->data();
+					data.size = pData->size();
+					data.pOwner = std::move(pData);
+				}
+				else
+				{
+					data.data = binary.data;
+					data.size = binary.size;
+					data.pOwner = std::move(binary.pOwner);
+				}
+			}
+			else
+			{
+				plot.getData(*m_pDataBuffer);
+				_gnuplot_impl_::formatData(*pData, *m_pDataBuffer);
+				data.data = pData->data();
+				data.size = pData->size();
+				data.pOwner = std::move(pData);
+			}
 		}
+
+		this->drawFrame(frame, begin);
+
+		// the borrowed data is not valid anymore
+		for (FrameData& data : frame.data)
+			if (!data.pOwner)
+				data.data = nullptr;
+
+		m_lastFrame = std::move(frame);
 	}
 
+	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::draw(const std::list<Plot2dRef>& plots)
 	{
-		// TODO chack not empty
+		this->drawPlots(plots);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::draw(std::initializer_list<Plot2dRef> plots)
+	{
+		this->drawPlots(plots);
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::shared_ptr<std::pmr::string> Gnuplotpp::dataString(void)
+	{
+		// the pool owns one reference, the others are of the streams
+		for (const auto& pString : m_dataPool)
+			if (pString.use_count() == 1)
+			{
+				pString->clear();
+				return pString;
+			}
+
+		// the control block comes from the resource as well
+		const std::pmr::polymorphic_allocator<std::pmr::string> allocator(m_pResource);
+		return m_dataPool.emplace_back(std::allocate_shared<std::pmr::string>(allocator));
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::setMemoryResource(std::pmr::memory_resource* resource)
+	{
+		if (!resource)
+			throw std::runtime_error("the memory resource can not be null");
+
+		// the strings still used by the streams are released by them (to the
+		// resource they come from), the last frame keeps its own ones
+		m_pResource = resource;
+		m_dataPool.clear();
+		m_pDataBuffer.reset();
+	}
 
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::drawFrame(DrawnFrame& frame, std::chrono::steady_clock::time_point begin)
+	{
 		// alias "gnuplot"
 		auto& gp = *this;
 
-		std::list<PlotOptionsSerializer> serializers;
-		m_forEachPlot(plots, [&](const Plot2dBase& plot, bool first)
+		// 2D and 3D plots need different commands
+		const bool splot = !frame.options.empty() && frame.options.front().splot;
+		for (const PlotOptions& options : frame.options)
+			if (options.splot != splot)
+				throw std::runtime_error("draw(): 2D and 3D plots can not be drawn together");
+
+		this->beginFrame();
+
+		// the line styles are defined here, before the plot command
+		auto& fragments = m_fragments;
+		fragments.clear();
+		for (const PlotOptions& options : frame.options)
+			fragments.push_back(&this->plotFragment(options));
+
+		m_command.clear();
+		_gnuplot_impl_::CommandWriter command(m_command);
+
+		command << (splot ? "splot" : "plot");
+
+		for (size_t i = 0; i < fragments.size(); i++)
+		{
+			if (i > 0)
+				command << ",";
+
+			command << " '-' " << *fragments[i];
+		}
+
+		// gnuplot draws the color box only if a plot uses the palette: a
+		// function with no points does
+		if (m_colorbox)
+			command << ", NaN lc palette cb " << m_colorbox.value().min << " notitle";
+
+		command << '\n';
+
+		gp.write(m_command.data(), m_command.size());
+		gp << std::flush;
+
+		// passing data to gnuplot
+		// see https://stackoverflow.com/questions/3318228/how-to-plot-data-without-a-separate-file-by-specifying-all-points-inside-the-gnu
+		for (const FrameData& data : frame.data)
+		{
+			if (data.binary)
 			{
-				serializers.emplace_back(plot.getOptions());
-				serializers.back().prepare(gp);
+				// gnuplot reads exactly the bytes of the format, right after
+				// the plot command and with no end of data line
+				gp.beginData();
+				gp.write(data.pOwner, data.data, data.size);
+				gp.endData();
+				continue;
 			}
-		);
 
-		gp << "plot";
+			// data on new line
+			gp << std::endl;
+
+			// write the data, the streams can keep it without copies
+			gp.beginData();
+			gp.write(data.pOwner, data.data, data.size);
+
+			// tell End Of Data
+			gp << Datablock_EOD << std::endl;
+			//gp << Datablock_E << std::endl;// <- this would do the same
+			gp.endData();
+		}
+
+		// gnuplot keeps the data of the last plot, but not in multiplot mode
+		frame.session = m_session;
+		frame.resident = !m_multiplot;
+
+		// a plot may replace what remultiplot replays
+		m_multiplotFigure.reset();
+
+		this->finishFrame(begin);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::refresh(void)
+	{
+		if (m_multiplot)
+			throw std::runtime_error("Gnuplotpp::refresh(): not available in multiplot mode");
+
+		if (!m_lastFrame)
+			throw std::runtime_error("Gnuplotpp::refresh(): nothing to refresh");
+
+		const auto begin = std::chrono::steady_clock::now();
+
+		if (m_lastFrame->resident && m_lastFrame->session == m_session)
+		{
+			*this << "refresh" << std::endl;
+			this->finishFrame(begin);
+		}
+		else
+		{
+			for (const FrameData& data : m_lastFrame->data)
+				if (!data.data)
+					throw std::runtime_error("Gnuplotpp::refresh(): the data of the last draw() was borrowed, draw again");
+
+			this->drawFrame(m_lastFrame.value(), begin);
+		}
+	}
 
-		std::list<PlotOptionsSerializer>::iterator it = serializers.begin();
-		m_forEachPlot(plots, [&](const Plot2dBase& plot, bool first)
-			{
-				ScopeGuard i_guard([&]() { it++; });
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::beginFrame(void)
+	{
+		// the plot clauses not used for a while are dropped, with them the line
+		// styles only they were using
+		if (m_frames % 64 == 0)
+			std::erase_if(m_plotFragments, [this](const auto& pair) -> bool { return pair.second.frame + 64 < m_frames; });
 
-				if (!first)
-					gp << ",";
+		// the styles not used anymore
+		this->cleanIDs();
+	}
 
-				_TMP_GNUPLOTPP_SPACE(gp);
-				gp << "'-'";
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::finishFrame(std::chrono::steady_clock::time_point begin)
+	{
+		const auto enqueued = std::chrono::steady_clock::now();
+		this->endFrame();
 
-				_TMP_GNUPLOTPP_SPACE(gp);
-				it->print(gp);
-			}
-		);
+		// the gnuplot pipe is synchronous, now it has the whole frame
+		if (m_pGnuplotPipe)
+			m_pGnuplotPipe->fence(m_frames, begin, enqueued);
+		m_frames++;
+	}
 
-		gp << std::endl;
+	////////////////////////////////////////////////////////////////
+	const std::string& Gnuplotpp::plotFragment(const PlotOptions& options)
+	{
+		auto it = m_plotFragments.find(options);
+		if (it != m_plotFragments.end())
+		{
+			it->second.frame = m_frames;
+			return it->second.text;
+		}
 
-		// passing data to gnuplot
-		// see https://stackoverflow.com/questions/3318228/how-to-plot-data-without-a-separate-file-by-specifying-all-points-inside-the-gnu
-		m_forEachPlot(plots, [&](const Plot2dBase& plot, bool first)
-			{
-				// data on new line
-				gp << std::endl;
+		PlotFragment fragment;
+		fragment.pSerializer = std::make_unique<PlotOptionsSerializer>(options);
+		fragment.pSerializer->prepare(*this);
 
-				// write the data
-				auto buffer = plot.getData();
-				gp << buffer;
+		fragment.pSerializer->write(fragment.text);
+		fragment.frame = m_frames;
 
-				// tell End Of Data
-				gp << Datablock_EOD << std::endl;
-				//gp << Datablock_E << std::endl;// <- this would do the same
-			}
-		);
+		return m_plotFragments.emplace(options, std::move(fragment)).first->second.text;
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -650,6 +3631,9 @@ namespace lc
 	{
 		auto& gp = *this;
 
+		if (!_gnuplot_impl_::updateSessionState(m_sessionState.ticks, options))
+			return;
+
 		if (options)
 		{
 			gp << "set mxtics " << options.value().minorXdivider << std::endl;
@@ -666,12 +3650,20 @@ namespace lc
 	void Gnuplotpp::setGridOptions(std::optional<GridOptions> options)
 	{
 		auto& gp = *this;
+
+		if (!_gnuplot_impl_::updateSessionState(m_sessionState.grid, options))
+			return;
+
+		this->cleanIDs();
 		
 		// unset the previous grid options
 		gp << "unset grid" << std::endl;
 
 		if (!options)
+		{
+			m_gridStyleIDs.clear();
 			return;
+		}
 
 		// grid ticks
 		//gp << "show style line" << std::endl;
@@ -697,11 +3689,12 @@ namespace lc
 			break;
 		}
 
-		LineStyleSerializer majorLineStyleSerialiser(this->createNewID(), options.value().majorLineStyle);
-		LineStyleSerializer minorLineStyleSerializer(this->createNewID(), options.value().minorLineStyle);
-		majorLineStyleSerialiser.prepare(*this); minorLineStyleSerializer.prepare(*this);
-		majorLineStyleSerialiser.print(*this); minorLineStyleSerializer.print(*this);
-		gp << "set grid ls " << majorLineStyleSerialiser.m_id->id << ", ls " << minorLineStyleSerializer.m_id->id << std::endl;
+		CommandLineID majorID = this->lineStyleID(options.value().majorLineStyle);
+		CommandLineID minorID = this->lineStyleID(options.value().minorLineStyle);
+		gp << "set grid ls " << majorID->id << ", ls " << minorID->id << std::endl;
+
+		// the previous grid styles are released only now, they could be the same
+		m_gridStyleIDs = { majorID, minorID };
 
 		if constexpr (0)
 		{
@@ -717,6 +3710,45 @@ namespace lc
 		}
 	}
 
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::setColorbox(std::optional<Colorbox> colorbox)
+	{
+		m_colorbox = colorbox;
+
+		if (!_gnuplot_impl_::updateSessionState(m_sessionState.colorbox, colorbox))
+			return;
+
+		if (!colorbox)
+		{
+			*this << "unset colorbox" << std::endl;
+			return;
+		}
+
+		const auto& colors = colorbox.value().colormap.colors;
+		if (colors.empty())
+			throw std::runtime_error("Colorbox: empty colormap");
+
+		m_command.clear();
+		_gnuplot_impl_::CommandWriter os(m_command);
+
+		os << "set palette defined (";
+		for (size_t k = 0; k < colors.size(); k++)
+		{
+			if (k > 0)
+				os << ", ";
+			os << k << " \"";
+			_gnuplot_impl_::writeOpaqueColor(os, colors[k]);
+			os << "\"";
+		}
+		os << ")\n";
+
+		os << "set cbrange [" << colorbox.value().min << ":" << colorbox.value().max << "]\n";
+		os << "set colorbox\n";
+
+		this->write(m_command.data(), m_command.size());
+		*this << std::flush;
+	}
+
 	////////////////////////////////////////////////////////////////
 	/*void Gnuplotpp::lineStyle(LineStyle style)
 	{
@@ -728,38 +3760,15 @@ namespace lc
 
 	Vector2d Gnuplotpp::getMouseClick(void)
 	{
-		// TODO read https://docs.microsoft.com/en-us/windows/console/creating-a-pseudoconsole-session
-		// https://devblogs.microsoft.com/commandline/windows-command-line-introducing-the-windows-pseudo-console-conpty/
-
-		auto& gp = *this;
+		// gnuplot waits for a click, then it sets the mouse variables
+		const std::string answer = this->query("pause mouse button1,button2,button3\nprint MOUSE_X, MOUSE_Y").get();
 
-		Vector2d v;
+		double x = 0, y = 0;
+		std::istringstream is(answer);
+		if (!(is >> x >> y))
+			throw GnuplotError("Gnuplotpp::getMouseClick(): unexpected answer \"" + answer + "\"");
 
-		/*
-		gp << "set mouse" << std::endl;
-		gp << "set mouse" << std::endl;
-
-		//gp << "pause mouse \"Mouse Click!\"" << std::endl;
-		gp << "pause mouse" << std::endl;
-		std::string s;
-
-		while (1)
-		{
-			using namespace std::chrono_literals;
-			std::this_thread::sleep_for(0.2s);
-
-			gp >> s;
-			std::cout << "s = " << s << std::endl;
-		}
-
-		//*this << "if (exists(\"MOUSE_X\")) print MOUSE_X, MOUSE_Y, MOUSE_BUTTON; else print 0, 0, -1;" << std::endl;
-		gp << "if (exists(\"MOUSE_X\")) print MOUSE_X; else print 0;" << std::endl;
-		//gp >> v.x;
-		gp << "if (exists(\"MOUSE_Y\")) print MOUSE_Y; else print 0;" << std::endl;
-		//gp >> v.y;
-		*/
-
-		return v;
+		return Vector2d(x, y);
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -790,12 +3799,21 @@ namespace lc
 	void Gnuplotpp::beginMultiplot(size_t rows, size_t cols)
 	{
 		*this << "set multiplot layout " << rows << ", " << cols << std::endl;
+		m_multiplot = true;
+
+		// remultiplot would draw this one, not a figure
+		m_multiplotFigure.reset();
+
+		// neither refresh() the last draw()
+		if (m_lastFrame)
+			m_lastFrame->resident = false;
 	}
 
 	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::endMultiplot(void)
 	{
 		*this << "unset multiplot" << std::endl;
+		m_multiplot = false;
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -805,25 +3823,138 @@ namespace lc
 		return MultiplotGuard(this);
 	}
 
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::setFrameCallback(std::function<void(const FrameTiming&)> callback)
+	{
+		if (m_pGnuplotPipe)
+			m_pGnuplotPipe->setFrameCallback(std::move(callback));
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::optional<Gnuplotpp::FrameTiming> Gnuplotpp::lastFrameTiming(void) const
+	{
+		if (!m_pGnuplotPipe)
+			return {};
+		return m_pGnuplotPipe->lastFrameTiming();
+	}
+
+	////////////////////////////////////////////////////////////////
+	bool Gnuplotpp::waitFrames(std::optional<std::chrono::steady_clock::duration> timeout)
+	{
+		if (!m_pGnuplotPipe)
+			return false;
+		return m_pGnuplotPipe->waitFrames(timeout);
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::future<std::string> Gnuplotpp::query(const std::string& command)
+	{
+		if (!m_pGnuplotPipe || !m_pGnuplotPipe->readsOutput())
+			throw std::runtime_error("Gnuplotpp::query() requires the gnuplot pipe");
+
+		// the commands written so far come first
+		*this << std::flush;
+
+		return m_pGnuplotPipe->query(command);
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::future<std::string> Gnuplotpp::queryValue(const std::string& expression)
+	{
+		return this->query("print " + expression);
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::vector<Gnuplotpp::Message> Gnuplotpp::takeMessages(void)
+	{
+		if (!m_pGnuplotPipe)
+			return {};
+		return m_pGnuplotPipe->takeMessages();
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::string Gnuplotpp::takeOutput(void)
+	{
+		if (!m_pGnuplotPipe)
+			return {};
+		return m_pGnuplotPipe->takeOutput();
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::setForwardOutput(bool forward)
+	{
+		if (m_pGnuplotPipe)
+			m_pGnuplotPipe->setForwardOutput(forward);
+	}
+
 	////////////////////////////////////////////////////////////////
 	Gnuplotpp::CommandLineID Gnuplotpp::createNewID(void)
 	{
-		auto ID = std::make_shared<CommandLineIDImpl>();
+		return CommandLineID(this->createNewIDImpl());
+	}
 
-		ID->id = 50;
-		while (m_idMap.find(ID->id) != m_idMap.end())
-			ID->id++;
+	////////////////////////////////////////////////////////////////
+	std::shared_ptr<Gnuplotpp::CommandLineIDImpl> Gnuplotpp::createNewIDImpl(void)
+	{
+		IDRegistry& registry = *m_pIDs;
 
-		m_idMap[ID->id] = ID;
-		this->cleanIDs();
+		auto pImpl = std::make_unique<CommandLineIDImpl>();
+		if (registry.free.empty())
+			pImpl->id = registry.next++;
+		else
+		{
+			pImpl->id = registry.free.back();
+			registry.free.pop_back();
+		}
 
-		return CommandLineID(ID);
+		// the ID is not reused right away: gnuplot has to forget it first
+		std::weak_ptr<IDRegistry> pWeakRegistry = m_pIDs;
+		return std::shared_ptr<CommandLineIDImpl>(pImpl.release(), [pWeakRegistry](CommandLineIDImpl* pImpl)
+			{
+				if (auto pRegistry = pWeakRegistry.lock())
+					pRegistry->released.emplace_back(pImpl->id, std::move(pImpl->onExit));
+				delete pImpl;
+			}
+		);
 	}
 
 	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::cleanIDs(void)
 	{
-		std::erase_if(m_idMap, [](const auto& pair) -> bool { return !pair.second.lock(); });
+		if (m_pIDs->released.empty())
+			return;
+
+		// onExit could release other IDs
+		auto released = std::move(m_pIDs->released);
+		m_pIDs->released.clear();
+
+		for (auto& [id, onExit] : released)
+		{
+			*this << "unset style line " << id << std::endl;
+			if (onExit)
+				onExit();
+			m_pIDs->free.push_back(id);
+		}
+
+		std::erase_if(m_lineStyles, [](const auto& pair) -> bool { return pair.second.expired(); });
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::CommandLineID Gnuplotpp::lineStyleID(const LineStyle& lineStyle)
+	{
+		auto it = m_lineStyles.find(lineStyle);
+		if (it != m_lineStyles.end())
+			if (auto pImpl = it->second.lock())
+				return CommandLineID(pImpl);
+
+		CommandLineID id = this->createNewID();
+
+		LineStyleSerializer serializer(id, lineStyle);
+		serializer.prepare(*this);
+		serializer.print(*this);
+
+		m_lineStyles[lineStyle] = id;
+		return id;
 	}
 
 	////////////////////////////////////////////////////////////////
@@ -836,11 +3967,11 @@ namespace lc
 	//}
 
 	////////////////////////////////////////////////////////////////
-	void Gnuplotpp::addOstream(const std::shared_ptr<std::ostream>& pOstream)
+	void Gnuplotpp::addOstream(const std::shared_ptr<std::ostream>& pOstream, bool async)
 	{
 		// TODO checks on pOstream
 
-		this->addRdbuf(pOstream->rdbuf());
+		this->addRdbuf(pOstream->rdbuf(), async);
 		m_ostreams.emplace_back(std::move(pOstream));
 	}
 
@@ -861,7 +3992,19 @@ namespace lc
 	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::writeCommandsOnFile(std::ofstream&& file)
 	{
-		this->addOstream(std::make_unique<std::ofstream>(std::move(file)));
+		this->addOstream(std::make_unique<std::ofstream>(std::move(file)), true);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::recordSession(const std::filesystem::path& path)
+	{
+		this->addSink(std::make_shared<SessionRecorder>(path), true);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::exportScript(const std::filesystem::path& path)
+	{
+		this->addSink(std::make_shared<ScriptExporter>(path), true);
 	}
 
 	// ================================================================
@@ -871,11 +4014,11 @@ namespace lc
 	////////////////////////////////////////////////////////////////
 	Gnuplotpp::DataBuffer& endRow(Gnuplotpp::DataBuffer& buff)
 	{
-#if defined(_GNUPLOTPP_USE_CONCEPTS)
-		buff.push_row(buff.m_tmpData);
-#else
-		buff.push_row(std::list<double>(buff.m_tmpData.begin(), buff.m_tmpData.end()));
-#endif
+		if (buff.m_tmpData.size() != buff.cols())
+			throw std::runtime_error("row size must be equal to the number of cols");
+
+		// no temporary list, the row is appended as it is
+		buff.m_data.insert(buff.m_data.end(), buff.m_tmpData.begin(), buff.m_tmpData.end());
 		buff.m_tmpData.clear();
 		return buff;
 	}
@@ -885,8 +4028,11 @@ namespace lc
 	// ================================
 
 	////////////////////////////////////////////////////////////////
-	Gnuplotpp::DataBuffer::DataBuffer(size_t cols) :
-		m_cols(cols)
+	Gnuplotpp::DataBuffer::DataBuffer(size_t cols, std::pmr::memory_resource* resource) :
+		m_cols(cols),
+		m_data(resource),
+		m_tmpData(resource),
+		m_blockEnds(resource)
 	{
 		assert(("cols must be > 0", cols > 0));
 	}
@@ -895,6 +4041,17 @@ namespace lc
 	//             DATA
 	// ================================
 
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::DataBuffer::reset(size_t cols)
+	{
+		assert(("cols must be > 0", cols > 0));
+
+		m_cols = cols;
+		m_data.clear();
+		m_tmpData.clear();
+		m_blockEnds.clear();
+	}
+
 	////////////////////////////////////////////////////////////////
 	void Gnuplotpp::DataBuffer::push_row(std::list<double> row)
 	{
@@ -917,37 +4074,287 @@ namespace lc
 	{
 		return f(*this);
 	}
-}
 
-std::ostream& operator<<(std::ostream& ostream, const lc::Gnuplotpp::DataBuffer& buffer)
-{
-	// we write data in the form:
-	// 0 1 2 3
-	// 4 5 6 10
+	////////////////////////////////////////////////////////////////
+	std::ostream& operator<<(std::ostream& ostream, const Gnuplotpp::DataBuffer& buffer)
+	{
+		// we write data in the form:
+		// 0 1 2 3
+		// 4 5 6 10
+		// no std::endl here: the whole block is flushed at once by the caller
+		std::string text;
+		_gnuplot_impl_::formatData(text, buffer);
+		ostream.write(text.data(), static_cast<std::streamsize>(text.size()));
+
+		return ostream;
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::ostream& operator<<(std::ostream& ostream, const Gnuplotpp::Color& color)
+	{
+		std::string text;
+		_gnuplot_impl_::CommandWriter os(text);
+		_gnuplot_impl_::writeColor(os, color);
+		ostream.write(text.data(), static_cast<std::streamsize>(text.size()));
+		return ostream;
+	}
+
+	// ================================================================
+	//                        GNUPLOT++ FIGURE
+	// ================================================================
+
+	// ================================
+	//             PANEL
+	// ================================
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::Panel::setTitle(std::optional<std::string> title)
+	{
+		m_changed |= (m_title != title);
+		m_title = std::move(title);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::Panel::xLabel(std::optional<std::string> label)
+	{
+		m_changed |= (m_xLabel != label);
+		m_xLabel = std::move(label);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::Panel::yLabel(std::optional<std::string> label)
+	{
+		m_changed |= (m_yLabel != label);
+		m_yLabel = std::move(label);
+	}
 
-	for (size_t i = 0; i < buffer.rows(); i++)
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::Panel::setPlots(const std::list<Plot2dRef>& plots)
 	{
-		for (size_t j = 0; j < buffer.cols(); j++)
+		if (plots.size() != m_series.size())
+		{
+			m_changed = true;
+			m_series.resize(plots.size());
+		}
+
+		size_t i = 0;
+		for (const Plot2dRef& ref : plots)
 		{
-			ostream << buffer.at(i, j);
-			if (j < buffer.cols() - 1)
-				ostream << "\t";
+			const Plot2dBase& plot = ref.get();
+			Series& series = m_series[i++];
+
+			PlotOptions options = plot.getOptions();
+			if (options.binary)
+				throw std::runtime_error("Figure: binary data (for example an Image) can not be kept in a datablock");
+
+			if (!series.pData || series.options != options)
+			{
+				// the line styles of the old options are released by draw()
+				series.options = std::move(options);
+				series.pSerializer.reset();
+				m_changed = true;
+			}
+
+			std::string data;
+			_gnuplot_impl_::formatData(data, plot.getData());
+
+			// the same data is not sent again
+			if (series.pData && *series.pData == data)
+				continue;
+
+			series.pData = std::make_shared<const std::string>(std::move(data));
+			series.sent = false;
 		}
-		ostream << std::endl;
 	}
 
-	return ostream;
-}
-std::ostream& operator<<(std::ostream& ostream, const lc::Gnuplotpp::Color& color)
-{
-	// TODO con std::format
-	ostream << std::hex
-		<< std::setw(2) << std::setfill('0') << (int)color.transparency
-		<< std::setw(2) << std::setfill('0') << (int)color.r
-		<< std::setw(2) << std::setfill('0') << (int)color.g
-		<< std::setw(2) << std::setfill('0') << (int)color.b
-		<< std::dec;
-	return ostream;
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::Panel::clear(void)
+	{
+		m_changed |= !m_series.empty();
+		m_series.clear();
+	}
+
+	////////////////////////////////////////////////////////////////
+	std::string Gnuplotpp::Figure::Panel::datablock(size_t i) const
+	{
+		return m_name + "_" + std::to_string(i);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::Panel::formatCommands(Gnuplotpp& gp)
+	{
+		m_commands.clear();
+		_gnuplot_impl_::CommandWriter ss(m_commands);
+
+		// the settings are shared by the panels, every panel sets all of them
+		auto setOrUnset = [&ss](const char* name, const std::optional<std::string>& value)
+		{
+			if (value)
+				ss << "set " << name << " \"" << value.value() << "\"\n";
+			else
+				ss << "unset " << name << "\n";
+		};
+		setOrUnset("title", m_title);
+		setOrUnset("xlabel", m_xLabel);
+		setOrUnset("ylabel", m_yLabel);
+
+		if (m_series.empty())
+		{
+			// leave the panel empty
+			ss << "set multiplot next\n";
+			return;
+		}
+
+		ss << "plot";
+		for (size_t i = 0; i < m_series.size(); i++)
+		{
+			Series& series = m_series[i];
+
+			// defines the line styles
+			if (!series.pSerializer)
+			{
+				series.pSerializer = std::make_unique<PlotOptionsSerializer>(series.options);
+				series.pSerializer->prepare(gp);
+			}
+
+			if (i > 0)
+				ss << ",";
+			ss << " " << this->datablock(i);
+			series.pSerializer->write(m_commands);
+		}
+		ss << "\n";
+	}
+
+	// ================================
+	//          CONSTRUCTORS
+	// ================================
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Figure::Figure(Gnuplotpp& gp, size_t rows, size_t cols) :
+		Figure(gp, rows, cols, Options{})
+	{
+		// empty
+	}
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Figure::Figure(Gnuplotpp& gp, size_t rows, size_t cols, Options options) :
+		m_gp(gp),
+		m_rows(rows),
+		m_cols(cols),
+		m_options(options),
+		m_session(gp.m_session)
+	{
+		if (rows == 0 || cols == 0)
+			throw std::runtime_error("Gnuplotpp::Figure: empty layout");
+
+		m_id = gp.m_figures++;
+		const std::string name = "$gnuplotpp_figure" + std::to_string(m_id);
+
+		m_panels.reserve(rows * cols);
+		for (size_t i = 0; i < rows * cols; i++)
+			m_panels.push_back(Panel(name + "_" + std::to_string(i)));
+	}
+
+	// ================================
+	//            PANELS
+	// ================================
+
+	////////////////////////////////////////////////////////////////
+	Gnuplotpp::Figure::Panel& Gnuplotpp::Figure::panel(size_t row, size_t col)
+	{
+		if (row >= m_rows || col >= m_cols)
+			throw std::out_of_range("Gnuplotpp::Figure::panel(): no such panel");
+
+		return m_panels[row * m_cols + col];
+	}
+
+	// ================================
+	//            DRAWING
+	// ================================
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::draw(void)
+	{
+		const auto begin = std::chrono::steady_clock::now();
+
+		auto& gp = m_gp;
+
+		// a session reset has deleted the datablocks and the line styles
+		if (m_session != gp.m_session)
+			this->invalidate();
+
+		// the line styles released by the panels
+		gp.beginFrame();
+
+		bool changed = !m_sent;
+		for (Panel& panel : m_panels)
+		{
+			if (panel.m_changed)
+			{
+				panel.formatCommands(gp);
+				panel.m_changed = false;
+				changed = true;
+			}
+
+			for (size_t i = 0; i < panel.m_series.size(); i++)
+			{
+				Panel::Series& series = panel.m_series[i];
+				if (series.sent)
+					continue;
+
+				gp << panel.datablock(i) << " << " << Datablock_EOD << std::endl;
+				gp.beginData();
+				gp.write(series.pData, series.pData->data(), series.pData->size());
+				gp << Datablock_EOD << std::endl;
+				gp.endData();
+
+				series.sent = true;
+			}
+
+			for (size_t i = panel.m_series.size(); i < panel.m_definedSeries; i++)
+				gp << "undefine " << panel.datablock(i) << std::endl;
+			panel.m_definedSeries = panel.m_series.size();
+		}
+
+		// gnuplot replays its last multiplot, it must be this one
+		if (!changed && m_options.remultiplot && gp.m_multiplotFigure == m_id)
+			gp << "remultiplot" << std::endl;
+		else
+		{
+			gp << "set multiplot layout " << m_rows << ", " << m_cols << std::endl;
+			for (const Panel& panel : m_panels)
+				gp.write(panel.m_commands.data(), panel.m_commands.size());
+			gp << "unset multiplot" << std::endl;
+		}
+
+		// the panels (replayed too) have changed the title and the labels, and
+		// the last plot gnuplot has is not the one of the last draw() anymore
+		gp.invalidateSessionState();
+		gp.m_multiplotFigure = m_id;
+
+		m_sent = true;
+		gp.finishFrame(begin);
+	}
+
+	////////////////////////////////////////////////////////////////
+	void Gnuplotpp::Figure::invalidate(void)
+	{
+		for (Panel& panel : m_panels)
+		{
+			// the line styles are defined again
+			for (Panel::Series& series : panel.m_series)
+			{
+				series.sent = false;
+				series.pSerializer.reset();
+			}
+
+			panel.m_definedSeries = 0;
+			panel.m_changed = true;
+		}
+
+		m_sent = false;
+		m_session = m_gp.m_session;
+	}
 }
 
 
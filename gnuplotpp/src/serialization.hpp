@@ -0,0 +1,265 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <istream>
+#include <concepts>
+
+// helpers to read and write the formats used by the library (commands, session
+// recordings, sidecar data files), they are not part of the public interface
+
+namespace lc::_gnuplot_impl_
+{
+	// ================================================================
+	//                            HASH
+	// ================================================================
+
+	// 64 bit FNV-1a hash
+	inline uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ull)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= static_cast<unsigned char>(data[i]);
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	// ================================================================
+	//                       LITTLE ENDIAN I/O
+	// ================================================================
+
+	// appends an unsigned LEB128 integer
+	inline void putVarint(std::string& out, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out += static_cast<char>((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		out += static_cast<char>(value);
+	}
+
+	// reads an unsigned LEB128 integer, returns false on EOF
+	inline bool getVarint(std::istream& in, uint64_t& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			const int c = in.get();
+			if (c == std::char_traits<char>::eof())
+				return false;
+			value |= static_cast<uint64_t>(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	inline uint64_t zigzag(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+	inline int64_t unzigzag(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+	template <class UInt>
+	inline void putLE(std::string& out, UInt value)
+	{
+		for (size_t i = 0; i < sizeof(UInt); i++)
+			out += static_cast<char>((value >> (8 * i)) & 0xff);
+	}
+
+	template <class UInt>
+	inline UInt getLE(const char* data)
+	{
+		UInt value = 0;
+		for (size_t i = 0; i < sizeof(UInt); i++)
+			value |= static_cast<UInt>(static_cast<unsigned char>(data[i])) << (8 * i);
+		return value;
+	}
+
+	// ================================================================
+	//                           VALUES
+	// ================================================================
+
+	// Writes a value the same way a default std::ostream does ("%g", precision 6)
+	template <class String>
+	inline void formatValue(String& out, double value)
+	{
+		char buff[32];
+		auto result = std::to_chars(buff, buff + sizeof(buff), value, std::chars_format::general, 6);
+		out.append(buff, result.ptr);
+	}
+
+	// ================================================================
+	//                           COMMANDS
+	// ================================================================
+
+	// Appends the text of gnuplot commands to a string. Numbers are written with
+	// std::to_chars, like a default std::ostream would do but without streams and
+	// locales: keep the string and clear it to reuse its memory.
+	// String is std::string or another std::basic_string<char> (std::pmr::string).
+	template <class String>
+	class BasicCommandWriter
+	{
+	public:
+		BasicCommandWriter(String& out) : m_out(out) {};
+
+		BasicCommandWriter& operator<<(std::string_view text) { m_out.append(text); return *this; };
+		BasicCommandWriter& operator<<(const char* text) { m_out.append(text); return *this; };
+		BasicCommandWriter& operator<<(char c) { m_out += c; return *this; };
+
+		BasicCommandWriter& operator<<(double value) { formatValue(m_out, value); return *this; };
+
+		template <std::integral Int>
+		requires (!std::same_as<Int, char> && !std::same_as<Int, bool>)
+		BasicCommandWriter& operator<<(Int value)
+		{
+			char buff[24];
+			auto result = std::to_chars(buff, buff + sizeof(buff), value);
+			m_out.append(buff, result.ptr);
+			return *this;
+		}
+
+		// two lowercase hexadecimal digits
+		BasicCommandWriter& hex(uint8_t value)
+		{
+			const char* digits = "0123456789abcdef";
+			m_out += digits[value >> 4];
+			m_out += digits[value & 0xf];
+			return *this;
+		}
+
+	private:
+		String& m_out;
+	};
+
+	using CommandWriter = BasicCommandWriter<std::string>;
+
+	// ================================================================
+	//                         TEXT TABLES
+	// ================================================================
+
+	// A text data block split into numeric values
+	struct Table
+	{
+		size_t rows = 0;
+		size_t cols = 0;
+
+		// row-major values
+		std::vector<double> values;
+
+		// what follows the last row (for example "EOD\n")
+		std::string terminator;
+	};
+
+	// Parses a data block as written by the library: rows of tab separated values
+	// formatted as by formatValue(), followed by an optional non numeric terminator
+	// line. Returns false if the block is not in this form, in particular if
+	// formatting back the parsed values would not give the same text.
+	inline bool parseTable(std::string_view text, Table& table)
+	{
+		table = {};
+
+		std::string formatted;
+		size_t begin = 0;
+		while (begin < text.size())
+		{
+			const size_t end = text.find('\n', begin);
+			if (end == std::string_view::npos)
+				return false;
+
+			const std::string_view line = text.substr(begin, end - begin);
+
+			// parse the row
+			size_t cols = 0;
+			bool numeric = !line.empty();
+			size_t tokenBegin = 0;
+			while (numeric && tokenBegin <= line.size())
+			{
+				size_t tokenEnd = line.find('\t', tokenBegin);
+				if (tokenEnd == std::string_view::npos)
+					tokenEnd = line.size();
+				const std::string_view token = line.substr(tokenBegin, tokenEnd - tokenBegin);
+
+				double value = 0;
+				auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+				formatted.clear();
+				if (result.ec == std::errc())
+					formatValue(formatted, value);
+				if (result.ec != std::errc() || formatted != token)
+					numeric = false;
+				else
+				{
+					table.values.push_back(value);
+					cols++;
+				}
+
+				tokenBegin = tokenEnd + 1;
+			}
+
+			if (!numeric)
+			{
+				// only the last line can be a terminator
+				if (end + 1 != text.size())
+					return false;
+				table.values.resize(table.rows * table.cols);
+				table.terminator = std::string(text.substr(begin));
+				return true;
+			}
+
+			if (table.rows == 0)
+				table.cols = cols;
+			else if (cols != table.cols)
+				return false;
+			table.rows++;
+
+			begin = end + 1;
+		}
+
+		return true;
+	}
+
+	// Tells if storing the values as float instead of double would give back the same text
+	inline bool formatsAsFloat32(const std::vector<double>& values)
+	{
+		std::string a, b;
+		for (const double v : values)
+		{
+			a.clear(); b.clear();
+			formatValue(a, v);
+			formatValue(b, static_cast<double>(static_cast<float>(v)));
+			if (a != b)
+				return false;
+		}
+		return true;
+	}
+
+	// Writes back a table in its original text form
+	inline void formatTable(std::string& out, const Table& table)
+	{
+		for (size_t i = 0; i < table.rows; i++)
+		{
+			for (size_t j = 0; j < table.cols; j++)
+			{
+				formatValue(out, table.values[i * table.cols + j]);
+				if (j < table.cols - 1)
+					out += '\t';
+			}
+			out += '\n';
+		}
+		out += table.terminator;
+	}
+}
@@ -0,0 +1,281 @@
+/* LC_NOTICE_BEGIN
+===============================================================================
+|                        Copyright (C) 2021 Luca Ciucci                       |
+|-----------------------------------------------------------------------------|
+| Important notices:                                                          |
+|  - This work is distributed under the MIT license, feel free to use this    |
+|   work as you wish.                                                         |
+|  - Read the license file for further info.                                  |
+| Written by Luca Ciucci <luca.ciucci99@gmail.com>, 2021                      |
+===============================================================================
+LC_NOTICE_END */
+
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <span>
+#include <algorithm>
+#include <numbers>
+#include <stdexcept>
+#include <limits>
+
+// numeric helpers of the plots that compute their data (densities, spectra,
+// ...), they are not part of the public interface
+
+namespace lc::_gnuplot_impl_
+{
+	// ================================================================
+	//                             FFT
+	// ================================================================
+
+	// the smallest power of two >= n
+	inline size_t nextPowerOfTwo(size_t n)
+	{
+		size_t p = 1;
+		while (p < n)
+			p <<= 1;
+		return p;
+	}
+
+	// In place iterative radix-2 FFT, the size must be a power of two.
+	// The inverse transform is not scaled (divide by the size).
+	inline void fft(std::vector<std::complex<double>>& a, bool inverse = false)
+	{
+		const size_t n = a.size();
+		if (n & (n - 1))
+			throw std::runtime_error("fft: the size must be a power of two");
+
+		// bit reversal permutation
+		for (size_t i = 1, j = 0; i < n; i++)
+		{
+			size_t bit = n >> 1;
+			for (; j & bit; bit >>= 1)
+				j ^= bit;
+			j ^= bit;
+
+			if (i < j)
+				std::swap(a[i], a[j]);
+		}
+
+		for (size_t len = 2; len <= n; len <<= 1)
+		{
+			const double angle = 2 * std::numbers::pi / len * (inverse ? 1 : -1);
+			const std::complex<double> wLen(std::cos(angle), std::sin(angle));
+
+			for (size_t i = 0; i < n; i += len)
+			{
+				std::complex<double> w(1);
+				for (size_t j = 0; j < len / 2; j++)
+				{
+					const std::complex<double> u = a[i + j];
+					const std::complex<double> v = a[i + j + len / 2] * w;
+					a[i + j] = u + v;
+					a[i + j + len / 2] = u - v;
+					w *= wLen;
+				}
+			}
+		}
+	}
+
+	// ================================================================
+	//                          QUANTILES
+	// ================================================================
+
+	// The quantile q (0 <= q <= 1) of some values, linearly interpolated
+	// between the closest ranks. The values are reordered.
+	inline double quantile(std::span<double> values, double q)
+	{
+		if (values.empty())
+			throw std::runtime_error("quantile: no values");
+
+		const double position = q * (values.size() - 1);
+		const size_t i = static_cast<size_t>(position);
+
+		std::nth_element(values.begin(), values.begin() + i, values.end());
+		const double lo = values[i];
+		if (i + 1 >= values.size())
+			return lo;
+
+		// the next value is the smallest of the ones after i
+		const double hi = *std::min_element(values.begin() + i + 1, values.end());
+		return lo + (hi - lo) * (position - i);
+	}
+
+	// Streaming estimate of a quantile with the P-square algorithm (Jain and
+	// Chlamtac, 1985): five markers (minimum, p/2, p, (1+p)/2, maximum) whose
+	// heights are adjusted with a parabola as the values are added.
+	// Constant memory, exact until five values.
+	class P2Quantile
+	{
+	public:
+
+		explicit P2Quantile(double p) :
+			m_p(p),
+			m_desired{ 0, 2 * p, 4 * p, 2 + 2 * p, 4 },
+			m_increment{ 0, p / 2, p, (1 + p) / 2, 1 }
+		{
+		}
+
+		void add(double x)
+		{
+			if (m_count < 5)
+			{
+				m_height[m_count++] = x;
+				if (m_count == 5)
+					std::sort(m_height, m_height + 5);
+				return;
+			}
+			m_count++;
+
+			// the cell of x, the extremes move with it
+			size_t k = 0;
+			if (x < m_height[0])
+				m_height[0] = x, k = 0;
+			else if (x >= m_height[4])
+				m_height[4] = x, k = 3;
+			else
+				while (x >= m_height[k + 1])
+					k++;
+
+			for (size_t i = k + 1; i < 5; i++)
+				m_position[i]++;
+			for (size_t i = 0; i < 5; i++)
+				m_desired[i] += m_increment[i];
+
+			// the middle markers too far from where they should be are moved by one
+			for (size_t i = 1; i < 4; i++)
+			{
+				const double d = m_desired[i] - m_position[i];
+				if ((d >= 1 && m_position[i + 1] - m_position[i] > 1) || (d <= -1 && m_position[i - 1] - m_position[i] < -1))
+				{
+					const double s = (d > 0) ? 1 : -1;
+
+					const double parabolic = m_height[i] + s / (m_position[i + 1] - m_position[i - 1]) * (
+						(m_position[i] - m_position[i - 1] + s) * (m_height[i + 1] - m_height[i]) / (m_position[i + 1] - m_position[i]) +
+						(m_position[i + 1] - m_position[i] - s) * (m_height[i] - m_height[i - 1]) / (m_position[i] - m_position[i - 1]));
+
+					if (m_height[i - 1] < parabolic && parabolic < m_height[i + 1])
+						m_height[i] = parabolic;
+					else
+					{
+						const size_t j = (s > 0) ? i + 1 : i - 1;
+						m_height[i] += s * (m_height[j] - m_height[i]) / (m_position[j] - m_position[i]);
+					}
+
+					m_position[i] += s;
+				}
+			}
+		}
+
+		// NaN if there are no values
+		double value(void) const
+		{
+			if (m_count == 0)
+				return std::numeric_limits<double>::quiet_NaN();
+
+			if (m_count >= 5)
+				return m_height[2];
+
+			double values[5];
+			std::copy(m_height, m_height + m_count, values);
+			return quantile(std::span<double>(values, m_count), m_p);
+		}
+
+	private:
+		double m_p;
+		size_t m_count = 0;
+
+		double m_height[5] = {};
+		double m_position[5] = { 0, 1, 2, 3, 4 };
+		double m_desired[5];
+		double m_increment[5];
+	};
+
+	// ================================================================
+	//                   KERNEL DENSITY ESTIMATION
+	// ================================================================
+
+	// Silverman's rule of thumb for a gaussian kernel:
+	// 0.9 * min(standard deviation, interquartile range / 1.34) * n^(-1/5)
+	inline double silvermanBandwidth(std::span<const double> samples)
+	{
+		const size_t n = samples.size();
+		if (n < 2)
+			return 1;
+
+		double mean = 0;
+		for (const double x : samples)
+			mean += x;
+		mean /= n;
+
+		double variance = 0;
+		for (const double x : samples)
+			variance += (x - mean) * (x - mean);
+		const double sd = std::sqrt(variance / (n - 1));
+
+		std::vector<double> copy(samples.begin(), samples.end());
+		const double iqr = quantile(copy, 0.75) - quantile(copy, 0.25);
+
+		double spread = std::min(sd, iqr / 1.34);
+		if (!(spread > 0))
+			spread = (sd > 0) ? sd : 1;
+
+		return 0.9 * spread * std::pow(double(n), -0.2);
+	}
+
+	// Gaussian kernel density of some samples on density.size() points evenly
+	// spaced from a to b (included). The samples are linearly binned on the
+	// points, then the bins are convolved with the kernel through the FFT:
+	// O(n + m log m) instead of O(n * m). The samples outside are ignored,
+	// the density is normalized on all the samples.
+	inline void kdeGrid(std::span<const double> samples, double bandwidth, double a, double b, std::vector<double>& density)
+	{
+		const size_t m = density.size();
+		if (m < 2 || !(b > a) || !(bandwidth > 0))
+			throw std::runtime_error("kde: invalid grid or bandwidth");
+
+		const double delta = (b - a) / (m - 1);
+
+		// the kernel is cut at 4 bandwidths
+		const size_t L = std::min(m - 1, static_cast<size_t>(std::ceil(4 * bandwidth / delta)));
+		const size_t P = nextPowerOfTwo(m + L);
+
+		std::vector<std::complex<double>> bins(P);
+		for (const double x : samples)
+		{
+			const double position = (x - a) / delta;
+
+			// outside (or NaN)
+			if (!(position >= 0 && position <= m - 1))
+				continue;
+
+			const size_t i = std::min(static_cast<size_t>(position), m - 2);
+			const double t = position - i;
+			bins[i] += 1 - t;
+			bins[i + 1] += t;
+		}
+
+		// centered on 0, the negative offsets wrap around
+		std::vector<std::complex<double>> kernel(P);
+		const double norm = 1 / (std::sqrt(2 * std::numbers::pi) * bandwidth * samples.size());
+		for (size_t j = 0; j <= L; j++)
+		{
+			const double u = j * delta / bandwidth;
+			const double k = norm * std::exp(-0.5 * u * u);
+			kernel[j] = k;
+			if (j > 0)
+				kernel[P - j] = k;
+		}
+
+		fft(bins);
+		fft(kernel);
+		for (size_t i = 0; i < P; i++)
+			bins[i] *= kernel[i];
+		fft(bins, true);
+
+		for (size_t i = 0; i < m; i++)
+			density[i] = std::max(0.0, bins[i].real() / P);
+	}
+}